@@ -0,0 +1,431 @@
+// Benchmarks parsing, graph construction and evaluation on synthetic models.
+//
+//   bench [--quick] [--shape NAME] [--json FILE] [--counters] [--trace FILE]
+//
+// Batch throughput is measured twice on the same rows: with the variables
+// as separate arrays (SoA) and as fields of an array of row structs bound
+// with a stride (AoS). The tile size is then compared on the SoA rows: a
+// row at a time, all rows at once (every instruction a pass over whole
+// columns) and the tile tune() picks, then in single and mixed precision on
+// the tuned tile, and in double on every instruction set the CPU has
+// kernels for; "isa" is the level picked at startup, which the others
+// ran with. A summary goes to stderr, results as JSON to stdout or
+// FILE. With --counters, hardware counters are read around each phase.
+// With --trace, the phases are written to FILE as a Chrome trace (open in
+// Perfetto).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include "../src/batch_evaluator.h"
+#include "../src/batch_kernels.h"
+#include "../src/evaluation.h"
+#include "../src/parser.h"
+#include "../src/perf_counters.h"
+#include "../src/pugixml.hpp"
+#include "../src/tracer.h"
+#include "model_generator.h"
+
+namespace {
+
+// Heap accounting for everything allocated through new and by pugixml.
+std::atomic<long long> g_live(0), g_peak(0);
+
+void Track(long long delta) {
+    auto live = g_live += delta;
+    auto peak = g_peak.load();
+    while (live > peak && !g_peak.compare_exchange_weak(peak, live)) {
+    }
+}
+
+void* Allocate(size_t size) {
+    auto data = std::malloc(size ? size : 1);
+    if (data) Track(malloc_usable_size(data));
+    return data;
+}
+
+void Deallocate(void* data) {
+    if (!data) return;
+    Track(-static_cast<long long>(malloc_usable_size(data)));
+    std::free(data);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+    auto data = Allocate(size);
+    if (!data) throw std::bad_alloc();
+    return data;
+}
+
+// Not inlined: GCC would pair the free() inside with the new expressions
+// of the caller and report a mismatched deallocation.
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+void operator delete(void* data) noexcept { Deallocate(data); }
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double Seconds(Clock::time_point start) {
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return elapsed.count();
+}
+
+struct Case {
+    std::string name;
+    std::function<ModelGenerator::Model(std::ostream&)> generate;
+};
+
+struct Result {
+    ModelGenerator::Model model;
+    size_t fileBytes = 0;
+    size_t nodes = 0;
+    double parseSeconds = 0;
+    double loadSeconds = 0;
+    long long graphBytes = 0;
+    long long peakLoadBytes = 0;
+    // What EvaluationContext::memoryUsage makes of graphBytes.
+    size_t estimatedGraphBytes = 0;
+    double calcMinNs = 0, calcMedianNs = 0, calcP99Ns = 0;
+    double modelEvaluationsPerSecond = 0;
+    // Hardware counts per phase; calc per call, model per evaluation.
+    PerfCounters::Sample parseCounters, loadCounters, calcCounters, modelCounters;
+    size_t calcCalls = 0, modelEvaluations = 0;
+    // BatchEvaluator on the output, variables as arrays and as row structs.
+    size_t batchRows = 0;
+    double batchSoaRowsPerSecond = 0, batchAosRowsPerSecond = 0;
+    size_t batchRegisters = 0, batchTileRows = 0;
+    double batchRowRowsPerSecond = 0, batchColumnRowsPerSecond = 0, batchTiledRowsPerSecond = 0;
+    double batchSingleRowsPerSecond = 0, batchMixedRowsPerSecond = 0;
+    // Largest relative deviation of the output from double.
+    double batchSingleDeviation = 0, batchMixedDeviation = 0;
+    std::string batchIsa;
+    std::vector<std::pair<std::string, double>> batchIsaRowsPerSecond;
+};
+
+// Null unless --counters was given.
+PerfCounters* g_counters = nullptr;
+
+PerfCounters::Sample ReadCounters() {
+    return g_counters ? g_counters->read() : PerfCounters::Sample();
+}
+
+Result Run(const Case& test, const std::string& directory) {
+    Result result;
+    auto fname = directory + "/" + test.name + ".xml";
+    {
+        std::ofstream out(fname.c_str());
+        result.model = test.generate(out);
+        result.fileBytes = out.tellp();
+    }
+
+    {
+        auto counters = ReadCounters();
+        auto start = Clock::now();
+        pugi::xml_document doc;
+        doc.load_file(fname.c_str());
+        result.parseSeconds = Seconds(start);
+        result.parseCounters = ReadCounters() - counters;
+    }
+
+    auto before = g_live.load();
+    g_peak = before;
+    auto counters = ReadCounters();
+    auto start = Clock::now();
+    auto context = EvaluationParser::CreateFromFile(fname);
+    result.loadSeconds = Seconds(start);
+    result.loadCounters = ReadCounters() - counters;
+    result.graphBytes = g_live - before;
+    result.peakLoadBytes = g_peak - before;
+    auto usage = context.memoryUsage();
+    for (auto count : usage.nodeCount) result.nodes += count;
+    result.estimatedGraphBytes = usage.total();
+    std::remove(fname.c_str());
+
+    for (size_t i = 0; i < result.model.variables.size(); ++i)
+        context.setVariable(result.model.variables[i], 0.5 + 1e-3 * (i % 100));
+
+    // Single calc latency.
+    volatile double sink = context.calc(result.model.output);
+    std::vector<double> latencies;
+    Tracer::Span calc("bench", "calc latency");
+    counters = ReadCounters();
+    auto budget = Clock::now();
+    while (latencies.size() < 100000 && (latencies.size() < 5 || Seconds(budget) < 0.2)) {
+        auto call = Clock::now();
+        sink = context.calc(result.model.output);
+        latencies.push_back(Seconds(call) * 1e9);
+    }
+    result.calcCounters = ReadCounters() - counters;
+    calc.end();
+    result.calcCalls = latencies.size();
+    std::sort(latencies.begin(), latencies.end());
+    result.calcMinNs = latencies.front();
+    result.calcMedianNs = latencies[latencies.size() / 2];
+    result.calcP99Ns = latencies[latencies.size() * 99 / 100];
+
+    // Whole model: every expression once.
+    size_t evaluations = 0;
+    EVALUATION_TRACE("bench", "model throughput");
+    counters = ReadCounters();
+    start = Clock::now();
+    do {
+        for (const auto& expression : context.expressions())
+            sink = expression->eval();
+        ++evaluations;
+    } while (Seconds(start) < 0.2);
+    result.modelEvaluationsPerSecond = evaluations / Seconds(start);
+    result.modelCounters = ReadCounters() - counters;
+    result.modelEvaluations = evaluations;
+    (void)sink;
+
+    // Batch: about 32 MB of inputs whatever the number of variables.
+    const auto& variables = result.model.variables;
+    const size_t width = std::max<size_t>(variables.size(), 1);
+    const size_t rows = std::min<size_t>(65536, std::max<size_t>(16, (4 << 20) / width));
+    std::vector<std::vector<double>> columns(variables.size(), std::vector<double>(rows));
+    std::vector<double> structs(rows * (width + 1)), results(rows);
+    for (size_t v = 0; v < variables.size(); ++v) {
+        for (size_t r = 0; r < rows; ++r) {
+            columns[v][r] = 0.5 + 1e-3 * ((v + r) % 100);
+            structs[r * (width + 1) + v] = columns[v][r];
+        }
+    }
+    BatchEvaluator batch(context, {result.model.output});
+    auto throughput = [&] {
+        size_t runs = 0;
+        auto start = Clock::now();
+        do {
+            batch.run(rows);
+            ++runs;
+        } while (Seconds(start) < 0.2);
+        return runs * rows / Seconds(start);
+    };
+    auto index = [&](const std::string& name) {
+        return std::find(variables.begin(), variables.end(), name) - variables.begin();
+    };
+    const auto stride = (width + 1) * sizeof(double);
+    {
+        EVALUATION_TRACE("bench", "batch soa");
+        for (const auto& name : batch.variables()) batch.bind(name, columns[index(name)].data());
+        batch.bindResult(result.model.output, results.data());
+        result.batchSoaRowsPerSecond = throughput();
+    }
+    {
+        EVALUATION_TRACE("bench", "batch aos");
+        for (const auto& name : batch.variables())
+            batch.bind(name, &structs[index(name)], stride);
+        // The result goes in the last field of each row.
+        batch.bindResult(result.model.output, &structs[width], stride);
+        result.batchAosRowsPerSecond = throughput();
+    }
+    {
+        EVALUATION_TRACE("bench", "batch tiles");
+        for (const auto& name : batch.variables()) batch.bind(name, columns[index(name)].data());
+        batch.bindResult(result.model.output, results.data());
+        batch.setTileRows(1);
+        result.batchRowRowsPerSecond = throughput();
+        batch.setTileRows(rows);
+        result.batchColumnRowsPerSecond = throughput();
+        result.batchTileRows = batch.tune(rows);
+        result.batchTiledRowsPerSecond = throughput();
+    }
+    {
+        EVALUATION_TRACE("bench", "batch precision");
+        batch.setPrecision(BatchEvaluator::Precision::Single);
+        result.batchSingleDeviation = batch.validate(rows)[0].maxRelative;
+        result.batchSingleRowsPerSecond = throughput();
+        batch.setPrecision(BatchEvaluator::Precision::Mixed);
+        result.batchMixedDeviation = batch.validate(rows)[0].maxRelative;
+        result.batchMixedRowsPerSecond = throughput();
+        batch.setPrecision(BatchEvaluator::Precision::Double);
+    }
+    {
+        EVALUATION_TRACE("bench", "batch isa");
+        result.batchIsa = batch.isa();
+        for (const auto& isa : BatchKernels::Available()) {
+            batch.setIsa(isa);
+            result.batchIsaRowsPerSecond.emplace_back(isa, throughput());
+        }
+        batch.setIsa(result.batchIsa);
+    }
+    result.batchRegisters = batch.registers();
+    result.batchRows = rows;
+    return result;
+}
+
+void WriteJson(std::ostream& out, const std::vector<Result>& results) {
+    out << "{\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto& r = results[i];
+        auto nodes = static_cast<double>(std::max<size_t>(r.nodes, 1));
+        out << (i ? "," : "") << "\n    {"
+            << "\"shape\": \"" << r.model.shape << "\", "
+            << "\"expressions\": " << r.model.expressions << ", "
+            << "\"nodes\": " << r.nodes << ", "
+            << "\"file_bytes\": " << r.fileBytes << ", "
+            << "\"parse_seconds\": " << r.parseSeconds << ", "
+            << "\"compile_seconds\": " << std::max(0.0, r.loadSeconds - r.parseSeconds) << ", "
+            << "\"load_seconds\": " << r.loadSeconds << ", "
+            << "\"bytes_per_node\": " << r.graphBytes / nodes << ", "
+            << "\"peak_load_bytes\": " << r.peakLoadBytes << ", "
+            << "\"estimated_graph_bytes\": " << r.estimatedGraphBytes << ", "
+            << "\"calc_min_ns\": " << r.calcMinNs << ", "
+            << "\"calc_median_ns\": " << r.calcMedianNs << ", "
+            << "\"calc_p99_ns\": " << r.calcP99Ns << ", "
+            << "\"model_evaluations_per_second\": " << r.modelEvaluationsPerSecond << ", "
+            << "\"expressions_per_second\": "
+            << r.modelEvaluationsPerSecond * r.model.expressions << ", "
+            << "\"batch_rows\": " << r.batchRows << ", "
+            << "\"batch_soa_rows_per_second\": " << r.batchSoaRowsPerSecond << ", "
+            << "\"batch_aos_rows_per_second\": " << r.batchAosRowsPerSecond << ", "
+            << "\"batch_registers\": " << r.batchRegisters << ", "
+            << "\"batch_tile_rows\": " << r.batchTileRows << ", "
+            << "\"batch_row_rows_per_second\": " << r.batchRowRowsPerSecond << ", "
+            << "\"batch_column_rows_per_second\": " << r.batchColumnRowsPerSecond << ", "
+            << "\"batch_tiled_rows_per_second\": " << r.batchTiledRowsPerSecond << ", "
+            << "\"batch_single_rows_per_second\": " << r.batchSingleRowsPerSecond << ", "
+            << "\"batch_single_max_relative_deviation\": " << r.batchSingleDeviation << ", "
+            << "\"batch_mixed_rows_per_second\": " << r.batchMixedRowsPerSecond << ", "
+            << "\"batch_mixed_max_relative_deviation\": " << r.batchMixedDeviation << ", "
+            << "\"isa\": \"" << r.batchIsa << "\", \"batch_isa_rows_per_second\": {";
+        for (size_t l = 0; l < r.batchIsaRowsPerSecond.size(); ++l)
+            out << (l ? ", " : "") << "\"" << r.batchIsaRowsPerSecond[l].first
+                << "\": " << r.batchIsaRowsPerSecond[l].second;
+        out << "}";
+        if (g_counters) {
+            auto evaluations = static_cast<double>(r.modelEvaluations);
+            out << ", \"counters\": {"
+                << "\"parse\": " << g_counters->json(r.parseCounters) << ", "
+                << "\"load\": " << g_counters->json(r.loadCounters) << ", "
+                << "\"per_calc\": " << g_counters->json(r.calcCounters, r.calcCalls) << ", "
+                << "\"per_model_evaluation\": "
+                << g_counters->json(r.modelCounters, evaluations) << ", "
+                << "\"per_node_evaluated\": "
+                << g_counters->json(r.modelCounters, evaluations * nodes) << "}";
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    bool quick = false, counters = false;
+    std::string shape, json, trace;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--quick") {
+            quick = true;
+        } else if (arg == "--shape" && i + 1 < argc) {
+            shape = argv[++i];
+        } else if (arg == "--json" && i + 1 < argc) {
+            json = argv[++i];
+        } else if (arg == "--counters") {
+            counters = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--quick] [--shape NAME] [--json FILE] [--counters]"
+                      << " [--trace FILE]"
+                      << std::endl;
+            return 1;
+        }
+    }
+    // pugixml goes through the heap accounting above; DocumentMemory is not
+    // installed, so the load peak of the contexts stays 0 here.
+    pugi::set_memory_management_functions(Allocate, Deallocate);
+    std::unique_ptr<PerfCounters> perf;
+    if (counters) {
+        perf.reset(new PerfCounters);
+        if (perf->available())
+            g_counters = perf.get();
+        else
+            std::cerr << "hardware counters unavailable, reporting timings only"
+                      << std::endl;
+    }
+
+    size_t scale = quick ? 1 : 10;
+    std::vector<Case> cases = {
+        {"chain", [&](std::ostream& out) { return ModelGenerator::Chain(out, 500 * scale); }},
+        {"wide", [&](std::ostream& out) { return ModelGenerator::Wide(out, 10000 * scale); }},
+        {"diamond", [&](std::ostream& out) {
+             return ModelGenerator::Diamond(out, quick ? 12 : 16, 16);
+         }},
+        {"transcendental", [&](std::ostream& out) {
+             return ModelGenerator::Transcendental(out, 10000 * scale);
+         }},
+        {"large", [&](std::ostream& out) { return ModelGenerator::Large(out, 100000 * scale); }},
+    };
+
+    char directory[] = "/tmp/evaluation-bench-XXXXXX";
+    if (!mkdtemp(directory)) {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    if (!trace.empty()) {
+        Tracer::NameThread("bench");
+        Tracer::Start();
+    }
+    std::vector<Result> results;
+    for (const auto& test : cases) {
+        if (!shape.empty() && shape != test.name) continue;
+        {
+            EVALUATION_TRACE("bench", Tracer::Intern(test.name));
+            results.push_back(Run(test, directory));
+        }
+        const auto& r = results.back();
+        std::fprintf(stderr,
+                     "%-15s %8zu expr %9zu nodes  parse %8.3fs  load %8.3fs  "
+                     "calc %10.0fns  %10.1f models/s  %6.1f B/node  "
+                     "batch soa %10.0f aos %10.0f rows/s\n"
+                     "%-15s %8zu regs %9zu tile  row %10.0f  column %10.0f  tiled %10.0f rows/s\n"
+                     "%-15s single %10.0f rows/s (%.1e)  mixed %10.0f rows/s (%.1e)\n",
+                     test.name.c_str(), r.model.expressions, r.nodes, r.parseSeconds,
+                     r.loadSeconds, r.calcMedianNs, r.modelEvaluationsPerSecond,
+                     r.graphBytes / static_cast<double>(std::max<size_t>(r.nodes, 1)),
+                     r.batchSoaRowsPerSecond, r.batchAosRowsPerSecond, "", r.batchRegisters,
+                     r.batchTileRows, r.batchRowRowsPerSecond, r.batchColumnRowsPerSecond,
+                     r.batchTiledRowsPerSecond, "", r.batchSingleRowsPerSecond,
+                     r.batchSingleDeviation, r.batchMixedRowsPerSecond, r.batchMixedDeviation);
+        std::fprintf(stderr, "%-15s isa %-7s", "", r.batchIsa.c_str());
+        for (const auto& level : r.batchIsaRowsPerSecond)
+            std::fprintf(stderr, "  %s %10.0f", level.first.c_str(), level.second);
+        std::fprintf(stderr, " rows/s\n");
+    }
+    rmdir(directory);
+    if (!trace.empty()) {
+        Tracer::Stop();
+        std::ofstream out(trace.c_str());
+        Tracer::Write(out);
+    }
+
+    if (json.empty()) {
+        WriteJson(std::cout, results);
+    } else {
+        std::ofstream out(json.c_str());
+        WriteJson(out, results);
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include "model_generator.h"
+#include <functional>
+
+namespace {
+
+std::string Name(const std::string &prefix, size_t i) {
+    return prefix + std::to_string(i);
+}
+
+std::string Variable(const std::string &name) {
+    return "<variable value=\"" + name + "\"/>";
+}
+
+std::string Constant(double value) {
+    return "<constant value=\"" + std::to_string(value) + "\"/>";
+}
+
+std::string Binary(const char *type, const std::string &left,
+                   const std::string &right) {
+    return std::string("<bin_op type=\"") + type + "\">" + left + right +
+           "</bin_op>";
+}
+
+std::string Unary(const char *type, const std::string &operand) {
+    return std::string("<un_op type=\"") + type + "\">" + operand + "</un_op>";
+}
+
+void Define(std::ostream &out, const std::string &name, const std::string &body) {
+    out << "<variable value=\"" << name << "\">" << body << "</variable>\n";
+}
+
+std::vector<std::string> Names(const std::string &prefix, size_t count) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < count; ++i) names.push_back(Name(prefix, i));
+    return names;
+}
+
+}  // namespace
+
+ModelGenerator::Model ModelGenerator::Chain(std::ostream &out, size_t length) {
+    Model model;
+    model.shape = "chain";
+    model.variables = {"x"};
+    out << "<root>\n";
+    Define(out, "E0", Binary("+", Variable("x"), Constant(1)));
+    for (size_t i = 1; i < length; ++i) {
+        Define(out, Name("E", i),
+               Binary("+", Binary("*", Variable(Name("E", i - 1)), Constant(0.999)),
+                      Variable("x")));
+    }
+    out << "</root>\n";
+    model.expressions = length;
+    model.output = Name("E", length - 1);
+    return model;
+}
+
+ModelGenerator::Model ModelGenerator::Wide(std::ostream &out, size_t width) {
+    Model model;
+    model.shape = "wide";
+    model.variables = Names("v", width);
+    std::function<std::string(size_t, size_t)> sum = [&](size_t begin,
+                                                         size_t end) {
+        if (end - begin == 1)
+            return Binary("*", Variable(model.variables[begin]),
+                          Constant(1.0 + begin % 7));
+        auto middle = begin + (end - begin) / 2;
+        return Binary("+", sum(begin, middle), sum(middle, end));
+    };
+    out << "<root>\n";
+    Define(out, "S", sum(0, width));
+    out << "</root>\n";
+    model.expressions = 1;
+    model.output = "S";
+    return model;
+}
+
+ModelGenerator::Model ModelGenerator::Diamond(std::ostream &out, size_t levels,
+                                              size_t width) {
+    Model model;
+    model.shape = "diamond";
+    model.variables = Names("x", width);
+    auto node = [](size_t level, size_t j) {
+        return "D" + std::to_string(level) + "_" + std::to_string(j);
+    };
+    out << "<root>\n";
+    for (size_t j = 0; j < width; ++j)
+        Define(out, node(0, j), Binary("+", Variable(model.variables[j]), Constant(1)));
+    for (size_t level = 1; level < levels; ++level) {
+        for (size_t j = 0; j < width; ++j) {
+            Define(out, node(level, j),
+                   Binary("+",
+                          Binary("*", Variable(node(level - 1, j)), Constant(0.5)),
+                          Binary("*", Variable(node(level - 1, (j + 1) % width)),
+                                 Constant(0.25))));
+        }
+    }
+    out << "</root>\n";
+    model.expressions = levels * width;
+    model.output = node(levels - 1, 0);
+    return model;
+}
+
+ModelGenerator::Model ModelGenerator::Transcendental(std::ostream &out,
+                                                     size_t count) {
+    Model model;
+    model.shape = "transcendental";
+    model.variables = {"x", "y"};
+    out << "<root>\n";
+    for (size_t i = 0; i < count; ++i) {
+        auto scale = Constant(1.0 + (i % 13) * 0.1);
+        Define(out, Name("T", i),
+               Binary("+",
+                      Unary("sin", Binary("*", Variable("x"), scale)),
+                      Binary("*", Unary("exp", Unary("cos", Variable("y"))),
+                             Unary("log", Binary("+", Constant(1),
+                                                 Binary("^", Variable("x"),
+                                                        Constant(2)))))));
+    }
+    out << "</root>\n";
+    model.expressions = count;
+    model.output = Name("T", count - 1);
+    return model;
+}
+
+ModelGenerator::Model ModelGenerator::Large(std::ostream &out, size_t count) {
+    Model model;
+    model.shape = "large";
+    model.variables = Names("v", 1000);
+    out << "<root>\n";
+    for (size_t i = 0; i < count; ++i) {
+        Define(out, Name("H", i),
+               Binary("+",
+                      Binary("*", Variable(model.variables[i % 1000]),
+                             Constant(1.0 + i % 11)),
+                      Variable(model.variables[(i * 7 + 3) % 1000])));
+    }
+    out << "</root>\n";
+    model.expressions = count;
+    model.output = Name("H", count - 1);
+    return model;
+}
@@ -0,0 +1,34 @@
+#ifndef MODEL_GENERATOR_H
+#define MODEL_GENERATOR_H
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//! Writes synthetic model files of known shape for benchmarking.
+class ModelGenerator {
+   public:
+    struct Model {
+        std::string shape;
+        //! The expression a single calc is timed on.
+        std::string output;
+        size_t expressions = 0;
+        //! Variables to set before evaluating.
+        std::vector<std::string> variables;
+    };
+
+    //! E_i = E_{i-1} * c + x: evaluation depth grows with the length.
+    static Model Chain(std::ostream& out, size_t length);
+    //! One sum over `width` scaled variables, as a balanced tree.
+    static Model Wide(std::ostream& out, size_t width);
+    //! Layers of expressions each using two of the previous layer: a calc
+    //! of the last layer revisits shared nodes 2^levels times.
+    static Model Diamond(std::ostream& out, size_t levels, size_t width);
+    //! Independent expressions mixing exp, log, sin and cos.
+    static Model Transcendental(std::ostream& out, size_t count);
+    //! Many small independent expressions over a pool of variables.
+    static Model Large(std::ostream& out, size_t count);
+};
+
+#endif
@@ -0,0 +1,303 @@
+#include "aggregate.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include "batch_evaluator.h"
+#include "number_text.h"
+
+namespace {
+
+const double Pi = 3.14159265358979323846;
+const double NaN = std::numeric_limits<double>::quiet_NaN();
+
+bool Larger(const Aggregate::Entry& a, const Aggregate::Entry& b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+}  // namespace
+
+TDigest::TDigest(double compression)
+    : d_compression(compression),
+      d_bufferSize(static_cast<size_t>(5 * compression)),
+      d_min(std::numeric_limits<double>::infinity()),
+      d_max(-std::numeric_limits<double>::infinity()) {
+    if (!(compression >= 10)) throw std::runtime_error("t-digest compression below 10");
+    d_buffer.reserve(d_bufferSize);
+}
+
+void TDigest::add(double value, double weight) {
+    d_buffer.push_back({value, weight});
+    d_count += weight;
+    d_min = std::min(d_min, value);
+    d_max = std::max(d_max, value);
+    if (d_buffer.size() >= d_bufferSize) compress();
+}
+
+void TDigest::merge(const TDigest& other) {
+    for (const auto& centroid : other.d_centroids) d_buffer.push_back(centroid);
+    for (const auto& centroid : other.d_buffer) d_buffer.push_back(centroid);
+    d_count += other.d_count;
+    d_min = std::min(d_min, other.d_min);
+    d_max = std::max(d_max, other.d_max);
+    compress();
+}
+
+void TDigest::compress() {
+    if (d_buffer.empty()) return;
+    d_buffer.insert(d_buffer.end(), d_centroids.begin(), d_centroids.end());
+    std::sort(d_buffer.begin(), d_buffer.end());
+    d_centroids.clear();
+
+    // k(q) = compression / 2pi * asin(2q - 1): a centroid spans at most one
+    // unit of k, so centroids shrink towards both tails.
+    auto scale = [this](double q) { return d_compression / (2 * Pi) * std::asin(2 * q - 1); };
+    auto limit = [this](double k) {
+        if (k >= d_compression / 4) return 1.0;
+        return (std::sin(k * 2 * Pi / d_compression) + 1) / 2;
+    };
+    double total = 0;
+    for (const auto& centroid : d_buffer) total += centroid.weight;
+    double before = 0;
+    double bound = total * limit(scale(0) + 1);
+    auto current = d_buffer.front();
+    for (size_t i = 1; i < d_buffer.size(); ++i) {
+        const auto& next = d_buffer[i];
+        if (before + current.weight + next.weight <= bound) {
+            current.weight += next.weight;
+            current.mean += (next.mean - current.mean) * next.weight / current.weight;
+            continue;
+        }
+        before += current.weight;
+        bound = total * limit(scale(before / total) + 1);
+        d_centroids.push_back(current);
+        current = next;
+    }
+    d_centroids.push_back(current);
+    d_buffer.clear();
+}
+
+size_t TDigest::centroids() {
+    compress();
+    return d_centroids.size();
+}
+
+double TDigest::quantile(double q) {
+    compress();
+    if (d_centroids.empty()) return NaN;
+    if (q <= 0) return d_min;
+    if (q >= 1) return d_max;
+    if (d_centroids.size() == 1) return d_centroids[0].mean;
+    // Centroid means sit at the middle of their weight; interpolate between
+    // them, and between the extremes and the outer centroids.
+    double rank = q * d_count;
+    double left = d_centroids[0].weight / 2;
+    if (rank < left)
+        return d_min + (d_centroids[0].mean - d_min) * rank / left;
+    for (size_t i = 0; i + 1 < d_centroids.size(); ++i) {
+        double right = left + (d_centroids[i].weight + d_centroids[i + 1].weight) / 2;
+        if (rank < right) {
+            double t = (rank - left) / (right - left);
+            return d_centroids[i].mean + t * (d_centroids[i + 1].mean - d_centroids[i].mean);
+        }
+        left = right;
+    }
+    double tail = d_count - left;
+    const auto& last = d_centroids.back();
+    return tail > 0 ? last.mean + (d_max - last.mean) * (rank - left) / tail : d_max;
+}
+
+Aggregate::Aggregate() : Aggregate(Spec()) {}
+
+Aggregate::Aggregate(const Spec& spec)
+    : d_spec(spec),
+      d_min(std::numeric_limits<double>::infinity()),
+      d_max(-std::numeric_limits<double>::infinity()),
+      d_bins(spec.bins),
+      d_digest(spec.compression > 0 ? spec.compression : 10) {
+    if (spec.bins && !(spec.high > spec.low))
+        throw std::runtime_error("Histogram needs low < high");
+}
+
+void Aggregate::keep(const Entry& entry) {
+    if (d_top.size() < d_spec.top) {
+        d_top.push_back(entry);
+        std::push_heap(d_top.begin(), d_top.end(), Larger);
+    } else if (Larger(entry, d_top.front())) {
+        std::pop_heap(d_top.begin(), d_top.end(), Larger);
+        d_top.back() = entry;
+        std::push_heap(d_top.begin(), d_top.end(), Larger);
+    }
+}
+
+void Aggregate::add(const double* values, size_t rows, uint64_t firstRow) {
+    // Two passes over the block: its own mean and M2, then Chan's update.
+    uint64_t count = 0;
+    double sum = 0, low = d_min, high = d_max;
+    for (size_t i = 0; i < rows; ++i) {
+        if (values[i] != values[i]) continue;
+        ++count;
+        sum += values[i];
+        low = values[i] < low ? values[i] : low;
+        high = values[i] > high ? values[i] : high;
+    }
+    d_nans += rows - count;
+    if (!count) return;
+    double mean = sum / count, m2 = 0;
+    for (size_t i = 0; i < rows; ++i) {
+        if (values[i] != values[i]) continue;
+        double delta = values[i] - mean;
+        m2 += delta * delta;
+    }
+    double delta = mean - d_mean;
+    double total = static_cast<double>(d_count + count);
+    d_m2 += m2 + delta * delta * d_count * count / total;
+    d_mean += delta * count / total;
+    d_count += count;
+    d_min = low;
+    d_max = high;
+
+    if (d_spec.bins) {
+        double width = (d_spec.high - d_spec.low) / d_spec.bins;
+        for (size_t i = 0; i < rows; ++i) {
+            double value = values[i];
+            if (value != value) continue;
+            if (value < d_spec.low) {
+                ++d_under;
+            } else if (value >= d_spec.high) {
+                ++d_over;
+            } else {
+                auto bin = static_cast<size_t>((value - d_spec.low) / width);
+                ++d_bins[std::min(bin, d_spec.bins - 1)];
+            }
+        }
+    }
+    if (d_spec.compression > 0) {
+        for (size_t i = 0; i < rows; ++i)
+            if (values[i] == values[i]) d_digest.add(values[i]);
+    }
+    if (d_spec.top) {
+        for (size_t i = 0; i < rows; ++i)
+            if (values[i] == values[i]) keep(Entry(values[i], firstRow + i));
+    }
+}
+
+void Aggregate::merge(const Aggregate& other) {
+    d_nans += other.d_nans;
+    if (other.d_count) {
+        double delta = other.d_mean - d_mean;
+        double total = static_cast<double>(d_count + other.d_count);
+        d_m2 += other.d_m2 + delta * delta * d_count * other.d_count / total;
+        d_mean += delta * other.d_count / total;
+        d_count += other.d_count;
+        d_min = std::min(d_min, other.d_min);
+        d_max = std::max(d_max, other.d_max);
+    }
+    if (d_spec.bins && d_spec.bins == other.d_spec.bins) {
+        for (size_t b = 0; b < d_bins.size(); ++b) d_bins[b] += other.d_bins[b];
+        d_under += other.d_under;
+        d_over += other.d_over;
+    }
+    if (d_spec.compression > 0 && other.d_spec.compression > 0) d_digest.merge(other.d_digest);
+    for (const auto& entry : other.d_top) keep(entry);
+}
+
+double Aggregate::mean() const { return d_count ? d_mean : NaN; }
+
+double Aggregate::variance() const { return d_count > 1 ? d_m2 / (d_count - 1) : NaN; }
+
+double Aggregate::min() const { return d_count ? d_min : NaN; }
+
+double Aggregate::max() const { return d_count ? d_max : NaN; }
+
+double Aggregate::quantile(double q) {
+    return d_spec.compression > 0 ? d_digest.quantile(q) : NaN;
+}
+
+std::vector<Aggregate::Entry> Aggregate::top() const {
+    auto entries = d_top;
+    std::sort(entries.begin(), entries.end(), Larger);
+    return entries;
+}
+
+void Aggregate::write(std::ostream& out) {
+    out << "{\"count\": " << d_count << ", \"nan\": " << d_nans
+        << ", \"mean\": " << NumberText::Json(mean())
+        << ", \"variance\": " << NumberText::Json(variance())
+        << ", \"min\": " << NumberText::Json(min()) << ", \"max\": " << NumberText::Json(max());
+    if (d_spec.bins) {
+        out << ", \"histogram\": {\"low\": " << NumberText::Json(d_spec.low)
+            << ", \"high\": " << NumberText::Json(d_spec.high) << ", \"under\": " << d_under
+            << ", \"over\": " << d_over << ", \"counts\": [";
+        for (size_t b = 0; b < d_bins.size(); ++b) out << (b ? ", " : "") << d_bins[b];
+        out << "]}";
+    }
+    if (d_spec.compression > 0) {
+        static const double levels[] = {0.001, 0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99, 0.999};
+        out << ", \"quantiles\": {";
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); ++l) {
+            char name[16];
+            std::snprintf(name, sizeof(name), "%g", levels[l]);
+            out << (l ? ", " : "") << "\"" << name
+                << "\": " << NumberText::Json(quantile(levels[l]));
+        }
+        out << "}";
+    }
+    if (d_spec.top) {
+        out << ", \"top\": [";
+        auto entries = top();
+        for (size_t e = 0; e < entries.size(); ++e)
+            out << (e ? ", " : "") << "{\"row\": " << entries[e].second
+                << ", \"value\": " << NumberText::Json(entries[e].first) << "}";
+        out << "]";
+    }
+    out << "}";
+}
+
+std::vector<Aggregate> Aggregate::Evaluate(EvaluationContext& context,
+                                           const std::vector<std::string>& outputs,
+                                           const Spec& spec,
+                                           const std::function<void(BatchEvaluator&)>& bind,
+                                           size_t rows, size_t threads) {
+    threads = std::max<size_t>(1, std::min(threads, rows / BatchEvaluator::BlockRows + 1));
+    // Evaluators are built up front: building reads the maps of the context.
+    std::vector<std::unique_ptr<BatchEvaluator>> evaluators;
+    std::vector<std::vector<Aggregate>> partial(
+        threads, std::vector<Aggregate>(outputs.size(), Aggregate(spec)));
+    for (size_t t = 0; t < threads; ++t) {
+        evaluators.emplace_back(new BatchEvaluator(context, outputs));
+        bind(*evaluators.back());
+        for (size_t o = 0; o < outputs.size(); ++o)
+            evaluators.back()->bindAggregate(outputs[o], &partial[t][o]);
+    }
+
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    // Whole blocks per thread, the remainder to the last one.
+    size_t share = rows / threads / BatchEvaluator::BlockRows * BatchEvaluator::BlockRows;
+    for (size_t t = 0; t < threads; ++t) {
+        size_t first = t * share;
+        size_t count = t + 1 == threads ? rows - first : share;
+        auto work = [&, t, first, count] {
+            try {
+                evaluators[t]->run(first, count);
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        };
+        if (t + 1 == threads)
+            work();
+        else
+            workers.emplace_back(work);
+    }
+    for (auto& worker : workers) worker.join();
+    for (const auto& error : errors)
+        if (error) std::rethrow_exception(error);
+    for (size_t t = 1; t < threads; ++t)
+        for (size_t o = 0; o < outputs.size(); ++o) partial[0][o].merge(partial[t][o]);
+    return partial[0];
+}
@@ -0,0 +1,123 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+class BatchEvaluator;
+class EvaluationContext;
+
+//! Quantile sketch of a stream of values (merging t-digest).
+/*!
+  Values are buffered and folded into at most about `compression`
+  centroids with the arcsine scale function, which keeps centroids small
+  at both tails: quantiles near 0 and 1 are accurate to a few parts per
+  million of rank, the median to about 1/compression. Memory does not
+  grow with the number of values, and digests of disjoint streams merge.
+*/
+class TDigest {
+    struct Centroid {
+        double mean;
+        double weight;
+        bool operator<(const Centroid& other) const { return mean < other.mean; }
+    };
+    double d_compression;
+    size_t d_bufferSize;
+    std::vector<Centroid> d_centroids;
+    std::vector<Centroid> d_buffer;
+    double d_count = 0;
+    double d_min, d_max;
+
+    void compress();
+
+   public:
+    explicit TDigest(double compression = 100);
+    void add(double value, double weight = 1);
+    void merge(const TDigest& other);
+    double count() const { return d_count; }
+    //! Value at rank `q` in [0, 1]; NaN when empty.
+    double quantile(double q);
+    size_t centroids();
+};
+
+//! Statistics of a stream of values, in constant memory.
+/*!
+  Count, mean and variance (per block with two passes, combined with
+  Chan's update so that blocks and threads merge exactly), minimum and
+  maximum, and optionally an equal-width histogram, a t-digest for
+  quantiles and the largest values with the id of their row. NaNs are
+  counted apart and left out of everything else.
+*/
+class Aggregate {
+   public:
+    struct Spec {
+        //! Equal-width bins over [low, high), with under and overflow; 0 for none.
+        size_t bins = 0;
+        double low = 0;
+        double high = 0;
+        //! t-digest compression; 0 for no quantiles.
+        double compression = 0;
+        //! Largest values kept with their row id; 0 for none.
+        size_t top = 0;
+    };
+    using Entry = std::pair<double, uint64_t>;
+
+   private:
+    Spec d_spec;
+    uint64_t d_count = 0;
+    uint64_t d_nans = 0;
+    double d_mean = 0;
+    double d_m2 = 0;
+    double d_min, d_max;
+    std::vector<uint64_t> d_bins;
+    uint64_t d_under = 0, d_over = 0;
+    TDigest d_digest;
+    // Min-heap of the largest values: the smallest kept on top.
+    std::vector<Entry> d_top;
+
+    void keep(const Entry& entry);
+
+   public:
+    Aggregate();
+    explicit Aggregate(const Spec& spec);
+
+    //! Adds values[i] as row `firstRow` + i.
+    void add(const double* values, size_t rows, uint64_t firstRow = 0);
+    void merge(const Aggregate& other);
+
+    const Spec& spec() const { return d_spec; }
+    uint64_t count() const { return d_count; }
+    uint64_t nans() const { return d_nans; }
+    double mean() const;
+    //! Sample variance, NaN below two values.
+    double variance() const;
+    double min() const;
+    double max() const;
+    const std::vector<uint64_t>& histogram() const { return d_bins; }
+    uint64_t underflow() const { return d_under; }
+    uint64_t overflow() const { return d_over; }
+    //! NaN without a digest.
+    double quantile(double q);
+    //! Largest values first, ties by lowest row.
+    std::vector<Entry> top() const;
+    //! JSON object with everything the spec asked for.
+    void write(std::ostream& out);
+
+    //! Aggregates of `outputs` over `rows` rows, split across `threads`.
+    /*!
+      Every thread gets a BatchEvaluator of its own, which `bind` binds to
+      the inputs; each evaluates a contiguous range of rows into its own
+      aggregates, and the ranges are merged in order at the end.
+    */
+    static std::vector<Aggregate> Evaluate(EvaluationContext& context,
+                                           const std::vector<std::string>& outputs,
+                                           const Spec& spec,
+                                           const std::function<void(BatchEvaluator&)>& bind,
+                                           size_t rows, size_t threads);
+};
+
+#endif
@@ -0,0 +1,545 @@
+#include "batch_evaluator.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#include "latency_stats.h"
+#include "parser.h"
+#include "tracer.h"
+
+namespace {
+
+size_t CacheBytes() {
+    long bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    return bytes > 0 ? static_cast<size_t>(bytes) : size_t(256) << 10;
+}
+
+// Unwraps expressions down to the node that computes them.
+const EvalNode* Body(const EvalNode* node) {
+    while (node->kind() == EvalNode::Kind::Expression)
+        node = static_cast<const ExpressionNode*>(node)->expression().get();
+    return node;
+}
+
+// Rows `stride` bytes apart, converted to the type of the register.
+template <class T, class U>
+void Gather(const void* column, size_t stride, size_t rows, U* out) {
+    auto base = static_cast<const char*>(column);
+    if (stride == sizeof(T)) {
+        std::copy(reinterpret_cast<const T*>(base), reinterpret_cast<const T*>(base) + rows, out);
+        return;
+    }
+    // Four independent loads an iteration keep several cache misses in flight.
+    size_t i = 0;
+    for (; i + 4 <= rows; i += 4) {
+        auto a = *reinterpret_cast<const T*>(base + i * stride);
+        auto b = *reinterpret_cast<const T*>(base + (i + 1) * stride);
+        auto c = *reinterpret_cast<const T*>(base + (i + 2) * stride);
+        auto d = *reinterpret_cast<const T*>(base + (i + 3) * stride);
+        out[i] = a;
+        out[i + 1] = b;
+        out[i + 2] = c;
+        out[i + 3] = d;
+    }
+    for (; i < rows; ++i) out[i] = *reinterpret_cast<const T*>(base + i * stride);
+}
+
+// The reverse of Gather.
+template <class T, class U>
+void Scatter(const U* values, size_t rows, void* column, size_t stride) {
+    auto base = static_cast<char*>(column);
+    if (stride == sizeof(T)) {
+        auto out = reinterpret_cast<T*>(base);
+        for (size_t i = 0; i < rows; ++i) out[i] = static_cast<T>(values[i]);
+        return;
+    }
+    for (size_t i = 0; i < rows; ++i)
+        *reinterpret_cast<T*>(base + i * stride) = static_cast<T>(values[i]);
+}
+
+}  // namespace
+
+const size_t BatchEvaluator::BlockRows;
+const size_t BatchEvaluator::MaxTileRows;
+
+BatchEvaluator::BatchEvaluator(EvaluationContext& context,
+                               const std::vector<std::string>& outputs)
+    : BatchEvaluator(context, outputs, true) {}
+
+BatchEvaluator::BatchEvaluator(EvaluationContext& context,
+                               const std::vector<std::string>& outputs, bool reuse)
+    : d_kernels(&BatchKernels::Get()) {
+    std::unordered_map<const EvalNode*, size_t> slots;
+    // Equal constants, by bit pattern, share a slot.
+    std::unordered_map<uint64_t, size_t> constants;
+    size_t count = 0;
+    auto slotOf = [&](const EvalNode::Ptr& node) { return slots.at(Body(node.get())); };
+
+    // Post-order walk without recursion: models can be deep chains.
+    std::vector<std::pair<const EvalNode*, bool>> stack;
+    for (const auto& name : outputs) {
+        if (!context.isKnownExpression(name))
+            throw std::runtime_error("Unknown expression " + name);
+        auto root = context.getExpression(name);
+        stack.emplace_back(Body(root.get()), false);
+        while (!stack.empty()) {
+            auto node = stack.back().first;
+            if (slots.count(node)) {
+                stack.pop_back();
+                continue;
+            }
+            auto kind = node->kind();
+            if (!stack.back().second && kind == EvalNode::Kind::UnaryOperator) {
+                stack.back().second = true;
+                auto unary = static_cast<const UnaryOperatorNode*>(node);
+                stack.emplace_back(Body(unary->operand().get()), false);
+                continue;
+            }
+            if (!stack.back().second && kind == EvalNode::Kind::BinaryOperator) {
+                stack.back().second = true;
+                auto binary = static_cast<const BinaryOperatorNode*>(node);
+                stack.emplace_back(Body(binary->right().get()), false);
+                stack.emplace_back(Body(binary->left().get()), false);
+                continue;
+            }
+            stack.pop_back();
+            uint64_t bits = 0;
+            if (kind == EvalNode::Kind::Constant) {
+                double value = static_cast<const ConstantNode*>(node)->value();
+                std::memcpy(&bits, &value, sizeof(bits));
+                auto known = constants.find(bits);
+                if (known != constants.end()) {
+                    slots[node] = known->second;
+                    continue;
+                }
+            }
+            auto slot = count++;
+            slots[node] = slot;
+
+            if (kind == EvalNode::Kind::Constant) {
+                constants[bits] = slot;
+                d_constants.emplace_back(slot, static_cast<const ConstantNode*>(node)->value());
+            } else if (kind == EvalNode::Kind::Variable) {
+                auto variable = const_cast<VariableNode*>(static_cast<const VariableNode*>(node));
+                Input input;
+                input.name = variable->name();
+                input.variable = variable;
+                input.slot = slot;
+                d_inputs.push_back(input);
+            } else if (kind == EvalNode::Kind::UnaryOperator) {
+                auto unary = static_cast<const UnaryOperatorNode*>(node);
+                const auto& type = unary->type();
+                Instruction instruction{Op::Unary, slot, slotOf(unary->operand()), 0, nullptr,
+                                        nullptr, false, false, false};
+                if (type == "-") instruction.op = Op::Negate;
+                else if (type == "cos") instruction.op = Op::Cos;
+                else if (type == "sin") instruction.op = Op::Sin;
+                else if (type == "exp") instruction.op = Op::Exp;
+                else if (type == "log") instruction.op = Op::Log;
+                else instruction.unary = EvaluationParser::GetUnaryFunction(type);
+                d_program.push_back(instruction);
+            } else {
+                auto binary = static_cast<const BinaryOperatorNode*>(node);
+                const auto& type = binary->type();
+                Instruction instruction{Op::Binary, slot, slotOf(binary->left()),
+                                        slotOf(binary->right()), nullptr, nullptr,
+                                        false, false, false};
+                if (type == "+") instruction.op = Op::Add;
+                else if (type == "-") instruction.op = Op::Subtract;
+                else if (type == "*") instruction.op = Op::Multiply;
+                else if (type == "/") instruction.op = Op::Divide;
+                else if (type == "max") instruction.op = Op::Max;
+                else if (type == "min") instruction.op = Op::Min;
+                else if (type == "^") instruction.op = Op::Power;
+                else instruction.binary = EvaluationParser::GetBinaryFunction(type);
+                d_program.push_back(instruction);
+            }
+        }
+        Output output;
+        output.name = name;
+        output.slot = slotOf(root);
+        d_outputs.push_back(output);
+    }
+    std::sort(d_inputs.begin(), d_inputs.end(),
+              [](const Input& a, const Input& b) { return a.name < b.name; });
+
+    d_sources.resize(count);
+    if (reuse) allocate();
+    // Registers within half of L2, in tiles of 16 to MaxTileRows rows.
+    // Inputs are mostly read in place and left out.
+    size_t budget = CacheBytes() / 2 / sizeof(double) / working();
+    size_t tile = 16;
+    while (tile * 2 <= std::min(budget, MaxTileRows)) tile *= 2;
+    setTileRows(tile);
+}
+
+void BatchEvaluator::allocate() {
+    // Slots the program reads after the last instruction, or before the
+    // first, keep registers of their own.
+    const size_t none = static_cast<size_t>(-1);
+    std::vector<size_t> last(d_sources.size(), 0), physical(d_sources.size(), none);
+    std::vector<bool> pinned(d_sources.size(), false);
+    size_t count = 0;
+    for (const auto& constant : d_constants) pinned[constant.first] = true;
+    for (const auto& input : d_inputs) pinned[input.slot] = true;
+    for (const auto& output : d_outputs) pinned[output.slot] = true;
+    for (size_t s = 0; s < pinned.size(); ++s)
+        if (pinned[s]) physical[s] = count++;
+    auto unary = [](Op op) { return op <= Op::Unary; };
+    for (size_t i = 0; i < d_program.size(); ++i) {
+        last[d_program[i].left] = i;
+        if (!unary(d_program[i].op)) last[d_program[i].right] = i;
+    }
+    // Linear scan: an instruction gets a free register, then frees those
+    // of the operands it read last. The result never shares a register
+    // with an operand, which would stop the kernels from vectorizing.
+    std::vector<size_t> free;
+    for (size_t i = 0; i < d_program.size(); ++i) {
+        auto& instruction = d_program[i];
+        if (physical[instruction.out] == none) {
+            if (free.empty()) {
+                physical[instruction.out] = count++;
+            } else {
+                physical[instruction.out] = free.back();
+                free.pop_back();
+            }
+        }
+        size_t operands[2] = {instruction.left, instruction.right};
+        for (size_t o = 0; o < (unary(instruction.op) ? 1u : 2u); ++o) {
+            auto s = operands[o];
+            if (pinned[s] || last[s] != i || (o == 1 && s == operands[0])) continue;
+            free.push_back(physical[s]);
+        }
+        instruction.out = physical[instruction.out];
+        instruction.left = physical[instruction.left];
+        if (!unary(instruction.op)) instruction.right = physical[instruction.right];
+    }
+    for (auto& constant : d_constants) constant.first = physical[constant.first];
+    for (auto& input : d_inputs) input.slot = physical[input.slot];
+    for (auto& output : d_outputs) output.slot = physical[output.slot];
+    d_sources.assign(count, nullptr);
+}
+
+void BatchEvaluator::setTileRows(size_t rows) {
+    if (!rows) throw std::runtime_error("Tiles need at least one row");
+    d_tileRows = rows;
+    d_registers.assign(d_sources.size() * rows, 0);
+    for (size_t s = 0; s < d_sources.size(); ++s) d_sources[s] = slot(s);
+    for (const auto& constant : d_constants)
+        std::fill_n(slot(constant.first), rows, constant.second);
+    if (d_precision == Precision::Double) {
+        d_singles.clear();
+        d_singleScratch.clear();
+        d_doubleScratch.clear();
+        return;
+    }
+    d_singles.assign(d_sources.size() * rows, 0);
+    d_singleScratch.assign(2 * rows, 0);
+    d_doubleScratch.assign(2 * rows, 0);
+    for (const auto& constant : d_constants)
+        std::fill_n(single(constant.first), rows, static_cast<float>(constant.second));
+}
+
+void BatchEvaluator::setPrecision(Precision precision) {
+    d_precision = precision;
+    // What each register holds as the program runs: inputs are floats
+    // outside Double precision, constants are both and read as needed.
+    std::vector<bool> holds(d_sources.size(), false), constant(d_sources.size(), false);
+    for (const auto& c : d_constants) constant[c.first] = true;
+    for (auto& input : d_inputs) holds[input.slot] = input.single = precision != Precision::Double;
+    for (auto& instruction : d_program) {
+        bool sum = instruction.op == Op::Add || instruction.op == Op::Subtract;
+        instruction.single =
+            precision == Precision::Single || (precision == Precision::Mixed && !sum);
+        instruction.leftSingle =
+            constant[instruction.left] ? instruction.single : holds[instruction.left];
+        instruction.rightSingle =
+            constant[instruction.right] ? instruction.single : holds[instruction.right];
+        holds[instruction.out] = instruction.single;
+    }
+    for (auto& output : d_outputs) output.single = !constant[output.slot] && holds[output.slot];
+    setTileRows(d_tileRows);
+}
+
+const double* BatchEvaluator::doubles(size_t index, bool single, size_t which, size_t rows) {
+    if (!single) return d_sources[index];
+    double* scratch = &d_doubleScratch[which * d_tileRows];
+    std::copy(this->single(index), this->single(index) + rows, scratch);
+    return scratch;
+}
+
+const float* BatchEvaluator::singles(size_t index, bool single, size_t which, size_t rows) {
+    if (single) return this->single(index);
+    float* scratch = &d_singleScratch[which * d_tileRows];
+    const double* values = d_sources[index];
+    for (size_t i = 0; i < rows; ++i) scratch[i] = static_cast<float>(values[i]);
+    return scratch;
+}
+
+size_t BatchEvaluator::tune() { return tune(0); }
+
+size_t BatchEvaluator::tune(size_t rows) {
+    // The same rows for every candidate, a few of the largest tiles.
+    rows = std::min(rows, 2 * MaxTileRows);
+    // Rows per second over tiles of `tile` rows: of whole passes over the
+    // bound inputs, results discarded, or of the program on the registers.
+    auto measure = [this, rows](size_t tile) {
+        setTileRows(tile);
+        if (!rows) {
+            for (const auto& input : d_inputs) {
+                std::fill_n(slot(input.slot), tile, 0.5);
+                if (input.single) std::fill_n(single(input.slot), tile, 0.5f);
+            }
+        }
+        auto once = [&]() {
+            if (rows)
+                pass(0, rows, false);
+            else
+                execute(tile);
+            return rows ? rows : tile;
+        };
+        // One untimed pass to warm the registers, then at least 2 ms.
+        once();
+        size_t done = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed(0);
+        while (elapsed.count() < 2e-3) {
+            done += once();
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+        return done / elapsed.count();
+    };
+    // Timings are noisy, and those of the registers alone leave out the
+    // gathers that favour larger tiles: a candidate replaces the current
+    // tile only when clearly faster.
+    const double margin = 1.1;
+    size_t best = d_tileRows;
+    double fastest = measure(best);
+    size_t fits = CacheBytes() / sizeof(double) / working();
+    for (size_t tile = 16; tile <= MaxTileRows; tile *= 2) {
+        if (tile > 16 && tile > fits) break;
+        if (tile == best) continue;
+        double speed = measure(tile);
+        if (speed > fastest * margin) {
+            fastest = speed;
+            best = tile;
+        }
+    }
+    setTileRows(best);
+    return best;
+}
+
+std::vector<std::string> BatchEvaluator::variables() const {
+    std::vector<std::string> names;
+    for (const auto& input : d_inputs) names.push_back(input.name);
+    return names;
+}
+
+std::vector<std::string> BatchEvaluator::outputs() const {
+    std::vector<std::string> names;
+    for (const auto& output : d_outputs) names.push_back(output.name);
+    return names;
+}
+
+BatchEvaluator::Input& BatchEvaluator::input(const std::string& name) {
+    for (auto& input : d_inputs)
+        if (input.name == name) return input;
+    throw std::runtime_error("No output depends on variable " + name);
+}
+
+BatchEvaluator::Output& BatchEvaluator::output(const std::string& name) {
+    for (auto& output : d_outputs)
+        if (output.name == name) return output;
+    throw std::runtime_error("Not an output: " + name);
+}
+
+void BatchEvaluator::bindInput(const std::string& name, const void* column,
+                               ColumnFile::Type type, size_t stride) {
+    auto& bound = input(name);
+    bound.column = column;
+    bound.type = type;
+    bound.stride = stride;
+}
+
+void BatchEvaluator::bindOutput(const std::string& name, void* column, ColumnFile::Type type,
+                                size_t stride) {
+    // The same output can be asked for twice: bind every occurrence.
+    output(name);
+    for (auto& bound : d_outputs) {
+        if (bound.name != name) continue;
+        bound.column = column;
+        bound.type = type;
+        bound.stride = stride;
+    }
+}
+
+void BatchEvaluator::bindAggregate(const std::string& name, Aggregate* aggregate,
+                                   uint64_t firstRow) {
+    output(name);
+    for (auto& bound : d_outputs) {
+        if (bound.name != name) continue;
+        bound.aggregate = aggregate;
+        bound.firstRow = firstRow;
+    }
+}
+
+void BatchEvaluator::bind(const std::string& name, const ColumnFile& column) {
+    if (column.type() == ColumnFile::Double)
+        bind(name, static_cast<const double*>(column.data()));
+    else
+        bind(name, static_cast<const float*>(column.data()));
+}
+
+void BatchEvaluator::bindResult(const std::string& name, ColumnFile& column) {
+    if (column.type() == ColumnFile::Double)
+        bindResult(name, static_cast<double*>(column.data()));
+    else
+        bindResult(name, static_cast<float*>(column.data()));
+}
+
+template <class T>
+void BatchEvaluator::Apply(const Instruction& instruction, T* out, const T* a, const T* b,
+                           size_t rows) {
+    if (instruction.op == Op::Unary) {
+        for (size_t i = 0; i < rows; ++i) out[i] = static_cast<T>(instruction.unary(a[i]));
+    } else {
+        for (size_t i = 0; i < rows; ++i)
+            out[i] = static_cast<T>(instruction.binary(a[i], b[i]));
+    }
+}
+
+BatchKernels::Op BatchEvaluator::Kernel(Op op) {
+    static_assert(int(Op::Log) == BatchKernels::Log && int(Op::Power) == BatchKernels::Power + 1,
+                  "Op and BatchKernels::Op out of step");
+    return BatchKernels::Op(op < Op::Unary ? int(op) : int(op) - 1);
+}
+
+void BatchEvaluator::execute(size_t rows, size_t begin, size_t end) {
+    for (size_t at = begin; at < end; ++at) {
+        const auto& instruction = d_program[at];
+        bool unary = instruction.op <= Op::Unary;
+        bool function = instruction.op == Op::Unary || instruction.op == Op::Binary;
+        if (instruction.single) {
+            auto a = singles(instruction.left, instruction.leftSingle, 0, rows);
+            auto b = unary ? a : singles(instruction.right, instruction.rightSingle, 1, rows);
+            if (function)
+                Apply(instruction, single(instruction.out), a, b, rows);
+            else
+                d_kernels->singles[Kernel(instruction.op)](single(instruction.out), a, b, rows);
+        } else {
+            auto a = doubles(instruction.left, instruction.leftSingle, 0, rows);
+            auto b = unary ? a : doubles(instruction.right, instruction.rightSingle, 1, rows);
+            if (function)
+                Apply(instruction, slot(instruction.out), a, b, rows);
+            else
+                d_kernels->doubles[Kernel(instruction.op)](slot(instruction.out), a, b, rows);
+        }
+    }
+}
+
+void BatchEvaluator::run(size_t first, size_t rows) {
+    LatencyStats::Timer timer(LatencyStats::Batch);
+    EVALUATION_TRACE("batch", "run");
+    pass(first, rows, true);
+}
+
+void BatchEvaluator::pass(size_t first, size_t rows, bool store) {
+    for (const auto& input : d_inputs) {
+        d_sources[input.slot] = slot(input.slot);
+        if (input.column) continue;
+        auto value = input.variable->eval();
+        if (input.single)
+            std::fill_n(single(input.slot), d_tileRows, static_cast<float>(value));
+        else
+            std::fill_n(slot(input.slot), d_tileRows, value);
+    }
+
+    for (size_t start = first; start < first + rows; start += d_tileRows) {
+        auto count = std::min(d_tileRows, first + rows - start);
+        for (const auto& input : d_inputs) {
+            if (!input.column) continue;
+            auto column = static_cast<const char*>(input.column) + start * input.stride;
+            if (input.single && input.type == ColumnFile::Double) {
+                Gather<double>(column, input.stride, count, single(input.slot));
+            } else if (input.single) {
+                Gather<float>(column, input.stride, count, single(input.slot));
+            } else if (input.type == ColumnFile::Double && input.stride == sizeof(double)) {
+                d_sources[input.slot] = reinterpret_cast<const double*>(column);
+            } else if (input.type == ColumnFile::Double) {
+                Gather<double>(column, input.stride, count, slot(input.slot));
+            } else {
+                Gather<float>(column, input.stride, count, slot(input.slot));
+            }
+        }
+        execute(count);
+        if (!store) continue;
+        for (const auto& output : d_outputs) {
+            if (output.aggregate)
+                output.aggregate->add(doubles(output.slot, output.single, 0, count), count,
+                                      output.firstRow + start);
+            if (!output.column) continue;
+            auto column = static_cast<char*>(output.column) + start * output.stride;
+            if (output.single && output.type == ColumnFile::Double)
+                Scatter<double>(single(output.slot), count, column, output.stride);
+            else if (output.single)
+                Scatter<float>(single(output.slot), count, column, output.stride);
+            else if (output.type == ColumnFile::Double)
+                Scatter<double>(d_sources[output.slot], count, column, output.stride);
+            else
+                Scatter<float>(d_sources[output.slot], count, column, output.stride);
+        }
+    }
+}
+
+std::vector<BatchEvaluator::Deviation> BatchEvaluator::validate(size_t rows) {
+    auto bound = d_outputs;
+    auto precision = d_precision;
+    std::vector<std::vector<double>> reference(bound.size(), std::vector<double>(rows));
+    auto actual = reference;
+    auto evaluate = [&](Precision mode, std::vector<std::vector<double>>& results) {
+        setPrecision(mode);
+        for (size_t o = 0; o < d_outputs.size(); ++o) {
+            d_outputs[o].column = results[o].data();
+            d_outputs[o].type = ColumnFile::Double;
+            d_outputs[o].stride = sizeof(double);
+            d_outputs[o].aggregate = nullptr;
+        }
+        run(rows);
+    };
+    try {
+        evaluate(Precision::Double, reference);
+        evaluate(precision, actual);
+    } catch (...) {
+        d_outputs = bound;
+        setPrecision(precision);
+        throw;
+    }
+    d_outputs = bound;
+    setPrecision(precision);
+
+    std::vector<Deviation> deviations(bound.size());
+    for (size_t o = 0; o < bound.size(); ++o) {
+        auto& deviation = deviations[o];
+        deviation.output = bound[o].name;
+        for (size_t r = 0; r < rows; ++r) {
+            double expected = reference[o][r], value = actual[o][r];
+            if (!std::isfinite(expected) || !std::isfinite(value)) {
+                bool same = expected == value || (std::isnan(expected) && std::isnan(value));
+                if (!same) ++deviation.mismatches;
+                continue;
+            }
+            double difference = std::fabs(value - expected);
+            deviation.maxAbsolute = std::max(deviation.maxAbsolute, difference);
+            if (expected != 0 && difference / std::fabs(expected) > deviation.maxRelative) {
+                deviation.maxRelative = difference / std::fabs(expected);
+                deviation.row = r;
+            }
+        }
+    }
+    return deviations;
+}
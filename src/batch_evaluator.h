@@ -0,0 +1,234 @@
+#ifndef BATCH_EVALUATOR_H
+#define BATCH_EVALUATOR_H
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "aggregate.h"
+#include "batch_kernels.h"
+#include "column_file.h"
+#include "evaluation.h"
+
+//! Evaluates expressions of a context over columns of rows.
+/*!
+  The graph under the outputs is flattened once into a program with one
+  instruction per distinct node, and run a tile of rows at a time: every
+  instruction is a loop over the tile, so the per-node virtual calls of
+  eval() are paid once per tile instead of once per row.
+
+  Intermediate results live in registers of one tile each, reused as soon
+  as the last instruction reading them has run: a register is needed per
+  value live at once, not per node, so that a large model keeps its whole
+  working set in cache. The tile is sized from the L2 cache and the number
+  of registers; tune() times the candidates and keeps the fastest.
+
+  In Single precision every register holds floats: twice the values per
+  vector and per cache line, for about 7 significant digits. Mixed keeps
+  the results of additions and subtractions in double, where cancellation
+  would lose the most, and the rest in float. validate() compares either
+  with the double results on the first rows of the bound columns.
+
+  Inputs and outputs are bound to arrays of doubles or floats, typically
+  mapped column files, or to a field of an array of structs: a base
+  pointer and the stride in bytes from one row to the next, e.g.
+  bind("z", &rows[0].z, sizeof(Row)). Contiguous double inputs are read in
+  place; float and strided inputs are gathered, and strided outputs
+  scattered, a tile at a time, so nothing is transposed up front.
+  Variables that are not bound keep the value the context gives them, the
+  same for every row. Outputs can also be bound to an Aggregate, which
+  takes every tile as it is computed: statistics over any number of rows
+  in constant memory, without writing the rows anywhere. Results match calc()
+  bit for bit, the same functions being applied to the same values, with
+  the loops of whichever BatchKernels level the CPU runs best.
+*/
+class BatchEvaluator {
+   public:
+    //! Rows callers hand over at a time; tiles are sized independently.
+    static const size_t BlockRows = 256;
+    static const size_t MaxTileRows = 4096;
+
+    enum class Precision { Double, Single, Mixed };
+    //! Largest difference of an output from its double results.
+    struct Deviation {
+        std::string output;
+        double maxAbsolute = 0;
+        //! Over the rows where the double result is not 0.
+        double maxRelative = 0;
+        //! Row of the largest relative deviation.
+        uint64_t row = 0;
+        //! Rows where one result is NaN or infinite and the other is not the same.
+        uint64_t mismatches = 0;
+    };
+
+   private:
+    enum class Op {
+        Negate,
+        Cos,
+        Sin,
+        Exp,
+        Log,
+        Unary,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Max,
+        Min,
+        Power,
+        Binary
+    };
+    struct Instruction {
+        Op op;
+        size_t out, left, right;
+        UnaryOperatorNode::Function unary;
+        BinaryOperatorNode::Function binary;
+        // Whether the result, and the operands as last written, are floats.
+        bool single, leftSingle, rightSingle;
+    };
+    struct Input {
+        std::string name;
+        VariableNode* variable;
+        size_t slot;
+        const void* column = nullptr;
+        ColumnFile::Type type = ColumnFile::Double;
+        size_t stride = 0;
+        bool single = false;
+    };
+    struct Output {
+        std::string name;
+        size_t slot;
+        void* column = nullptr;
+        ColumnFile::Type type = ColumnFile::Double;
+        size_t stride = 0;
+        Aggregate* aggregate = nullptr;
+        uint64_t firstRow = 0;
+        bool single = false;
+    };
+
+    std::vector<Instruction> d_program;
+    std::vector<Input> d_inputs;
+    std::vector<Output> d_outputs;
+    // A tile of values per register, and where each register is read
+    // from: itself, or the column for double inputs.
+    std::vector<double> d_registers;
+    std::vector<const double*> d_sources;
+    std::vector<std::pair<size_t, double>> d_constants;
+    size_t d_tileRows = BlockRows;
+    // Float registers, alongside the double ones outside Double precision;
+    // constants are in both. Scratch tiles hold converted operands.
+    Precision d_precision = Precision::Double;
+    std::vector<float> d_singles;
+    std::vector<double> d_doubleScratch;
+    std::vector<float> d_singleScratch;
+    const BatchKernels* d_kernels;
+
+    Input& input(const std::string& name);
+    Output& output(const std::string& name);
+    void bindInput(const std::string& name, const void* column, ColumnFile::Type type,
+                   size_t stride);
+    void bindOutput(const std::string& name, void* column, ColumnFile::Type type, size_t stride);
+    // Pass `reuse` false to keep a register per node.
+    BatchEvaluator(EvaluationContext& context, const std::vector<std::string>& outputs,
+                   bool reuse);
+    void allocate();
+    // Registers other than those of the inputs.
+    size_t working() const { return std::max<size_t>(1, d_sources.size() - d_inputs.size()); }
+    double* slot(size_t index) { return &d_registers[index * d_tileRows]; }
+    float* single(size_t index) { return &d_singles[index * d_tileRows]; }
+    // Register `index` as doubles or floats, converted through scratch tile
+    // `which` when it holds the other type.
+    const double* doubles(size_t index, bool single, size_t which, size_t rows);
+    const float* singles(size_t index, bool single, size_t which, size_t rows);
+    // Unary and Binary, the functions of the nodes.
+    template <class T>
+    static void Apply(const Instruction& instruction, T* out, const T* a, const T* b,
+                      size_t rows);
+    static BatchKernels::Op Kernel(Op op);
+    //! Runs instructions [begin, end) of the program over `rows` rows.
+    void execute(size_t rows, size_t begin, size_t end);
+    void execute(size_t rows) { execute(rows, 0, d_program.size()); }
+    //! run() without the timer; with `store` false the results are dropped.
+    void pass(size_t first, size_t rows, bool store);
+
+    friend class GridSweep;
+
+   public:
+    //! Compiles `outputs`, which must be expressions known to `context`.
+    /*!
+      The evaluator refers to the nodes of the context, which must outlive it.
+    */
+    BatchEvaluator(EvaluationContext& context, const std::vector<std::string>& outputs);
+
+    //! Variables the outputs depend on, in name order.
+    std::vector<std::string> variables() const;
+    std::vector<std::string> outputs() const;
+
+    //! Registers of one tile each the program needs.
+    size_t registers() const { return d_sources.size(); }
+    size_t tileRows() const { return d_tileRows; }
+    //! Evaluates `rows` (at least 1) rows at a time; tune() tries up to MaxTileRows.
+    void setTileRows(size_t rows);
+    //! Times the program on every tile that fits in L2, keeps the fastest.
+    /*!
+      Takes a few milliseconds per candidate, on the registers alone:
+      tune once at startup, before long runs. The current tile is kept
+      unless a candidate is more than 10% faster. Returns the tile chosen.
+    */
+    size_t tune();
+    //! As tune(), timing passes over the first `rows` rows of the bound inputs.
+    /*!
+      Closer to run() than the registers alone when the inputs are bound,
+      gathers and column reads included; the results are not written.
+      Takes longer, up to 2 * MaxTileRows rows per candidate. Throws as
+      run() does.
+    */
+    size_t tune(size_t rows);
+
+    //! Instruction set of the kernels, BatchKernels::Get() unless set.
+    const char* isa() const { return d_kernels->isa; }
+    //! Runs the kernels built for `isa`; throws as BatchKernels::Get(isa).
+    void setIsa(const std::string& isa) { d_kernels = &BatchKernels::Get(isa); }
+
+    Precision precision() const { return d_precision; }
+    void setPrecision(Precision precision);
+    //! Deviation of every output from double precision over `rows` rows.
+    /*!
+      Evaluates the first `rows` rows of the bound inputs twice, in double
+      and in the current precision, without writing the bound results.
+    */
+    std::vector<Deviation> validate(size_t rows);
+
+    //! Reads row i of variable `name` at `column` + i * `stride` bytes; null unbinds.
+    void bind(const std::string& name, const double* column, size_t stride = sizeof(double)) {
+        bindInput(name, column, ColumnFile::Double, stride);
+    }
+    void bind(const std::string& name, const float* column, size_t stride = sizeof(float)) {
+        bindInput(name, column, ColumnFile::Float, stride);
+    }
+    void bind(const std::string& name, const ColumnFile& column);
+    //! Writes row i of output `name` at `column` + i * `stride` bytes; null unbinds.
+    void bindResult(const std::string& name, double* column, size_t stride = sizeof(double)) {
+        bindOutput(name, column, ColumnFile::Double, stride);
+    }
+    void bindResult(const std::string& name, float* column, size_t stride = sizeof(float)) {
+        bindOutput(name, column, ColumnFile::Float, stride);
+    }
+    void bindResult(const std::string& name, ColumnFile& column);
+    //! Adds the results of output `name` to `aggregate`; null unbinds.
+    /*!
+      Row i of the bound columns is added as row id `firstRow` + i.
+    */
+    void bindAggregate(const std::string& name, Aggregate* aggregate, uint64_t firstRow = 0);
+
+    //! Evaluates rows [0, rows) of the bound columns.
+    /*!
+      Throws "Variable not set" when a variable is neither bound nor set.
+    */
+    void run(size_t rows) { run(0, rows); }
+    //! Evaluates rows [first, first + rows) of the bound columns.
+    void run(size_t first, size_t rows);
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include "batch_kernels.h"
+#include <cstdlib>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BATCH_KERNELS_ISA "sse2"
+#else
+#define BATCH_KERNELS_ISA "generic"
+#endif
+#define BATCH_KERNELS_TABLE BaselineKernels
+#include "batch_kernels_impl.h"
+
+// Defined by batch_kernels_avx2.cpp and batch_kernels_avx512.cpp, which the
+// build compiles with the flags of their level when the compiler has them.
+#ifdef EVALUATION_AVX2
+extern const BatchKernels Avx2Kernels;
+#endif
+#ifdef EVALUATION_AVX512
+extern const BatchKernels Avx512Kernels;
+#endif
+
+namespace {
+
+struct Level {
+    const BatchKernels* kernels;
+    bool (*supported)();
+};
+
+bool Always() { return true; }
+
+#ifdef EVALUATION_AVX2
+bool HasAvx2() { return __builtin_cpu_supports("avx2"); }
+#endif
+#ifdef EVALUATION_AVX512
+bool HasAvx512() { return __builtin_cpu_supports("avx512f"); }
+#endif
+
+// Narrowest first.
+const Level Levels[] = {
+    {&BaselineKernels, Always},
+#ifdef EVALUATION_AVX2
+    {&Avx2Kernels, HasAvx2},
+#endif
+#ifdef EVALUATION_AVX512
+    {&Avx512Kernels, HasAvx512},
+#endif
+};
+
+const BatchKernels& Choose() {
+    const char* forced = std::getenv("EVALUATION_ISA");
+    if (forced && *forced) return BatchKernels::Get(forced);
+    const BatchKernels* widest = nullptr;
+    for (const auto& level : Levels)
+        if (level.supported()) widest = level.kernels;
+    return *widest;
+}
+
+}  // namespace
+
+const BatchKernels& BatchKernels::Get() {
+    static const BatchKernels& chosen = Choose();
+    return chosen;
+}
+
+const BatchKernels& BatchKernels::Get(const std::string& isa) {
+    static const char* known[] = {"generic", "sse2", "avx2", "avx512"};
+    for (const auto& level : Levels) {
+        if (isa != level.kernels->isa) continue;
+        if (!level.supported()) throw std::runtime_error("This CPU does not support " + isa);
+        return *level.kernels;
+    }
+    for (auto name : known)
+        if (isa == name) throw std::runtime_error("Kernels for " + isa + " are not built in");
+    throw std::runtime_error("Unknown instruction set " + isa);
+}
+
+std::vector<std::string> BatchKernels::Available() {
+    std::vector<std::string> names;
+    for (const auto& level : Levels)
+        if (level.supported()) names.push_back(level.kernels->isa);
+    return names;
+}
@@ -0,0 +1,57 @@
+#ifndef BATCH_KERNELS_H
+#define BATCH_KERNELS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+//! The elementwise loops of the batch evaluator, built for several instruction sets.
+/*!
+  The loops are compiled once per level, from the same source, in
+  translation units of their own: the baseline of the target, and on x86
+  AVX2 and AVX-512 as well. Get() picks the widest level the CPU supports
+  on first use, or the one named by the EVALUATION_ISA environment
+  variable (sse2, avx2 or avx512) to force a level for testing.
+
+  Every level applies the same functions to the same values, without FMA
+  contraction, so results do not depend on the level that ran.
+*/
+class BatchKernels {
+   public:
+    enum Op {
+        Negate,
+        Cos,
+        Sin,
+        Exp,
+        Log,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Max,
+        Min,
+        Power,
+        OpCount
+    };
+    //! out[i] = op(a[i], b[i]) for i in [0, rows); b is ignored by unary ops.
+    typedef void (*Double)(double* out, const double* a, const double* b, size_t rows);
+    typedef void (*Single)(float* out, const float* a, const float* b, size_t rows);
+
+    //! Name of the level: "sse2", "avx2", "avx512", or "generic" off x86.
+    const char* isa;
+    Double doubles[OpCount];
+    Single singles[OpCount];
+
+    //! The level chosen for this process.
+    /*!
+      Throws when EVALUATION_ISA names a level that is unknown, not built,
+      or not supported by the CPU.
+    */
+    static const BatchKernels& Get();
+    //! Level `isa`, with the same checks.
+    static const BatchKernels& Get(const std::string& isa);
+    //! Levels built in and supported by the CPU, narrowest first.
+    static std::vector<std::string> Available();
+};
+
+#endif
@@ -0,0 +1,4 @@
+// BatchKernels for AVX2, compiled with the flags of that level.
+#define BATCH_KERNELS_ISA "avx2"
+#define BATCH_KERNELS_TABLE Avx2Kernels
+#include "batch_kernels_impl.h"
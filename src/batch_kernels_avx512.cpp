@@ -0,0 +1,4 @@
+// BatchKernels for AVX-512, compiled with the flags of that level.
+#define BATCH_KERNELS_ISA "avx512"
+#define BATCH_KERNELS_TABLE Avx512Kernels
+#include "batch_kernels_impl.h"
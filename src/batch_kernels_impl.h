@@ -0,0 +1,96 @@
+// The loops of BatchKernels, included once per instruction set by a
+// translation unit that defines BATCH_KERNELS_ISA, the name of the level,
+// and BATCH_KERNELS_TABLE, the name of the table to define. Everything
+// else here has internal linkage: the compiler flags of the level must not
+// leak into code shared with the other levels.
+
+#include <math.h>
+
+#include "batch_kernels.h"
+
+namespace {
+
+// The C functions themselves, which calc() reaches through std::.
+inline double Cosine(double x) { return cos(x); }
+inline float Cosine(float x) { return cosf(x); }
+inline double Sine(double x) { return sin(x); }
+inline float Sine(float x) { return sinf(x); }
+inline double Exponential(double x) { return exp(x); }
+inline float Exponential(float x) { return expf(x); }
+inline double Logarithm(double x) { return log(x); }
+inline float Logarithm(float x) { return logf(x); }
+inline double Raise(double x, double y) { return pow(x, y); }
+inline float Raise(float x, float y) { return powf(x, y); }
+
+template <class T>
+void NegateLoop(T* out, const T* a, const T*, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = -a[i];
+}
+
+template <class T>
+void CosLoop(T* out, const T* a, const T*, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = Cosine(a[i]);
+}
+
+template <class T>
+void SinLoop(T* out, const T* a, const T*, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = Sine(a[i]);
+}
+
+template <class T>
+void ExpLoop(T* out, const T* a, const T*, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = Exponential(a[i]);
+}
+
+template <class T>
+void LogLoop(T* out, const T* a, const T*, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = Logarithm(a[i]);
+}
+
+template <class T>
+void AddLoop(T* out, const T* a, const T* b, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = a[i] + b[i];
+}
+
+template <class T>
+void SubtractLoop(T* out, const T* a, const T* b, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = a[i] - b[i];
+}
+
+template <class T>
+void MultiplyLoop(T* out, const T* a, const T* b, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = a[i] * b[i];
+}
+
+template <class T>
+void DivideLoop(T* out, const T* a, const T* b, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = a[i] / b[i];
+}
+
+// As std::max and std::min, which calc() uses, treat NaN.
+template <class T>
+void MaxLoop(T* out, const T* a, const T* b, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = a[i] < b[i] ? b[i] : a[i];
+}
+
+template <class T>
+void MinLoop(T* out, const T* a, const T* b, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = b[i] < a[i] ? b[i] : a[i];
+}
+
+template <class T>
+void PowerLoop(T* out, const T* a, const T* b, size_t rows) {
+    for (size_t i = 0; i < rows; ++i) out[i] = Raise(a[i], b[i]);
+}
+
+}  // namespace
+
+extern const BatchKernels BATCH_KERNELS_TABLE;
+const BatchKernels BATCH_KERNELS_TABLE = {
+    BATCH_KERNELS_ISA,
+    {NegateLoop<double>, CosLoop<double>, SinLoop<double>, ExpLoop<double>, LogLoop<double>,
+     AddLoop<double>, SubtractLoop<double>, MultiplyLoop<double>, DivideLoop<double>,
+     MaxLoop<double>, MinLoop<double>, PowerLoop<double>},
+    {NegateLoop<float>, CosLoop<float>, SinLoop<float>, ExpLoop<float>, LogLoop<float>,
+     AddLoop<float>, SubtractLoop<float>, MultiplyLoop<float>, DivideLoop<float>,
+     MaxLoop<float>, MinLoop<float>, PowerLoop<float>}};
@@ -0,0 +1,346 @@
+#include "chunked_pipeline.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tracer.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double Since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Chunk slots handed from one stage to the next.
+class Queue {
+    std::mutex d_mutex;
+    std::condition_variable d_ready;
+    std::deque<size_t> d_slots;
+    bool d_closed = false;
+    bool d_aborted = false;
+
+   public:
+    void push(size_t slot) {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_slots.push_back(slot);
+        d_ready.notify_one();
+    }
+    //! Next slot; false once closed and drained, or aborted.
+    bool pop(size_t& slot, double& waited) {
+        auto start = Clock::now();
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_ready.wait(lock, [this] { return d_aborted || d_closed || !d_slots.empty(); });
+        waited += Since(start);
+        if (d_aborted || d_slots.empty()) return false;
+        slot = d_slots.front();
+        d_slots.pop_front();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_closed = true;
+        d_ready.notify_all();
+    }
+    void abort() {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_aborted = true;
+        d_ready.notify_all();
+    }
+};
+
+struct File {
+    int fd = -1;
+    std::string fname;
+    ColumnFile::Layout layout;
+    File() {}
+    File(File&& other) : fd(other.fd), fname(std::move(other.fname)), layout(other.layout) {
+        other.fd = -1;
+    }
+    ~File() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+struct Chunk {
+    size_t first = 0;
+    size_t rows = 0;
+    std::vector<std::vector<char>> inputs, results;
+};
+
+void ReadFully(const File& file, char* data, size_t bytes, off_t offset) {
+    while (bytes) {
+        auto read = pread(file.fd, data, bytes, offset);
+        if (read < 0 && errno == EINTR) continue;
+        if (read <= 0) throw std::runtime_error("Cannot read '" + file.fname + "'");
+        data += read;
+        bytes -= read;
+        offset += read;
+    }
+}
+
+void WriteFully(const File& file, const char* data, size_t bytes, off_t offset) {
+    while (bytes) {
+        auto written = pwrite(file.fd, data, bytes, offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) throw std::runtime_error("Cannot write '" + file.fname + "'");
+        data += written;
+        bytes -= written;
+        offset += written;
+    }
+}
+
+// Pages behind the pipeline are not read again: leave room for others.
+void DropRead(const File& file, off_t offset, size_t bytes) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(file.fd, offset, bytes, POSIX_FADV_DONTNEED);
+#else
+    (void)file, (void)offset, (void)bytes;
+#endif
+}
+
+// Starts writing back the chunk just written, then waits for and drops the
+// (full) chunk before it: dirty pages never pile up beyond two chunks.
+void DropWritten(const File& file, off_t offset, size_t bytes, off_t previous,
+                 size_t previousBytes) {
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+    sync_file_range(file.fd, offset, bytes, SYNC_FILE_RANGE_WRITE);
+    if (previous >= 0) {
+        sync_file_range(file.fd, previous, previousBytes,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(file.fd, previous, previousBytes, POSIX_FADV_DONTNEED);
+    }
+#else
+    (void)file, (void)offset, (void)bytes, (void)previous, (void)previousBytes;
+#endif
+}
+
+}  // namespace
+
+const size_t ChunkedPipeline::Slots;
+
+ChunkedPipeline::ChunkedPipeline(EvaluationContext& context,
+                                 const std::vector<std::string>& outputs)
+    : ChunkedPipeline(context, outputs, Options()) {}
+
+ChunkedPipeline::ChunkedPipeline(EvaluationContext& context,
+                                 const std::vector<std::string>& outputs,
+                                 const Options& options)
+    : d_context(context), d_batch(context, outputs), d_outputs(outputs), d_options(options) {
+    d_batch.setPrecision(options.precision);
+}
+
+size_t ChunkedPipeline::ChunkRows(size_t rowBytes, size_t memoryBudget) {
+    // Whole evaluator blocks, and at least one.
+    auto rows = memoryBudget / (Slots * std::max<size_t>(rowBytes, 1));
+    rows -= rows % BatchEvaluator::BlockRows;
+    return std::max<size_t>(rows, BatchEvaluator::BlockRows);
+}
+
+ChunkedPipeline::Report ChunkedPipeline::run(const std::string& directory,
+                                             const std::string& results) {
+    auto start = Clock::now();
+    Report report;
+    std::vector<File> inputs, outputs;
+    std::vector<std::string> names;
+    size_t rowBytes = 0;
+    // Bindings of an earlier run point into its freed chunk buffers: a
+    // variable without a column this time must read the context instead.
+    for (const auto& name : d_batch.variables())
+        d_batch.bind(name, static_cast<const double*>(nullptr));
+    for (const auto& name : d_outputs) d_batch.bindResult(name, static_cast<double*>(nullptr));
+    for (const auto& name : d_batch.variables()) {
+        File file;
+        file.fname = directory + "/" + name + ".npy";
+        struct stat info;
+        if (stat(file.fname.c_str(), &info) != 0) {
+            try {
+                d_context.variables().at(name)->eval();
+            } catch (const std::exception&) {
+                throw std::runtime_error("Missing column '" + file.fname + "'");
+            }
+            continue;
+        }
+        file.layout = ColumnFile::Inspect(file.fname);
+        if (!inputs.empty() && file.layout.rows != report.rows)
+            throw std::runtime_error(file.fname + " has " + std::to_string(file.layout.rows) +
+                                     " rows, expected " + std::to_string(report.rows));
+        report.rows = file.layout.rows;
+        file.fd = open(file.fname.c_str(), O_RDONLY);
+        if (file.fd < 0) throw std::runtime_error("Cannot open '" + file.fname + "'");
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        rowBytes += file.layout.valueSize();
+        names.push_back(name);
+        inputs.push_back(std::move(file));
+    }
+    if (inputs.empty()) throw std::runtime_error("No column to read in '" + directory + "'");
+    for (const auto& name : d_outputs) {
+        File file;
+        file.fname = results + "/" + name + ".npy";
+        auto header = ColumnFile::Header(d_options.resultType, report.rows);
+        file.layout = {d_options.resultType, report.rows, header.size()};
+        file.fd = open(file.fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file.fd < 0) throw std::runtime_error("Cannot create '" + file.fname + "'");
+        WriteFully(file, header.data(), header.size(), 0);
+        if (ftruncate(file.fd, header.size() + report.rows * file.layout.valueSize()) != 0)
+            throw std::runtime_error("Cannot size '" + file.fname + "'");
+        rowBytes += file.layout.valueSize();
+        outputs.push_back(std::move(file));
+    }
+
+    report.chunkRows = d_options.chunkRows ? d_options.chunkRows
+                                           : ChunkRows(rowBytes, d_options.memoryBudget);
+    report.chunks = (report.rows + report.chunkRows - 1) / report.chunkRows;
+    std::vector<Chunk> chunks(Slots);
+    for (auto& chunk : chunks) {
+        for (const auto& file : inputs)
+            chunk.inputs.emplace_back(report.chunkRows * file.layout.valueSize());
+        for (const auto& file : outputs)
+            chunk.results.emplace_back(report.chunkRows * file.layout.valueSize());
+    }
+
+    Queue free, filled, computed;
+    for (size_t slot = 0; slot < Slots; ++slot) free.push(slot);
+    std::mutex failure;
+    std::exception_ptr error;
+    auto fail = [&] {
+        {
+            std::lock_guard<std::mutex> lock(failure);
+            if (!error) error = std::current_exception();
+        }
+        free.abort();
+        filled.abort();
+        computed.abort();
+    };
+
+    std::thread reader([&] {
+        Tracer::NameThread("pipeline reader");
+        try {
+            size_t slot;
+            for (size_t c = 0; c < report.chunks && free.pop(slot, report.reading.waitSeconds);
+                 ++c) {
+                EVALUATION_TRACE("pipeline", "read");
+                auto busy = Clock::now();
+                auto& chunk = chunks[slot];
+                chunk.first = c * report.chunkRows;
+                chunk.rows = std::min(report.chunkRows, report.rows - chunk.first);
+                for (size_t i = 0; i < inputs.size(); ++i) {
+                    auto size = inputs[i].layout.valueSize();
+                    auto offset = inputs[i].layout.offset + chunk.first * size;
+                    ReadFully(inputs[i], chunk.inputs[i].data(), chunk.rows * size, offset);
+                    DropRead(inputs[i], offset, chunk.rows * size);
+                    report.reading.bytes += chunk.rows * size;
+                }
+                report.reading.busySeconds += Since(busy);
+                filled.push(slot);
+            }
+            filled.close();
+        } catch (...) {
+            fail();
+        }
+    });
+    std::thread writer([&] {
+        Tracer::NameThread("pipeline writer");
+        try {
+            size_t slot;
+            off_t previous = -1;
+            while (computed.pop(slot, report.writing.waitSeconds)) {
+                EVALUATION_TRACE("pipeline", "write");
+                auto busy = Clock::now();
+                const auto& chunk = chunks[slot];
+                for (size_t o = 0; o < outputs.size(); ++o) {
+                    auto size = outputs[o].layout.valueSize();
+                    auto offset = outputs[o].layout.offset + chunk.first * size;
+                    WriteFully(outputs[o], chunk.results[o].data(), chunk.rows * size, offset);
+                    DropWritten(outputs[o], offset, chunk.rows * size,
+                                previous < 0 ? -1 : outputs[o].layout.offset + previous * size,
+                                report.chunkRows * size);
+                    report.writing.bytes += chunk.rows * size;
+                }
+                previous = chunk.first;
+                report.writing.busySeconds += Since(busy);
+                free.push(slot);
+            }
+        } catch (...) {
+            fail();
+        }
+    });
+
+    try {
+        size_t slot;
+        while (filled.pop(slot, report.computing.waitSeconds)) {
+            auto busy = Clock::now();
+            auto& chunk = chunks[slot];
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                auto data = chunk.inputs[i].data();
+                if (inputs[i].layout.type == ColumnFile::Double)
+                    d_batch.bind(names[i], reinterpret_cast<const double*>(data));
+                else
+                    d_batch.bind(names[i], reinterpret_cast<const float*>(data));
+            }
+            for (size_t o = 0; o < outputs.size(); ++o) {
+                auto data = chunk.results[o].data();
+                if (outputs[o].layout.type == ColumnFile::Double)
+                    d_batch.bindResult(d_outputs[o], reinterpret_cast<double*>(data));
+                else
+                    d_batch.bindResult(d_outputs[o], reinterpret_cast<float*>(data));
+            }
+            if (!d_tuned) {
+                d_batch.tune(chunk.rows);
+                d_tuned = true;
+            }
+            d_batch.run(chunk.rows);
+            report.computing.busySeconds += Since(busy);
+            computed.push(slot);
+        }
+        computed.close();
+    } catch (...) {
+        fail();
+    }
+    reader.join();
+    writer.join();
+    if (error) std::rethrow_exception(error);
+    report.seconds = Since(start);
+    return report;
+}
+
+void ChunkedPipeline::Report::write(std::ostream& out) const {
+    char line[160];
+    std::snprintf(line, sizeof(line), "%llu rows in %llu chunks of %llu, %.3fs: %.0f rows/s\n",
+                  static_cast<unsigned long long>(rows), static_cast<unsigned long long>(chunks),
+                  static_cast<unsigned long long>(chunkRows), seconds,
+                  seconds > 0 ? rows / seconds : 0.0);
+    out << line;
+    const Stage* stages[] = {&reading, &computing, &writing};
+    const char* names[] = {"read", "compute", "write"};
+    size_t bound = 0;
+    for (size_t s = 0; s < 3; ++s) {
+        const auto& stage = *stages[s];
+        std::snprintf(line, sizeof(line), "  %-8s %8.3fs busy %8.3fs waiting", names[s],
+                      stage.busySeconds, stage.waitSeconds);
+        out << line;
+        if (stage.bytes) {
+            std::snprintf(line, sizeof(line), " %10.1f MB %8.1f MB/s", stage.bytes / 1e6,
+                          stage.busySeconds > 0 ? stage.bytes / stage.busySeconds / 1e6 : 0.0);
+            out << line;
+        }
+        out << "\n";
+        if (stage.busySeconds > stages[bound]->busySeconds) bound = s;
+    }
+    out << "  bound by " << names[bound] << "\n";
+}
@@ -0,0 +1,81 @@
+#ifndef CHUNKED_PIPELINE_H
+#define CHUNKED_PIPELINE_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "batch_evaluator.h"
+#include "column_file.h"
+#include "evaluation.h"
+
+//! Evaluates column files larger than memory, a chunk of rows at a time.
+/*!
+  Three stages overlap on a ring of Slots chunk buffers. While the calling
+  thread runs a BatchEvaluator over chunk k, a reader thread preads the
+  inputs of chunk k + 1 and a writer thread pwrites the results of chunk
+  k - 1. Memory stays within the ring whatever the size of the files, and
+  pages are dropped from the page cache behind the pipeline so that a long
+  run does not evict everything else on the machine.
+
+  Chunks are sized from a memory budget: the larger the chunk, the fewer
+  and longer the I/O requests. Within a chunk the evaluator works a
+  cache-sized tile at a time, tuned on the first chunk of the first run,
+  so the chunk size does not matter to the compute stage.
+*/
+class ChunkedPipeline {
+   public:
+    static const size_t Slots = 3;
+
+    struct Options {
+        //! Bytes of all chunk buffers together.
+        size_t memoryBudget = size_t(256) << 20;
+        //! Rows per chunk; 0 derives it from the memory budget.
+        size_t chunkRows = 0;
+        ColumnFile::Type resultType = ColumnFile::Double;
+        BatchEvaluator::Precision precision = BatchEvaluator::Precision::Double;
+    };
+    //! Time a stage spent working and waiting on the other stages.
+    struct Stage {
+        double busySeconds = 0;
+        double waitSeconds = 0;
+        uint64_t bytes = 0;
+    };
+    struct Report {
+        size_t rows = 0;
+        size_t chunks = 0;
+        size_t chunkRows = 0;
+        double seconds = 0;
+        Stage reading, computing, writing;
+        //! One line per stage and the stage the pipeline waited on most.
+        void write(std::ostream& out) const;
+    };
+
+   private:
+    EvaluationContext& d_context;
+    BatchEvaluator d_batch;
+    std::vector<std::string> d_outputs;
+    Options d_options;
+    bool d_tuned = false;
+
+   public:
+    //! Compiles `outputs` of `context`, which must outlive the pipeline.
+    ChunkedPipeline(EvaluationContext& context, const std::vector<std::string>& outputs);
+    ChunkedPipeline(EvaluationContext& context, const std::vector<std::string>& outputs,
+                    const Options& options);
+
+    //! Evaluates `directory`/NAME.npy into `results`/NAME.npy.
+    /*!
+      Every variable the outputs depend on is read from its column file,
+      except variables set in the context, which may have none. Result
+      files are created or replaced. Throws, once every stage has stopped,
+      on the first error of any of them.
+    */
+    Report run(const std::string& directory, const std::string& results);
+
+    //! Rows per chunk for rows of `rowBytes` when the ring holds `memoryBudget`.
+    static size_t ChunkRows(size_t rowBytes, size_t memoryBudget);
+};
+
+#endif
@@ -0,0 +1,195 @@
+#include "column_file.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char Magic[] = "\x93NUMPY";
+const size_t MagicSize = 6;
+// Header length, preamble included, is a multiple of this.
+const size_t Alignment = 64;
+
+// Value of `key` in the header dictionary, up to the next comma outside
+// parentheses: "'<f8'", "False", "(1000,)".
+std::string Field(const std::string& header, const std::string& key) {
+    auto at = header.find("'" + key + "'");
+    if (at == std::string::npos) return std::string();
+    at = header.find(':', at);
+    if (at == std::string::npos) return std::string();
+    ++at;
+    while (at < header.size() && header[at] == ' ') ++at;
+    size_t end = at;
+    int depth = 0;
+    for (; end < header.size(); ++end) {
+        if (header[end] == '(') ++depth;
+        if (header[end] == ')') --depth;
+        if ((header[end] == ',' || header[end] == '}') && depth == 0) break;
+    }
+    return header.substr(at, end - at);
+}
+
+// Layout of the .npy file starting with [data, data + size).
+ColumnFile::Layout Parse(const char* data, size_t size, const std::string& fname) {
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+    if (size < MagicSize + 4 || std::memcmp(bytes, Magic, MagicSize) != 0 ||
+        (bytes[6] != 1 && bytes[6] != 2))
+        throw std::runtime_error("Not a .npy file: '" + fname + "'");
+    size_t preamble = bytes[6] == 1 ? 10 : 12;
+    if (size < preamble) throw std::runtime_error("Truncated .npy header: '" + fname + "'");
+    size_t length = bytes[8] | bytes[9] << 8;
+    if (bytes[6] == 2) length |= size_t(bytes[10]) << 16 | size_t(bytes[11]) << 24;
+    if (preamble + length > size)
+        throw std::runtime_error("Truncated .npy header: '" + fname + "'");
+    std::string header(data + preamble, length);
+
+    ColumnFile::Layout layout;
+    layout.offset = preamble + length;
+    auto descr = Field(header, "descr");
+    if (descr == "'<f8'") {
+        layout.type = ColumnFile::Double;
+    } else if (descr == "'<f4'") {
+        layout.type = ColumnFile::Float;
+    } else {
+        throw std::runtime_error("Unsupported .npy type " + descr + ": '" + fname + "'");
+    }
+    auto shape = Field(header, "shape");
+    char* end = nullptr;
+    if (shape.size() > 2 && shape[0] == '(')
+        layout.rows = std::strtoull(shape.c_str() + 1, &end, 10);
+    if (!end || end == shape.c_str() + 1 || std::strcmp(end, ",)") != 0)
+        throw std::runtime_error("Expected a 1-d .npy array, got shape " + shape + ": '" +
+                                 fname + "'");
+    return layout;
+}
+
+}  // namespace
+
+ColumnFile::ColumnFile(ColumnFile&& other) { *this = std::move(other); }
+
+ColumnFile& ColumnFile::operator=(ColumnFile&& other) {
+    if (this == &other) return *this;
+    if (d_map) munmap(d_map, d_mapSize);
+    d_fname = std::move(other.d_fname);
+    d_map = other.d_map;
+    d_mapSize = other.d_mapSize;
+    d_offset = other.d_offset;
+    d_type = other.d_type;
+    d_rows = other.d_rows;
+    d_writable = other.d_writable;
+    other.d_map = nullptr;
+    other.d_mapSize = 0;
+    return *this;
+}
+
+ColumnFile::~ColumnFile() {
+    if (d_map) munmap(d_map, d_mapSize);
+}
+
+ColumnFile ColumnFile::Open(const std::string& fname) {
+    ColumnFile column;
+    column.d_fname = fname;
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open '" + fname + "'");
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw std::runtime_error("Cannot stat '" + fname + "'");
+    }
+    column.d_mapSize = info.st_size;
+    if (column.d_mapSize < MagicSize + 4) {
+        close(fd);
+        throw std::runtime_error("Not a .npy file: '" + fname + "'");
+    }
+    void* data = mmap(nullptr, column.d_mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw std::runtime_error("Cannot map '" + fname + "'");
+    column.d_map = static_cast<char*>(data);
+
+    auto layout = Parse(column.d_map, column.d_mapSize, fname);
+    column.d_type = layout.type;
+    column.d_rows = layout.rows;
+    column.d_offset = layout.offset;
+    if (layout.offset + layout.rows * layout.valueSize() > column.d_mapSize)
+        throw std::runtime_error("Truncated .npy data: '" + fname + "'");
+    return column;
+}
+
+ColumnFile ColumnFile::Create(const std::string& fname, Type type, size_t rows) {
+    auto header = Header(type, rows);
+    ColumnFile column;
+    column.d_fname = fname;
+    column.d_type = type;
+    column.d_rows = rows;
+    column.d_writable = true;
+    column.d_offset = header.size();
+    column.d_mapSize = header.size() + rows * (type == Double ? sizeof(double) : sizeof(float));
+    int fd = open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw std::runtime_error("Cannot create '" + fname + "'");
+    if (ftruncate(fd, column.d_mapSize) != 0) {
+        close(fd);
+        throw std::runtime_error("Cannot size '" + fname + "'");
+    }
+    void* data = mmap(nullptr, column.d_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw std::runtime_error("Cannot map '" + fname + "'");
+    column.d_map = static_cast<char*>(data);
+    std::memcpy(column.d_map, header.data(), header.size());
+    return column;
+}
+
+ColumnFile::Layout ColumnFile::Inspect(const std::string& fname) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open '" + fname + "'");
+    struct stat info;
+    std::string header(MagicSize + 6, '\0');
+    auto read = pread(fd, &header[0], header.size(), 0);
+    if (read >= static_cast<ssize_t>(MagicSize + 4)) {
+        auto bytes = reinterpret_cast<const unsigned char*>(header.data());
+        size_t length = bytes[8] | bytes[9] << 8;
+        if (bytes[6] == 2) length |= size_t(bytes[10]) << 16 | size_t(bytes[11]) << 24;
+        header.resize(std::min<size_t>(length + 12, 1 << 20));
+        read = pread(fd, &header[0], header.size(), 0);
+    }
+    bool stated = fstat(fd, &info) == 0;
+    close(fd);
+    if (read < 0 || !stated) throw std::runtime_error("Cannot read '" + fname + "'");
+    header.resize(read);
+    auto layout = Parse(header.data(), header.size(), fname);
+    if (layout.offset + layout.rows * layout.valueSize() > static_cast<size_t>(info.st_size))
+        throw std::runtime_error("Truncated .npy data: '" + fname + "'");
+    return layout;
+}
+
+std::string ColumnFile::Header(Type type, size_t rows) {
+    std::string dictionary = "{'descr': '";
+    dictionary += type == Double ? "<f8" : "<f4";
+    dictionary += "', 'fortran_order': False, 'shape': (" + std::to_string(rows) + ",), }";
+    size_t total =
+        (MagicSize + 4 + dictionary.size() + 1 + Alignment - 1) / Alignment * Alignment;
+    dictionary.resize(total - MagicSize - 4 - 1, ' ');
+    dictionary += '\n';
+    std::string header(Magic, MagicSize);
+    header += '\x01';
+    header += '\0';
+    header += static_cast<char>(dictionary.size() & 0xff);
+    header += static_cast<char>(dictionary.size() >> 8);
+    return header + dictionary;
+}
+
+void* ColumnFile::data() {
+    if (!d_writable) throw std::runtime_error("Column is read-only: '" + d_fname + "'");
+    return d_map + d_offset;
+}
+
+void ColumnFile::sync() {
+    if (d_writable && d_map && msync(d_map, d_mapSize, MS_SYNC) != 0)
+        throw std::runtime_error("Cannot sync '" + d_fname + "'");
+}
@@ -0,0 +1,65 @@
+#ifndef COLUMN_FILE_H
+#define COLUMN_FILE_H
+
+#include <cstddef>
+#include <string>
+
+//! A column of doubles or floats in a memory-mapped .npy file.
+/*!
+  The file is a NumPy array of one dimension, little-endian <f8 or <f4, in
+  format version 1.0 or 2.0, so numpy.load reads what Create writes and
+  numpy.save writes what Open reads. The values are used in place: Open
+  maps the file read-only and Create maps a new file shared and writable,
+  so writes go to the page cache and the file without a copy.
+*/
+class ColumnFile {
+   public:
+    enum Type { Double, Float };
+    //! Where the values of a column file are.
+    struct Layout {
+        Type type;
+        size_t rows;
+        //! Byte offset of the first value.
+        size_t offset;
+        size_t valueSize() const { return type == Double ? sizeof(double) : sizeof(float); }
+    };
+
+   private:
+    std::string d_fname;
+    char* d_map = nullptr;
+    size_t d_mapSize = 0;
+    size_t d_offset = 0;
+    Type d_type = Double;
+    size_t d_rows = 0;
+    bool d_writable = false;
+
+    ColumnFile() {}
+
+   public:
+    ColumnFile(ColumnFile&& other);
+    ColumnFile& operator=(ColumnFile&& other);
+    ColumnFile(const ColumnFile&) = delete;
+    ColumnFile& operator=(const ColumnFile&) = delete;
+    ~ColumnFile();
+
+    //! Maps an existing .npy file; throws when it is not a 1-d <f8 or <f4 array.
+    static ColumnFile Open(const std::string& fname);
+    //! Creates (or replaces) `fname` with room for `rows` values.
+    static ColumnFile Create(const std::string& fname, Type type, size_t rows);
+    //! Reads the header of `fname` only, for callers doing their own I/O.
+    static Layout Inspect(const std::string& fname);
+    //! The header Create writes, padded so that values start 64-byte aligned.
+    static std::string Header(Type type, size_t rows);
+
+    const std::string& fname() const { return d_fname; }
+    Type type() const { return d_type; }
+    size_t rows() const { return d_rows; }
+    bool writable() const { return d_writable; }
+    //! First value; the values are 64-byte aligned when Create made the file.
+    const void* data() const { return d_map + d_offset; }
+    void* data();
+    //! Writes dirty pages back to the file.
+    void sync();
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "compiled_model.h"
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "parser.h"
+#include "tracer.h"
+
+const uint32_t CompiledModel::Version = 1;
+
+namespace {
+
+const char Magic[4] = {'E', 'V', 'C', 'M'};
+
+template <class T>
+void WritePod(std::ostream &out, const T &value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void WriteString(std::ostream &out, const std::string &value) {
+    WritePod(out, static_cast<uint32_t>(value.size()));
+    out.write(value.data(), value.size());
+}
+
+template <class T>
+T ReadPod(std::istream &in) {
+    T value;
+    if (!in.read(reinterpret_cast<char *>(&value), sizeof(value)))
+        throw std::runtime_error("Truncated compiled model");
+    return value;
+}
+
+std::string ReadString(std::istream &in) {
+    auto size = ReadPod<uint32_t>(in);
+    std::string value(size, '\0');
+    if (size && !in.read(&value[0], size))
+        throw std::runtime_error("Truncated compiled model");
+    return value;
+}
+
+// Numbers every node reachable from the roots, children first. Iterative so
+// long chains of expressions do not exhaust the stack.
+void Number(const EvalNode *root, std::map<const EvalNode *, uint64_t> &ids,
+            std::vector<const EvalNode *> &order) {
+    std::vector<std::pair<const EvalNode *, bool>> stack{{root, false}};
+    while (!stack.empty()) {
+        auto top = stack.back();
+        stack.pop_back();
+        if (ids.count(top.first)) continue;
+        if (top.second) {
+            ids[top.first] = order.size();
+            order.push_back(top.first);
+            continue;
+        }
+        stack.emplace_back(top.first, true);
+        auto children = top.first->children();
+        for (auto child = children.rbegin(); child != children.rend(); ++child)
+            if (!ids.count(*child)) stack.emplace_back(*child, false);
+    }
+}
+
+}  // namespace
+
+std::string CompiledModel::Signature() {
+    return "evcm-" + std::to_string(Version);
+}
+
+void CompiledModel::Write(const EvaluationContext &context, std::ostream &out) {
+    EVALUATION_TRACE("cache", "write compiled model");
+    std::map<const EvalNode *, uint64_t> ids;
+    std::vector<const EvalNode *> order;
+    for (const auto &expression : context.expressions())
+        Number(expression.get(), ids, order);
+    for (const auto &variable : context.variables())
+        Number(variable.second.get(), ids, order);
+
+    out.write(Magic, sizeof(Magic));
+    WritePod(out, Version);
+    WritePod(out, static_cast<uint64_t>(order.size()));
+    for (auto node : order) {
+        WritePod(out, static_cast<uint8_t>(node->kind()));
+        switch (node->kind()) {
+            case EvalNode::Kind::Constant:
+                WritePod(out, static_cast<const ConstantNode *>(node)->value());
+                break;
+            case EvalNode::Kind::Variable:
+                WriteString(out, static_cast<const VariableNode *>(node)->name());
+                break;
+            case EvalNode::Kind::Expression: {
+                auto expression = static_cast<const ExpressionNode *>(node);
+                WriteString(out, expression->name());
+                WritePod(out, ids[expression->expression().get()]);
+                break;
+            }
+            case EvalNode::Kind::UnaryOperator: {
+                auto unary = static_cast<const UnaryOperatorNode *>(node);
+                if (unary->type().empty())
+                    throw std::runtime_error("Cannot compile an unnamed unary operator");
+                WriteString(out, unary->type());
+                WritePod(out, ids[unary->operand().get()]);
+                break;
+            }
+            case EvalNode::Kind::BinaryOperator: {
+                auto binary = static_cast<const BinaryOperatorNode *>(node);
+                if (binary->type().empty())
+                    throw std::runtime_error("Cannot compile an unnamed binary operator");
+                WriteString(out, binary->type());
+                WritePod(out, ids[binary->left().get()]);
+                WritePod(out, ids[binary->right().get()]);
+                break;
+            }
+        }
+    }
+    WritePod(out, static_cast<uint64_t>(context.expressions().size()));
+    for (const auto &expression : context.expressions())
+        WritePod(out, ids[expression.get()]);
+    if (!out) throw std::runtime_error("Failed to write compiled model");
+}
+
+EvaluationContext CompiledModel::Read(std::istream &in) {
+    EVALUATION_TRACE("cache", "read compiled model");
+    char magic[sizeof(Magic)];
+    if (!in.read(magic, sizeof(magic)) ||
+        std::memcmp(magic, Magic, sizeof(Magic)) != 0)
+        throw std::runtime_error("Not a compiled model");
+    if (ReadPod<uint32_t>(in) != Version)
+        throw std::runtime_error("Unsupported compiled model version");
+
+    auto count = ReadPod<uint64_t>(in);
+    std::vector<EvalNode::Ptr> nodes;
+    auto child = [&](uint64_t id) {
+        if (id >= nodes.size())
+            throw std::runtime_error("Corrupt compiled model");
+        return nodes[id];
+    };
+    auto context = EvaluationContext{};
+    for (uint64_t i = 0; i < count; ++i) {
+        switch (static_cast<EvalNode::Kind>(ReadPod<uint8_t>(in))) {
+            case EvalNode::Kind::Constant:
+                nodes.push_back(std::make_shared<ConstantNode>(ReadPod<double>(in)));
+                break;
+            case EvalNode::Kind::Variable: {
+                auto name = ReadString(in);
+                auto variable = std::make_shared<VariableNode>(name);
+                context.addVariable(name, variable);
+                nodes.push_back(variable);
+                break;
+            }
+            case EvalNode::Kind::Expression: {
+                auto name = ReadString(in);
+                auto expression = child(ReadPod<uint64_t>(in));
+                nodes.push_back(std::make_shared<ExpressionNode>(name, expression));
+                break;
+            }
+            case EvalNode::Kind::UnaryOperator: {
+                auto type = ReadString(in);
+                auto operand = child(ReadPod<uint64_t>(in));
+                nodes.push_back(std::make_shared<UnaryOperatorNode>(
+                    operand, EvaluationParser::GetUnaryFunction(type), type));
+                break;
+            }
+            case EvalNode::Kind::BinaryOperator: {
+                auto type = ReadString(in);
+                auto left = child(ReadPod<uint64_t>(in));
+                auto right = child(ReadPod<uint64_t>(in));
+                nodes.push_back(std::make_shared<BinaryOperatorNode>(
+                    left, right, EvaluationParser::GetBinaryFunction(type), type));
+                break;
+            }
+            default:
+                throw std::runtime_error("Corrupt compiled model");
+        }
+    }
+    auto expressions = ReadPod<uint64_t>(in);
+    for (uint64_t i = 0; i < expressions; ++i) {
+        auto node = child(ReadPod<uint64_t>(in));
+        if (node->kind() != EvalNode::Kind::Expression)
+            throw std::runtime_error("Corrupt compiled model");
+        auto expression = std::static_pointer_cast<ExpressionNode>(node);
+        context.addExpression(expression->name(), expression);
+    }
+    return context;
+}
@@ -0,0 +1,24 @@
+#ifndef COMPILED_MODEL_H
+#define COMPILED_MODEL_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "evaluation.h"
+
+//! Binary form of an EvaluationContext.
+/*!
+  Nodes are written once each, children before parents, so shared
+  subexpressions stay shared and reading back needs no XML parsing.
+*/
+class CompiledModel {
+   public:
+    static const uint32_t Version;
+    //! Identifies the format and anything else that changes the compiled form.
+    static std::string Signature();
+    static void Write(const EvaluationContext& context, std::ostream& out);
+    static EvaluationContext Read(std::istream& in);
+};
+
+#endif
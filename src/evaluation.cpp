@@ -1,9 +1,48 @@
 #include "evaluation.h"
+#include <unordered_set>
+
+#include "latency_stats.h"
+#include "profiler.h"
+#include "tracer.h"
+#include "workload.h"
 
 EvalNode::~EvalNode() {}
 
+std::vector<const EvalNode*> EvalNode::children() const {
+    switch (kind()) {
+        case Kind::Expression:
+            return {static_cast<const ExpressionNode*>(this)->expression().get()};
+        case Kind::UnaryOperator:
+            return {static_cast<const UnaryOperatorNode*>(this)->operand().get()};
+        case Kind::BinaryOperator: {
+            auto binary = static_cast<const BinaryOperatorNode*>(this);
+            return {binary->left().get(), binary->right().get()};
+        }
+        default:
+            return {};
+    }
+}
+
+const std::string& EvalNode::operatorType() const {
+    static const std::string none;
+    if (kind() == Kind::UnaryOperator)
+        return static_cast<const UnaryOperatorNode*>(this)->type();
+    if (kind() == Kind::BinaryOperator)
+        return static_cast<const BinaryOperatorNode*>(this)->type();
+    return none;
+}
+
+ExpressionLoader::~ExpressionLoader() {}
+
 void EvaluationContext::setVariable(const std::string& name, double value) {
+    if (d_recorder) d_recorder->setVariable(name, value);
     auto variable = d_variableMap.find(name);
+    if (variable == d_variableMap.end() && d_loader) {
+        auto node = std::make_shared<VariableNode>(name);
+        addVariable(name, node);
+        node->set(value);
+        return;
+    }
     if (variable == d_variableMap.end()) {
         // should LOG something gracefully
         std::cout << "Trying to set an unknown variable: " << name << std::endl;
@@ -11,3 +50,135 @@ void EvaluationContext::setVariable(const std::string& name, double value) {
     }
     variable->second->set(value);
 }
+
+double EvaluationContext::calc(const std::string& expression_name) {
+    LatencyStats::Timer timer(LatencyStats::Calc);
+    auto expression = d_expressionMap.find(expression_name);
+    if (expression == d_expressionMap.end() && d_loader &&
+        d_loader->load(expression_name, *this))
+        expression = d_expressionMap.find(expression_name);
+    if (expression == d_expressionMap.end())
+        throw std::runtime_error("Not found");
+    if (!d_recorder) return expression->second->eval();
+    auto result = expression->second->eval();
+    d_recorder->calc(expression_name, result);
+    return result;
+}
+
+void EvaluationContext::instrument(const ExpressionNode::Ptr& expression) {
+    auto evaluator = expression->expression();
+    if (d_profiling)
+        evaluator = std::make_shared<ProfiledNode>(
+            d_profiler, d_profiler->add(expression.get()), evaluator);
+    if (d_tracing)
+        evaluator = std::make_shared<TracedNode>(
+            Tracer::Intern(expression->name()), evaluator);
+    expression->setEvaluator(evaluator);
+}
+
+void EvaluationContext::instrumentAll() {
+    for (const auto& expression : d_expressions)
+        instrument(std::static_pointer_cast<ExpressionNode>(expression));
+}
+
+void EvaluationContext::replaceDefinitions(EvaluationContext& other) {
+    d_expressionMap.swap(other.d_expressionMap);
+    d_variableMap.swap(other.d_variableMap);
+    d_expressions.swap(other.d_expressions);
+    if (d_profiling || d_tracing) instrumentAll();
+}
+
+void EvaluationContext::enableProfiling(bool hardwareCounters) {
+    if (!d_profiler) d_profiler = std::make_shared<Profiler>();
+    d_profiler->useHardwareCounters(hardwareCounters);
+    if (d_profiling) return;
+    d_profiling = true;
+    instrumentAll();
+}
+
+void EvaluationContext::disableProfiling() {
+    if (!d_profiling) return;
+    d_profiling = false;
+    instrumentAll();
+}
+
+void EvaluationContext::enableTracing() {
+    if (d_tracing) return;
+    d_tracing = true;
+    instrumentAll();
+}
+
+void EvaluationContext::disableTracing() {
+    if (!d_tracing) return;
+    d_tracing = false;
+    instrumentAll();
+}
+
+MemoryUsage EvaluationContext::memoryUsage() const {
+    MemoryUsage usage;
+    std::unordered_set<const EvalNode*> seen;
+    std::vector<const EvalNode*> stack;
+    for (const auto& expression : d_expressions) stack.push_back(expression.get());
+    for (const auto& variable : d_variableMap) stack.push_back(variable.second.get());
+    while (!stack.empty()) {
+        auto node = stack.back();
+        stack.pop_back();
+        if (!seen.insert(node).second) continue;
+        auto type = static_cast<size_t>(node->kind());
+        ++usage.nodeCount[type];
+        switch (node->kind()) {
+            case EvalNode::Kind::Constant:
+                usage.nodes[type] += MemoryUsage::SharedBlock(sizeof(ConstantNode));
+                break;
+            case EvalNode::Kind::Variable: {
+                auto variable = static_cast<const VariableNode*>(node);
+                usage.nodes[type] += MemoryUsage::SharedBlock(sizeof(VariableNode));
+                usage.names += MemoryUsage::String(variable->name());
+                break;
+            }
+            case EvalNode::Kind::Expression: {
+                auto expression = static_cast<const ExpressionNode*>(node);
+                usage.nodes[type] += MemoryUsage::SharedBlock(sizeof(ExpressionNode));
+                usage.names += MemoryUsage::String(expression->name());
+                // The wrappers instrument() puts around the expression.
+                if (d_profiling) usage.caches += MemoryUsage::SharedBlock(sizeof(ProfiledNode));
+                if (d_tracing) usage.caches += MemoryUsage::SharedBlock(sizeof(TracedNode));
+                stack.push_back(expression->expression().get());
+                break;
+            }
+            case EvalNode::Kind::UnaryOperator: {
+                auto unary = static_cast<const UnaryOperatorNode*>(node);
+                usage.nodes[type] += MemoryUsage::SharedBlock(sizeof(UnaryOperatorNode));
+                usage.names += MemoryUsage::String(unary->type());
+                stack.push_back(unary->operand().get());
+                break;
+            }
+            case EvalNode::Kind::BinaryOperator: {
+                auto binary = static_cast<const BinaryOperatorNode*>(node);
+                usage.nodes[type] += MemoryUsage::SharedBlock(sizeof(BinaryOperatorNode));
+                usage.names += MemoryUsage::String(binary->type());
+                stack.push_back(binary->left().get());
+                stack.push_back(binary->right().get());
+                break;
+            }
+        }
+    }
+    usage.constantPool = usage.nodes[MemoryUsage::Constant];
+
+    // Red-black tree nodes: colour and three links, then the value.
+    const size_t tree_node = sizeof(int) + 3 * sizeof(void*);
+    for (const auto& expression : d_expressionMap)
+        usage.expressionMap += MemoryUsage::Block(tree_node + sizeof(expression)) +
+                               MemoryUsage::String(expression.first);
+    for (const auto& variable : d_variableMap)
+        usage.variableMap += MemoryUsage::Block(tree_node + sizeof(variable)) +
+                             MemoryUsage::String(variable.first);
+    if (d_expressions.capacity())
+        usage.expressionList =
+            MemoryUsage::Block(d_expressions.capacity() * sizeof(EvalNode::Ptr));
+
+    if (d_profiler) usage.caches += d_profiler->memoryUsage();
+    if (d_loader) usage.caches += d_loader->memoryUsage();
+    if (d_loadDocumentPeak) usage.loadPeak = d_loadDocumentPeak + usage.total();
+    return usage;
+}
@@ -10,25 +10,42 @@
 #include <vector>
 #include <map>
 
+#include "memory_usage.h"
+
 class EvalNode {
     public:
     using Ptr = std::shared_ptr<EvalNode>;
+    //! Concrete node type, used to walk and serialize a graph.
+    enum class Kind { Constant, Variable, Expression, UnaryOperator, BinaryOperator };
     virtual double eval() = 0;
+    virtual Kind kind() const = 0;
     virtual ~EvalNode();
+    //! The body of an expression, the operands of an operator, left first.
+    std::vector<const EvalNode*> children() const;
+    //! "+", "cos", ... for operators, empty for other nodes.
+    const std::string& operatorType() const;
 };
 
 class ExpressionNode : public EvalNode {
     EvalNode::Ptr d_expression;
     std::string d_name;
+    // What eval() runs: the expression itself or an instrumented wrapper.
+    EvalNode::Ptr d_evaluator;
     public:
     using Ptr = std::shared_ptr<ExpressionNode>;
     virtual double eval() {
-        return d_expression->eval();
+        return d_evaluator->eval();
     }
-    ExpressionNode(const std::string &name, const EvalNode::Ptr &expression)
-        : d_expression(expression), d_name(name) {
-      std::cout << "Expression created: " << d_name << std::endl;
+    virtual Kind kind() const { return Kind::Expression; }
+    const std::string& name() const { return d_name; }
+    const EvalNode::Ptr& expression() const { return d_expression; }
+    const EvalNode::Ptr& evaluator() const { return d_evaluator; }
+    //! Runs `evaluator` in place of the expression; null restores it.
+    void setEvaluator(const EvalNode::Ptr& evaluator) {
+        d_evaluator = evaluator ? evaluator : d_expression;
     }
+    ExpressionNode(const std::string &name, const EvalNode::Ptr &expression)
+        : d_expression(expression), d_name(name), d_evaluator(expression) {}
     
 };
 
@@ -38,14 +55,14 @@ class ConstantNode : public EvalNode {
     virtual double eval() {
         return d_value;
     }
+    virtual Kind kind() const { return Kind::Constant; }
+    double value() const { return d_value; }
     //! Constant node.
     /*!
       Right now, values are double only but takes anything that cast to a double.
     */
     template<class T>
-    ConstantNode(const T& value) : d_value(static_cast<double>(value)) {
-      std::cout << "Constant created: " << d_value << std::endl;
-    }
+    ConstantNode(const T& value) : d_value(static_cast<double>(value)) {}
 };
 
 class VariableNode: public EvalNode {
@@ -60,9 +77,9 @@ class VariableNode: public EvalNode {
             return d_value;
         }
     };
-    VariableNode(const std::string& name) : d_name(name) {
-      std::cout << "Variable created: " << d_name << std::endl;
-    }
+    virtual Kind kind() const { return Kind::Variable; }
+    const std::string& name() const { return d_name; }
+    VariableNode(const std::string& name) : d_name(name) {}
     void set(double value) {
         d_value = value;
     }
@@ -74,14 +91,18 @@ class UnaryOperatorNode : public EvalNode {
     private:
     EvalNode::Ptr d_node;
     Function d_function;
+    std::string d_type;
     public:
     virtual double eval() {
         return d_function(d_node->eval());   
     };
-    UnaryOperatorNode(const EvalNode::Ptr &node, const Function &function)
-        : d_node(node), d_function(function) {
-      std::cout << "UnaryOperatorNode created: " << std::endl;
-    }
+    virtual Kind kind() const { return Kind::UnaryOperator; }
+    const EvalNode::Ptr& operand() const { return d_node; }
+    //! Operator name as given to EvaluationParser::GetUnaryFunction.
+    const std::string& type() const { return d_type; }
+    UnaryOperatorNode(const EvalNode::Ptr &node, const Function &function,
+                      const std::string &type = std::string())
+        : d_node(node), d_function(function), d_type(type) {}
 };
 
 class BinaryOperatorNode : public EvalNode {
@@ -90,25 +111,59 @@ class BinaryOperatorNode : public EvalNode {
     private:
     EvalNode::Ptr d_leftNode, d_rightNode;
     Function d_function;
+    std::string d_type;
     public:
     virtual double eval() {
         return d_function(d_leftNode->eval(), d_rightNode->eval());   
     };
-    BinaryOperatorNode(const EvalNode::Ptr& leftNode, const EvalNode::Ptr& rightNode, const Function& function) :
-        d_leftNode(leftNode), d_rightNode(rightNode), d_function(function) {
-      std::cout << "BinaryOperatorNode created: " << std::endl;
-    }
+    virtual Kind kind() const { return Kind::BinaryOperator; }
+    const EvalNode::Ptr& left() const { return d_leftNode; }
+    const EvalNode::Ptr& right() const { return d_rightNode; }
+    //! Operator name as given to EvaluationParser::GetBinaryFunction.
+    const std::string& type() const { return d_type; }
+    BinaryOperatorNode(const EvalNode::Ptr& leftNode, const EvalNode::Ptr& rightNode, const Function& function,
+                       const std::string& type = std::string()) :
+        d_leftNode(leftNode), d_rightNode(rightNode), d_function(function), d_type(type) {}
+};
+
+class EvaluationContext;
+class Profiler;
+class WorkloadRecorder;
+
+//! Builds expressions of a context on demand.
+class ExpressionLoader {
+    public:
+    using Ptr = std::shared_ptr<ExpressionLoader>;
+    //! Adds expression `name` (and what it depends on) to the context.
+    /*!
+      Returns false when the model does not define `name`.
+    */
+    virtual bool load(const std::string& name, EvaluationContext& context) = 0;
+    //! Heap bytes held by the loader itself.
+    virtual size_t memoryUsage() const { return 0; }
+    virtual ~ExpressionLoader();
 };
 
 class EvaluationContext {
-    private:
+    public:
     using ExpressionMap = std::map<std::string, ExpressionNode::Ptr>;
     using VariableMap= std::map<std::string, VariableNode::Ptr>;
+    private:
     ExpressionMap d_expressionMap;
     VariableMap d_variableMap;
     // This is a collection of expressions
     // The order of evaluation matters
     std::vector<EvalNode::Ptr> d_expressions;
+    ExpressionLoader::Ptr d_loader;
+    std::shared_ptr<Profiler> d_profiler;
+    std::shared_ptr<WorkloadRecorder> d_recorder;
+    bool d_profiling = false;
+    bool d_tracing = false;
+    // pugixml bytes at the peak of the load, when built by EvaluationParser.
+    size_t d_loadDocumentPeak = 0;
+    // Wraps the expression according to the profiling and tracing flags.
+    void instrument(const ExpressionNode::Ptr& expression);
+    void instrumentAll();
     public:
     // We need
     bool isKnownExpression(const std::string& name) {
@@ -126,23 +181,74 @@ class EvaluationContext {
     void addExpression(const std::string& name, const ExpressionNode::Ptr& expression) {
         d_expressionMap[name] = expression;
         d_expressions.push_back(expression);
+        if (d_profiling || d_tracing) instrument(expression);
     }
     void addVariable(const std::string& name, const VariableNode::Ptr& variable) {
         d_variableMap[name] = variable;
     }
+    //! Expressions in definition order (a redefined name appears twice).
+    const std::vector<EvalNode::Ptr>& expressions() const {
+        return d_expressions;
+    }
+    const VariableMap& variables() const {
+        return d_variableMap;
+    }
+    //! Expressions not known to the context are requested from the loader.
+    void setLoader(const ExpressionLoader::Ptr& loader) {
+        d_loader = loader;
+    }
+    //! Takes the expressions and variables of `other` in place of its own.
+    /*!
+      Profiling, tracing, the recorder and the loader of this context stay
+      as they are and apply to the new expressions; `other` is left with
+      the previous ones.
+    */
+    void replaceDefinitions(EvaluationContext& other);
     
+    //! Times every expression evaluation from now on.
+    /*!
+      Expressions are wrapped in timing nodes, so nothing is measured, and
+      nothing costs anything, while profiling is off. Measurements add up
+      across enable/disable cycles until the profiler is reset. Not for
+      concurrent evaluation; expression nodes shared with another context
+      are profiled in both. With hardwareCounters, perf events are also
+      read around every expression (see PerfCounters).
+    */
+    void enableProfiling(bool hardwareCounters = false);
+    void disableProfiling();
+    bool isProfiling() const { return d_profiling; }
+    //! Measurements so far; null if profiling was never enabled.
+    const std::shared_ptr<Profiler>& profiler() const { return d_profiler; }
+
+    //! Records a span per expression evaluation while the Tracer records.
+    /*!
+      Expressions are wrapped the same way as for profiling, and both can
+      be on at once.
+    */
+    void enableTracing();
+    void disableTracing();
+    bool isTracing() const { return d_tracing; }
+
+    //! Logs setVariable and calc calls from now on; null stops.
+    void setRecorder(const std::shared_ptr<WorkloadRecorder>& recorder) {
+        d_recorder = recorder;
+    }
+
+    //! Current heap footprint, broken down by kind of data.
+    MemoryUsage memoryUsage() const;
+    //! Recorded by EvaluationParser for MemoryUsage::loadPeak.
+    void setLoadDocumentPeak(size_t bytes) { d_loadDocumentPeak = bytes; }
+
     //! Set a variable to a given value when it exists.
     /*!
-      Doesn't do anything if variable isn't known to context.
+      Doesn't do anything if variable isn't known to context. With a loader,
+      unknown variables are created since their expressions may not be
+      loaded yet.
     */
     void setVariable(const std::string& name, double value);
     
     
-    double calc(const std::string& expression_name) {
-        if (d_expressionMap.find(expression_name) == d_expressionMap.end())
-            throw std::runtime_error("Not found");
-        return d_expressionMap[expression_name]->eval();
-    }
+    double calc(const std::string& expression_name);
     
     
 };
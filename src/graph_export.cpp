@@ -0,0 +1,259 @@
+#include "graph_export.h"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "model_analyzer.h"
+#include "profiler.h"
+
+namespace {
+
+struct Vertex {
+    const EvalNode *node;
+    std::string kind;
+    std::string label;
+    bool measured = false;
+    Profiler::Entry entry;
+    size_t fanOut = 0;
+    // Cost along the critical path: exclusive seconds or estimated cycles.
+    double weight = 0;
+    bool critical = false;
+};
+
+struct Graph {
+    std::vector<Vertex> vertices;
+    std::vector<std::pair<size_t, size_t>> edges;
+    std::vector<bool> criticalEdges;
+    std::vector<size_t> path;
+    bool profiled = false;
+    double exclusiveSeconds = 0;
+};
+
+Vertex Describe(const EvalNode *node) {
+    Vertex vertex;
+    vertex.node = node;
+    switch (node->kind()) {
+        case EvalNode::Kind::Constant: {
+            char value[32];
+            std::snprintf(value, sizeof(value), "%.17g",
+                          static_cast<const ConstantNode *>(node)->value());
+            vertex.kind = "constant";
+            vertex.label = value;
+            break;
+        }
+        case EvalNode::Kind::Variable:
+            vertex.kind = "variable";
+            vertex.label = static_cast<const VariableNode *>(node)->name();
+            break;
+        case EvalNode::Kind::Expression:
+            vertex.kind = "expression";
+            vertex.label = static_cast<const ExpressionNode *>(node)->name();
+            break;
+        case EvalNode::Kind::UnaryOperator:
+            vertex.kind = "unary";
+            vertex.label = node->operatorType();
+            break;
+        case EvalNode::Kind::BinaryOperator:
+            vertex.kind = "binary";
+            vertex.label = node->operatorType();
+            break;
+    }
+    vertex.weight = ModelAnalyzer::Cycles(node->kind(), node->operatorType());
+    return vertex;
+}
+
+Graph Build(const EvaluationContext &context, GraphExport::Detail detail) {
+    Graph graph;
+    std::unordered_map<const EvalNode *, size_t> ids;
+    std::vector<size_t> pending;
+    auto vertex = [&](const EvalNode *node) {
+        auto known = ids.find(node);
+        if (known != ids.end()) return known->second;
+        ids[node] = graph.vertices.size();
+        graph.vertices.push_back(Describe(node));
+        pending.push_back(graph.vertices.size() - 1);
+        return graph.vertices.size() - 1;
+    };
+    for (const auto &expression : context.expressions()) vertex(expression.get());
+    for (const auto &variable : context.variables()) vertex(variable.second.get());
+
+    while (!pending.empty()) {
+        auto id = pending.back();
+        pending.pop_back();
+        auto node = graph.vertices[id].node;
+        if (detail == GraphExport::Nodes) {
+            for (auto child : node->children()) graph.edges.emplace_back(id, vertex(child));
+            continue;
+        }
+        if (node->kind() != EvalNode::Kind::Expression) continue;
+        // The body, down to the expressions and variables it references.
+        std::set<size_t> references;
+        std::vector<const EvalNode *> body{
+            static_cast<const ExpressionNode *>(node)->expression().get()};
+        while (!body.empty()) {
+            auto part = body.back();
+            body.pop_back();
+            if (part->kind() == EvalNode::Kind::Expression ||
+                part->kind() == EvalNode::Kind::Variable) {
+                references.insert(vertex(part));
+                continue;
+            }
+            graph.vertices[id].weight += ModelAnalyzer::Cycles(part->kind(), part->operatorType());
+            auto children = part->children();
+            body.insert(body.end(), children.begin(), children.end());
+        }
+        for (auto reference : references) graph.edges.emplace_back(id, reference);
+    }
+    for (const auto &edge : graph.edges) ++graph.vertices[edge.second].fanOut;
+
+    if (context.profiler()) {
+        auto measurements = context.profiler()->measurements();
+        graph.profiled = !measurements.empty();
+        for (auto &v : graph.vertices) {
+            if (graph.profiled) v.weight = 0;
+            if (v.node->kind() != EvalNode::Kind::Expression) continue;
+            auto measured =
+                measurements.find(static_cast<const ExpressionNode *>(v.node)->name());
+            if (measured == measurements.end()) continue;
+            v.measured = true;
+            v.entry = measured->second;
+            v.weight = v.entry.exclusiveSeconds;
+            graph.exclusiveSeconds += v.entry.exclusiveSeconds;
+        }
+    }
+
+    // Heaviest chain, children before parents.
+    std::vector<std::vector<size_t>> out(graph.vertices.size());
+    for (const auto &edge : graph.edges) out[edge.first].push_back(edge.second);
+    const auto none = static_cast<size_t>(-1);
+    std::vector<double> best(graph.vertices.size(), -1);
+    std::vector<size_t> next(graph.vertices.size(), none);
+    for (size_t root = 0; root < graph.vertices.size(); ++root) {
+        std::vector<std::pair<size_t, bool>> stack{{root, false}};
+        while (!stack.empty()) {
+            auto id = stack.back().first;
+            if (best[id] >= 0) {
+                stack.pop_back();
+                continue;
+            }
+            if (!stack.back().second) {
+                stack.back().second = true;
+                for (auto child : out[id])
+                    if (best[child] < 0) stack.emplace_back(child, false);
+                continue;
+            }
+            stack.pop_back();
+            best[id] = graph.vertices[id].weight;
+            for (auto child : out[id]) {
+                if (next[id] == none || best[child] > best[next[id]]) next[id] = child;
+            }
+            if (next[id] != none) best[id] += best[next[id]];
+        }
+    }
+    if (!graph.vertices.empty()) {
+        size_t start = std::max_element(best.begin(), best.end()) - best.begin();
+        for (auto id = start; id != none; id = next[id]) {
+            graph.path.push_back(id);
+            graph.vertices[id].critical = true;
+        }
+    }
+    std::set<std::pair<size_t, size_t>> onPath;
+    for (size_t i = 1; i < graph.path.size(); ++i)
+        onPath.insert(std::make_pair(graph.path[i - 1], graph.path[i]));
+    for (const auto &edge : graph.edges) graph.criticalEdges.push_back(onPath.count(edge) > 0);
+    return graph;
+}
+
+std::string Escape(const std::string &text) {
+    std::string result;
+    for (auto c : text) {
+        if (c == '"' || c == '\\') result += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            result += escaped;
+            continue;
+        }
+        result += c;
+    }
+    return result;
+}
+
+}  // namespace
+
+void GraphExport::WriteDot(const EvaluationContext &context, std::ostream &out, Detail detail) {
+    auto graph = Build(context, detail);
+    double hottest = 0;
+    for (const auto &v : graph.vertices) hottest = std::max(hottest, v.entry.exclusiveSeconds);
+
+    out << "digraph model {\n"
+        << "  node [fontname=\"Helvetica\", style=filled, fillcolor=white];\n";
+    char line[256];
+    for (size_t id = 0; id < graph.vertices.size(); ++id) {
+        const auto &v = graph.vertices[id];
+        std::string label = Escape(v.label);
+        if (v.measured) {
+            std::snprintf(line, sizeof(line),
+                          "\\n%llu calls, %.3g us incl, %.3g us excl (%.1f%%)",
+                          static_cast<unsigned long long>(v.entry.calls),
+                          v.entry.inclusiveSeconds * 1e6, v.entry.exclusiveSeconds * 1e6,
+                          graph.exclusiveSeconds > 0
+                              ? 100 * v.entry.exclusiveSeconds / graph.exclusiveSeconds
+                              : 0.0);
+            label += line;
+        }
+        if (v.fanOut > 1) label += "\\nfan-out " + std::to_string(v.fanOut);
+
+        const char *shape = "circle";
+        if (v.kind == "expression") shape = "box";
+        if (v.kind == "variable") shape = "ellipse";
+        if (v.kind == "constant") shape = "plaintext";
+        // White to red with the share of the hottest expression.
+        int fade = hottest > 0 ? static_cast<int>(175 * v.entry.exclusiveSeconds / hottest) : 0;
+        std::snprintf(line, sizeof(line), "fillcolor=\"#ff%02x%02x\"", 255 - fade, 255 - fade);
+        out << "  n" << id << " [label=\"" << label << "\", shape=" << shape << ", " << line
+            << (v.critical ? ", color=red, penwidth=3" : "") << "];\n";
+    }
+    for (size_t e = 0; e < graph.edges.size(); ++e) {
+        out << "  n" << graph.edges[e].first << " -> n" << graph.edges[e].second
+            << (graph.criticalEdges[e] ? " [color=red, penwidth=3]" : "") << ";\n";
+    }
+    out << "}\n";
+}
+
+void GraphExport::WriteJson(const EvaluationContext &context, std::ostream &out, Detail detail) {
+    auto graph = Build(context, detail);
+    out << "{\"profiled\": " << (graph.profiled ? "true" : "false") << ",\n\"nodes\": [";
+    char line[256];
+    for (size_t id = 0; id < graph.vertices.size(); ++id) {
+        const auto &v = graph.vertices[id];
+        out << (id ? ",\n  " : "\n  ") << "{\"id\": " << id << ", \"kind\": \"" << v.kind
+            << "\", \"label\": \"" << Escape(v.label) << "\", \"fan_out\": " << v.fanOut
+            << ", \"critical\": " << (v.critical ? "true" : "false");
+        if (v.measured) {
+            std::snprintf(line, sizeof(line),
+                          ", \"calls\": %llu, \"inclusive_seconds\": %.9g, "
+                          "\"exclusive_seconds\": %.9g",
+                          static_cast<unsigned long long>(v.entry.calls),
+                          v.entry.inclusiveSeconds, v.entry.exclusiveSeconds);
+            out << line;
+        } else if (!graph.profiled) {
+            std::snprintf(line, sizeof(line), ", \"estimated_cycles\": %.9g", v.weight);
+            out << line;
+        }
+        out << "}";
+    }
+    out << "\n],\n\"edges\": [";
+    for (size_t e = 0; e < graph.edges.size(); ++e) {
+        out << (e ? ",\n  " : "\n  ") << "{\"from\": " << graph.edges[e].first
+            << ", \"to\": " << graph.edges[e].second
+            << ", \"critical\": " << (graph.criticalEdges[e] ? "true" : "false") << "}";
+    }
+    out << "\n],\n\"critical_path\": [";
+    for (size_t i = 0; i < graph.path.size(); ++i) out << (i ? ", " : "") << graph.path[i];
+    out << "]}\n";
+}
@@ -0,0 +1,31 @@
+#ifndef GRAPH_EXPORT_H
+#define GRAPH_EXPORT_H
+
+#include <iostream>
+
+#include "evaluation.h"
+
+//! Writes the graph of a context as Graphviz DOT or JSON.
+/*!
+  At Expressions detail, vertices are the expressions and variables and an
+  edge goes from an expression to each one its definition references; at
+  Nodes detail every distinct node is a vertex. Vertices carry their
+  fan-out (how many vertices use them) and, when the context was profiled,
+  the calls, inclusive and exclusive time of expressions; DOT colours
+  expressions by their share of exclusive time.
+
+  The critical path, highlighted in both formats, is the chain of
+  dependencies with the most exclusive time, or with the most estimated
+  cycles (see ModelAnalyzer) when there is no profile.
+*/
+class GraphExport {
+   public:
+    enum Detail { Expressions, Nodes };
+
+    static void WriteDot(const EvaluationContext& context, std::ostream& out,
+                         Detail detail = Expressions);
+    static void WriteJson(const EvaluationContext& context, std::ostream& out,
+                          Detail detail = Expressions);
+};
+
+#endif
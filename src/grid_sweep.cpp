@@ -0,0 +1,124 @@
+#include "grid_sweep.h"
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+
+#include "tracer.h"
+
+GridSweep::Axis GridSweep::Axis::Linear(const std::string& name, double low, double high,
+                                        size_t points) {
+    Axis axis{name, std::vector<double>(points)};
+    for (size_t i = 0; i < points; ++i)
+        axis.values[i] = points == 1 ? low : low + (high - low) * i / (points - 1);
+    if (points > 1) axis.values.back() = high;
+    return axis;
+}
+
+GridSweep::GridSweep(EvaluationContext& context, const std::vector<std::string>& outputs)
+    : d_batch(context, outputs, false) {}
+
+size_t GridSweep::Points(const std::vector<Axis>& axes) {
+    size_t points = 1;
+    for (const auto& axis : axes) points *= axis.values.size();
+    return points;
+}
+
+std::vector<double> GridSweep::run(const std::vector<Axis>& axes) {
+    std::vector<double> results(d_batch.d_outputs.size() * Points(axes));
+    run(axes, results.data());
+    return results;
+}
+
+void GridSweep::run(const std::vector<Axis>& axes, double* results) {
+    EVALUATION_TRACE("sweep", "run");
+    const size_t k = axes.size();
+    const size_t none = static_cast<size_t>(-1);
+    if (!k) throw std::runtime_error("A sweep needs at least one axis");
+    std::set<std::string> names;
+    for (const auto& axis : axes) {
+        if (axis.values.empty()) throw std::runtime_error("Axis " + axis.name + " is empty");
+        if (!names.insert(axis.name).second)
+            throw std::runtime_error("Axis " + axis.name + " is repeated");
+    }
+
+    // Level of every register: the innermost axis it depends on, plus one.
+    auto& batch = d_batch;
+    const size_t tile = batch.d_tileRows;
+    std::vector<size_t> level(batch.d_sources.size(), 0);
+    std::vector<size_t> axisSlot(k, none);
+    for (size_t s = 0; s < level.size(); ++s) batch.d_sources[s] = batch.slot(s);
+    for (const auto& input : batch.d_inputs) {
+        auto axis = std::find_if(axes.begin(), axes.end(),
+                                 [&input](const Axis& a) { return a.name == input.name; });
+        if (axis == axes.end()) {
+            std::fill_n(batch.slot(input.slot), tile, input.variable->eval());
+            continue;
+        }
+        level[input.slot] = axis - axes.begin() + 1;
+        axisSlot[axis - axes.begin()] = input.slot;
+    }
+    auto unary = [](BatchEvaluator::Op op) { return op <= BatchEvaluator::Op::Unary; };
+    for (const auto& instruction : batch.d_program) {
+        level[instruction.out] = level[instruction.left];
+        if (!unary(instruction.op))
+            level[instruction.out] = std::max(level[instruction.out], level[instruction.right]);
+    }
+    // Operands come before their use in the program and have no higher
+    // level, so ordering by level keeps it valid.
+    std::stable_sort(batch.d_program.begin(), batch.d_program.end(),
+                     [&level](const BatchEvaluator::Instruction& a,
+                              const BatchEvaluator::Instruction& b) {
+                         return level[a.out] < level[b.out];
+                     });
+    std::vector<size_t> bounds(k + 2, batch.d_program.size());
+    d_levels.assign(k + 1, 0);
+    for (size_t i = batch.d_program.size(); i-- > 0;) {
+        auto l = level[batch.d_program[i].out];
+        bounds[l] = i;
+        ++d_levels[l];
+    }
+    for (size_t l = k; l-- > 0;) bounds[l] = std::min(bounds[l], bounds[l + 1]);
+
+    // Outer levels run on the first row of their registers; those the
+    // innermost level or the results read are copied across the tile.
+    std::vector<std::vector<size_t>> broadcast(k);
+    std::vector<bool> wide(level.size(), false);
+    for (size_t i = bounds[k]; i < batch.d_program.size(); ++i) {
+        const auto& instruction = batch.d_program[i];
+        wide[instruction.left] = true;
+        if (!unary(instruction.op)) wide[instruction.right] = true;
+    }
+    for (const auto& output : batch.d_outputs) wide[output.slot] = true;
+    for (size_t s = 0; s < level.size(); ++s)
+        if (wide[s] && level[s] > 0 && level[s] < k) broadcast[level[s]].push_back(s);
+
+    const size_t points = Points(axes);
+    const size_t inner = axes.back().values.size();
+    batch.execute(tile, bounds[0], bounds[1]);
+    std::vector<size_t> index(k - 1, 0);
+    size_t changed = 0;
+    for (size_t row = 0; row < points / inner; ++row) {
+        for (size_t a = changed; a + 1 < k; ++a) {
+            if (axisSlot[a] != none) batch.slot(axisSlot[a])[0] = axes[a].values[index[a]];
+            batch.execute(1, bounds[a + 1], bounds[a + 2]);
+            for (auto s : broadcast[a + 1])
+                std::fill_n(batch.slot(s) + 1, tile - 1, batch.slot(s)[0]);
+        }
+        for (size_t start = 0; start < inner; start += tile) {
+            auto count = std::min(tile, inner - start);
+            if (axisSlot[k - 1] != none)
+                std::copy_n(axes.back().values.data() + start, count,
+                            batch.slot(axisSlot[k - 1]));
+            batch.execute(count, bounds[k], bounds[k + 1]);
+            for (size_t o = 0; o < batch.d_outputs.size(); ++o)
+                std::copy_n(batch.slot(batch.d_outputs[o].slot), count,
+                            results + o * points + row * inner + start);
+        }
+        // Next point of the outer axes, odometer style.
+        for (size_t a = k - 1; a-- > 0;) {
+            changed = a;
+            if (++index[a] < axes[a].values.size()) break;
+            index[a] = 0;
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef GRID_SWEEP_H
+#define GRID_SWEEP_H
+
+#include <string>
+#include <vector>
+
+#include "batch_evaluator.h"
+#include "evaluation.h"
+
+//! Evaluates expressions over the cartesian grid of a few variables.
+/*!
+  The grid is walked as nested loops, the first axis outermost. Every
+  instruction of the compiled outputs is given the loop level of the
+  innermost axis it depends on, and runs only when a variable of that
+  level changes: a subexpression of the first axis alone is computed once
+  per value of that axis, one of no axis once per sweep. The innermost
+  level runs a tile of the last axis at a time, through the batch
+  kernels; the outer levels run on scalars. Variables that are not axes
+  keep the value the context gives them.
+
+  Results are dense, one grid per output with the last axis contiguous:
+  the value of output o at point (i0, i1, ..., ik) is at
+  o * Points(axes) + ((i0 * n1 + i1) * n2 + ...) + ik. They match calc()
+  bit for bit.
+*/
+class GridSweep {
+   public:
+    struct Axis {
+        std::string name;
+        std::vector<double> values;
+
+        //! `points` values evenly spaced from `low` to `high`, both included.
+        static Axis Linear(const std::string& name, double low, double high, size_t points);
+    };
+
+   private:
+    BatchEvaluator d_batch;
+    std::vector<size_t> d_levels;
+
+   public:
+    //! Compiles `outputs` of `context`, which must outlive the sweep.
+    GridSweep(EvaluationContext& context, const std::vector<std::string>& outputs);
+
+    //! Writes outputs().size() * Points(axes) values to `results`.
+    /*!
+      Throws when `axes` is empty, or has an empty or repeated axis.
+    */
+    void run(const std::vector<Axis>& axes, double* results);
+    std::vector<double> run(const std::vector<Axis>& axes);
+
+    std::vector<std::string> outputs() const { return d_batch.outputs(); }
+    //! Instructions at each loop level of the last run.
+    /*!
+      Level 0 ran once, level k once per point of the first k axes.
+    */
+    const std::vector<size_t>& levels() const { return d_levels; }
+
+    static size_t Points(const std::vector<Axis>& axes);
+};
+
+#endif
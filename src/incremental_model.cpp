@@ -0,0 +1,144 @@
+#include "incremental_model.h"
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+
+#include "latency_stats.h"
+#include "model_cache.h"
+#include "model_index.h"
+#include "model_library.h"
+#include "parser.h"
+#include "tracer.h"
+
+namespace {
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+}  // namespace
+
+IncrementalModel::IncrementalModel(const std::string &fname) : d_fname(fname) {
+    reload();
+}
+
+uint64_t IncrementalModel::Hash(const char *data, size_t size) {
+    // FNV-1a over the significant characters.
+    uint64_t hash = 14695981039346656037ULL;
+    char quote = 0;
+    for (size_t i = 0; i < size; ++i) {
+        auto c = data[i];
+        if (quote) {
+            if (c == quote) quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            continue;
+        }
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+IncrementalModel::ReloadReport IncrementalModel::reload() {
+    ReloadReport report;
+    LatencyStats::Timer timer(LatencyStats::Load);
+    auto start = std::chrono::steady_clock::now();
+
+    // Index the file and, in place, each distinct included file.
+    std::vector<std::unique_ptr<std::string>> contents;
+    ModelIndex index;
+    std::set<uint64_t> seen;
+    Tracer::Span scan("load", "scan definitions", Tracer::Detail(d_fname));
+    std::function<void(const std::string &)> read = [&](const std::string &path) {
+        contents.emplace_back(new std::string(ModelLibrary::ReadFile(path)));
+        const auto &text = *contents.back();
+        if (!seen.insert(ModelCache::Hash(text.data(), text.size())).second)
+            return;
+        index.scan(text.data(), text.size(), [&](const std::string &include) {
+            read(ModelLibrary::Resolve(path, include));
+        });
+    };
+    read(d_fname);
+    const auto &found = index.definitions();
+    std::vector<uint64_t> hashes;
+    hashes.reserve(found.size());
+    for (const auto &definition : found)
+        hashes.push_back(Hash(definition.data, definition.length));
+    report.scanSeconds = SecondsSince(start);
+    scan.end();
+    EVALUATION_TRACE("build", "rebuild changed definitions");
+
+    start = std::chrono::steady_clock::now();
+    // The n-th definition of a name is matched with its previous n-th one.
+    std::map<std::string, std::vector<size_t>> previousByName;
+    for (size_t i = 0; i < d_definitions.size(); ++i)
+        previousByName[d_definitions[i].name].push_back(i);
+    std::map<std::string, size_t> occurrences;
+
+    auto context = EvaluationContext{};
+    for (const auto &variable : d_context.variables())
+        context.addVariable(variable.first, variable.second);
+    std::vector<Definition> definitions(found.size());
+    for (size_t i = 0; i < found.size(); ++i) {
+        auto &current = definitions[i];
+        current.name = found[i].name;
+        current.hash = hashes[i];
+
+        const Definition *previous = nullptr;
+        auto occurrence = occurrences[current.name]++;
+        auto candidates = previousByName.find(current.name);
+        if (candidates != previousByName.end() &&
+            occurrence < candidates->second.size())
+            previous = &d_definitions[candidates->second[occurrence]];
+
+        bool reuse = previous && previous->hash == current.hash;
+        if (!reuse) ++report.changed;
+        // Same text: reusable if every reference still means the same node.
+        for (size_t r = 0; reuse && r < previous->references.size(); ++r) {
+            const auto &reference = previous->references[r];
+            auto target = index.before(reference.first, i);
+            if (target == ModelIndex::npos || reference.second == ModelIndex::npos) {
+                reuse = target == reference.second;
+            } else {
+                reuse = definitions[target].node ==
+                        d_definitions[reference.second].node;
+            }
+            current.references.emplace_back(reference.first, target);
+        }
+
+        if (reuse) {
+            current.node = previous->node;
+            ++report.reused;
+        } else {
+            current.references.clear();
+            current.node = EvaluationParser::CreateDefinition(
+                found[i].data, found[i].length, context,
+                [&](const std::string &name) {
+                    auto target = index.before(name, i);
+                    current.references.emplace_back(name, target);
+                    if (target != ModelIndex::npos)
+                        return EvalNode::Ptr(definitions[target].node);
+                    if (context.isKnownVariable(name))
+                        return context.getVariable(name);
+                    auto variable = std::make_shared<VariableNode>(name);
+                    context.addVariable(name, variable);
+                    return EvalNode::Ptr(variable);
+                });
+            ++report.rebuilt;
+        }
+        context.addExpression(current.name, current.node);
+    }
+    report.definitions = found.size();
+    report.buildSeconds = SecondsSince(start);
+
+    // Swapped in, so that profiling, tracing and recording carry over.
+    d_context.replaceDefinitions(context);
+    d_definitions.swap(definitions);
+    d_report = report;
+    return report;
+}
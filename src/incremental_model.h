@@ -0,0 +1,63 @@
+#ifndef INCREMENTAL_MODEL_H
+#define INCREMENTAL_MODEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "evaluation.h"
+
+//! A model file whose reloads only rebuild what changed.
+/*!
+  Each top-level definition is hashed on its text with insignificant
+  whitespace removed. On reload, a definition whose hash is unchanged and
+  whose references still resolve to the same (reused) expressions or to
+  variables keeps its nodes; everything else, that is changed definitions
+  and whatever depends on them, is rebuilt. Variables are carried over, so
+  values already set stay set.
+*/
+class IncrementalModel {
+   public:
+    struct ReloadReport {
+        size_t definitions = 0;
+        //! Definitions that are new or whose text changed.
+        size_t changed = 0;
+        //! Changed definitions plus their dependents.
+        size_t rebuilt = 0;
+        size_t reused = 0;
+        //! Reading and hashing the files, proportional to their size.
+        double scanSeconds = 0;
+        //! Building nodes, proportional to `rebuilt`.
+        double buildSeconds = 0;
+    };
+
+    //! Loads the file; throws like EvaluationParser::CreateFromFile.
+    explicit IncrementalModel(const std::string& fname);
+
+    //! The context is updated in place by reload().
+    EvaluationContext& context() { return d_context; }
+    //! Re-reads the file. On error the model is left unchanged.
+    ReloadReport reload();
+    const ReloadReport& lastReport() const { return d_report; }
+
+    //! Hash of a definition's text, ignoring whitespace outside quotes.
+    static uint64_t Hash(const char* data, size_t size);
+
+   private:
+    struct Definition {
+        std::string name;
+        uint64_t hash;
+        ExpressionNode::Ptr node;
+        //! Referenced names and the definition each resolved to (or npos).
+        std::vector<std::pair<std::string, size_t>> references;
+    };
+
+    std::string d_fname;
+    EvaluationContext d_context;
+    std::vector<Definition> d_definitions;
+    ReloadReport d_report;
+};
+
+#endif
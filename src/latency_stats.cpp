@@ -0,0 +1,195 @@
+#include "latency_stats.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+size_t LatencyHistogram::Bucket(uint64_t nanoseconds) {
+    const uint64_t limit = (uint64_t(1) << MaxBits) - 1;
+    auto value = std::min(nanoseconds, limit);
+    if (value < (uint64_t(1) << SubBucketBits)) return static_cast<size_t>(value);
+    size_t shift = (63 - __builtin_clzll(value)) - (SubBucketBits - 1);
+    return (shift << (SubBucketBits - 1)) + static_cast<size_t>(value >> shift);
+}
+
+uint64_t LatencyHistogram::Top(size_t bucket) {
+    if (bucket < (size_t(1) << SubBucketBits)) return bucket;
+    size_t shift = (bucket >> (SubBucketBits - 1)) - 1;
+    uint64_t first = bucket - (shift << (SubBucketBits - 1));
+    return ((first + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds, uint64_t count) {
+    d_buckets[Bucket(nanoseconds)] += count;
+    d_count += count;
+    d_sum += nanoseconds * count;
+    d_min = std::min(d_min, nanoseconds);
+    d_max = std::max(d_max, nanoseconds);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for (size_t i = 0; i < BucketCount; ++i) d_buckets[i] += other.d_buckets[i];
+    d_count += other.d_count;
+    d_sum += other.d_sum;
+    d_min = std::min(d_min, other.d_min);
+    d_max = std::max(d_max, other.d_max);
+}
+
+void LatencyHistogram::reset() { *this = LatencyHistogram(); }
+
+uint64_t LatencyHistogram::percentile(double percent) const {
+    if (!d_count) return 0;
+    auto rank = static_cast<uint64_t>(percent / 100 * d_count + 0.5);
+    rank = std::max<uint64_t>(1, std::min(rank, d_count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BucketCount; ++i) {
+        seen += d_buckets[i];
+        // The last bucket also holds the clamped values.
+        if (seen >= rank) return i + 1 < BucketCount ? std::min(Top(i), d_max) : d_max;
+    }
+    return d_max;
+}
+
+namespace {
+
+// Histograms of one thread: written by that thread only, read by anyone.
+struct Shard {
+    struct Histogram {
+        std::atomic<uint64_t> buckets[LatencyHistogram::BucketCount];
+        std::atomic<uint64_t> count, sum, min, max;
+    };
+    Histogram histograms[LatencyStats::MetricCount];
+
+    Shard() { clear(); }
+
+    void clear() {
+        for (auto &histogram : histograms) {
+            for (auto &bucket : histogram.buckets) bucket.store(0, std::memory_order_relaxed);
+            histogram.count.store(0, std::memory_order_relaxed);
+            histogram.sum.store(0, std::memory_order_relaxed);
+            histogram.min.store(UINT64_MAX, std::memory_order_relaxed);
+            histogram.max.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Single writer: plain loads and stores, no read-modify-write.
+    static void Add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value,
+                      std::memory_order_relaxed);
+    }
+
+    void record(LatencyStats::Metric metric, uint64_t nanoseconds) {
+        auto &histogram = histograms[metric];
+        Add(histogram.buckets[LatencyHistogram::Bucket(nanoseconds)], 1);
+        Add(histogram.count, 1);
+        Add(histogram.sum, nanoseconds);
+        if (nanoseconds < histogram.min.load(std::memory_order_relaxed))
+            histogram.min.store(nanoseconds, std::memory_order_relaxed);
+        if (nanoseconds > histogram.max.load(std::memory_order_relaxed))
+            histogram.max.store(nanoseconds, std::memory_order_relaxed);
+    }
+};
+
+std::atomic<bool> g_enabled(false);
+std::mutex g_mutex;
+std::vector<std::unique_ptr<Shard>> g_shards;
+std::vector<Shard *> g_free;  // shards of exited threads
+
+// Takes a shard on first use and gives it back when the thread exits.
+struct ThreadShard {
+    Shard *shard = nullptr;
+
+    Shard &get() {
+        if (shard) return *shard;
+        std::lock_guard<std::mutex> lock(g_mutex);
+        if (!g_free.empty()) {
+            shard = g_free.back();
+            g_free.pop_back();
+        } else {
+            g_shards.emplace_back(new Shard);
+            shard = g_shards.back().get();
+        }
+        return *shard;
+    }
+
+    ~ThreadShard() {
+        if (!shard) return;
+        std::lock_guard<std::mutex> lock(g_mutex);
+        g_free.push_back(shard);
+    }
+};
+
+thread_local ThreadShard t_shard;
+
+uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+}  // namespace
+
+void LatencyStats::Enable(bool enabled) { g_enabled = enabled; }
+
+bool LatencyStats::IsEnabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+void LatencyStats::Record(Metric metric, uint64_t nanoseconds) {
+    t_shard.get().record(metric, nanoseconds);
+}
+
+LatencyHistogram LatencyStats::Snapshot(Metric metric) {
+    LatencyHistogram result;
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for (const auto &shard : g_shards) {
+        const auto &histogram = shard->histograms[metric];
+        for (size_t i = 0; i < LatencyHistogram::BucketCount; ++i)
+            result.d_buckets[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+        result.d_count += histogram.count.load(std::memory_order_relaxed);
+        result.d_sum += histogram.sum.load(std::memory_order_relaxed);
+        result.d_min = std::min(result.d_min, histogram.min.load(std::memory_order_relaxed));
+        result.d_max = std::max(result.d_max, histogram.max.load(std::memory_order_relaxed));
+    }
+    return result;
+}
+
+void LatencyStats::Reset() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for (const auto &shard : g_shards) shard->clear();
+}
+
+const char *LatencyStats::Name(Metric metric) {
+    static const char *names[MetricCount] = {"calc", "load", "batch"};
+    return names[metric];
+}
+
+void LatencyStats::Write(std::ostream &out) {
+    out << "{";
+    char line[256];
+    for (size_t i = 0; i < MetricCount; ++i) {
+        auto metric = static_cast<Metric>(i);
+        auto histogram = Snapshot(metric);
+        std::snprintf(line, sizeof(line),
+                      "%s\n  \"%s\": {\"count\": %llu, \"mean_ns\": %.1f, "
+                      "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+                      "\"max_ns\": %llu}",
+                      i ? "," : "", Name(metric),
+                      static_cast<unsigned long long>(histogram.count()),
+                      histogram.mean(),
+                      static_cast<unsigned long long>(histogram.percentile(50)),
+                      static_cast<unsigned long long>(histogram.percentile(99)),
+                      static_cast<unsigned long long>(histogram.percentile(99.9)),
+                      static_cast<unsigned long long>(histogram.max()));
+        out << line;
+    }
+    out << "\n}\n";
+}
+
+LatencyStats::Timer::Timer(Metric metric)
+    : d_metric(metric), d_start(IsEnabled() ? Now() : 0) {}
+
+LatencyStats::Timer::~Timer() {
+    if (d_start) Record(d_metric, Now() - d_start);
+}
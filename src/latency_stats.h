@@ -0,0 +1,85 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+//! Distribution of latencies in nanoseconds, HDR style.
+/*!
+  Values below 128 are counted exactly; above, each power of two is split
+  into 64 buckets, so a percentile is off by less than 1/64 of its value.
+  The range is 2^40 ns (about 18 minutes); longer values are clamped, but
+  max() stays exact.
+*/
+class LatencyHistogram {
+   public:
+    static const size_t SubBucketBits = 7;
+    static const size_t MaxBits = 40;
+    static const size_t BucketCount =
+        (MaxBits - SubBucketBits + 2) << (SubBucketBits - 1);
+
+    void record(uint64_t nanoseconds, uint64_t count = 1);
+    void merge(const LatencyHistogram& other);
+    void reset();
+
+    uint64_t count() const { return d_count; }
+    uint64_t min() const { return d_count ? d_min : 0; }
+    uint64_t max() const { return d_max; }
+    double mean() const { return d_count ? static_cast<double>(d_sum) / d_count : 0; }
+    //! Smallest value with at least `percent`% of the values at or below it,
+    //! reported as the top of its bucket (and never above max()).
+    uint64_t percentile(double percent) const;
+
+    static size_t Bucket(uint64_t nanoseconds);
+    //! Highest value counted in `bucket`.
+    static uint64_t Top(size_t bucket);
+
+   private:
+    uint64_t d_buckets[BucketCount] = {};
+    uint64_t d_count = 0;
+    uint64_t d_sum = 0;
+    uint64_t d_min = UINT64_MAX;
+    uint64_t d_max = 0;
+
+    friend class LatencyStats;
+};
+
+//! Process-wide latency histograms of calc calls, model loads and batch runs.
+/*!
+  Off by default; once enabled, recording costs two clock reads and a few
+  uncontended stores. Every thread records into histograms of its own,
+  merged when read, so threads never share a cache line on the hot path.
+  The histograms of an exited thread are kept and reused by the next one.
+*/
+class LatencyStats {
+   public:
+    enum Metric { Calc, Load, Batch, MetricCount };
+
+    static void Enable(bool enabled = true);
+    static bool IsEnabled();
+    static void Record(Metric metric, uint64_t nanoseconds);
+    //! Everything recorded so far, all threads merged.
+    static LatencyHistogram Snapshot(Metric metric);
+    //! Clears all histograms; recording threads may lose a few values.
+    static void Reset();
+    static const char* Name(Metric metric);
+    //! {"calc": {"count": ..., "p50_ns": ..., ...}, ...}, the stats file.
+    static void Write(std::ostream& out);
+
+    //! Records the lifetime of the object when enabled.
+    class Timer {
+        Metric d_metric;
+        uint64_t d_start;
+
+       public:
+        explicit Timer(Metric metric);
+        ~Timer();
+        //! Records nothing, e.g. when a nested timer covers the call.
+        void cancel() { d_start = 0; }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+    };
+};
+
+#endif
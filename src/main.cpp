@@ -1,7 +1,547 @@
+// Streams rows of variable values through a model.
+//
+//   evaluation MODEL [--outputs A,B,...] [--input FILE] [--format csv|binary]
+//              [--variables X,Y,...]
+//   evaluation MODEL [--outputs A,B,...] --columns DIR --results DIR [--float]
+//              [--precision double|single|mixed] [--memory MB] [--chunk-rows N]
+//   evaluation MODEL [--outputs A,B,...] --columns DIR --stats
+//              [--bins N --range LOW,HIGH] [--top K] [--threads N]
+//   evaluation MODEL [--outputs A,B,...] --sample NAME=KIND:A,B ...
+//              [--correlate X,Y,...=R,...] [--samples N] [--seed S] [--sobol]
+//              [--tolerance T] [--bins N --range LOW,HIGH] [--top K] [--threads N]
+//
+// Rows are read from FILE (stdin when absent or "-") and the outputs (every
+// expression of the model by default) are written to stdout, one row per
+// input row. In csv format the first input line names the columns; columns
+// that are not variables of the model are ignored. The output starts with
+// a header of the output names. In binary format rows are native doubles,
+// one per name in --variables in, one per output out, with no header.
+//
+// With --columns, every variable the outputs need is read from DIR/NAME.npy
+// and every output written to the --results directory as NAME.npy (floats
+// with --float), through a BatchEvaluator on mapped files (see ColumnFile).
+// With --precision single or mixed the model is evaluated in floats (see
+// BatchEvaluator::Precision), and the largest deviation from double over
+// the first rows is reported on stderr.
+// With --memory or --chunk-rows the columns are streamed through a
+// ChunkedPipeline instead, within MB megabytes of buffers, for sets larger
+// than memory; the time each stage spent is reported.
+//
+// With --stats instead of --results, nothing is written per row: each
+// output is reduced to an Aggregate (count, mean, variance, extremes,
+// quantiles, and an N-bin histogram and the K largest rows on request)
+// across --threads threads, and printed as one JSON object on stdout.
+//
+// With --sample, no input is read: a MonteCarlo run draws N samples (2^20
+// by default) of every sampled variable, KIND being uniform:LOW,HIGH,
+// normal:MEAN,SD or lognormal:MU,SIGMA, and reports the aggregates of the
+// outputs with the convergence of their means. --correlate gives the
+// correlations of sampled normals, the upper triangle row by row, and
+// --tolerance stops once every mean is within T of its value, relatively.
+//
+// Parsing and formatting go through NumberText on large buffers, and the
+// graph is evaluated through node pointers resolved once, so rows do not
+// allocate. Throughput is reported on stderr at exit.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aggregate.h"
+#include "batch_evaluator.h"
+#include "chunked_pipeline.h"
+#include "column_file.h"
 #include "evaluation.h"
+#include "monte_carlo.h"
+#include "number_text.h"
 #include "parser.h"
 
-int main() {
-    // TODO
+namespace {
+
+const size_t BufferSize = 1 << 20;
+
+std::vector<std::string> Split(const std::string& list) {
+    std::vector<std::string> names;
+    size_t start = 0;
+    while (start <= list.size()) {
+        auto comma = list.find(',', start);
+        if (comma == std::string::npos) comma = list.size();
+        if (comma > start) names.push_back(list.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return names;
+}
+
+class Input {
+    std::FILE* d_file;
+    std::vector<char> d_buffer;
+    size_t d_begin = 0, d_end = 0;
+    bool d_eof = false;
+    size_t d_bytes = 0;
+
+    bool fill() {
+        if (d_eof) return false;
+        if (d_begin) {
+            std::memmove(d_buffer.data(), d_buffer.data() + d_begin, d_end - d_begin);
+            d_end -= d_begin;
+            d_begin = 0;
+        }
+        if (d_end == d_buffer.size()) d_buffer.resize(2 * d_buffer.size());
+        auto read = std::fread(d_buffer.data() + d_end, 1, d_buffer.size() - d_end, d_file);
+        if (!read) {
+            if (std::ferror(d_file)) throw std::runtime_error("Cannot read input");
+            d_eof = true;
+        }
+        d_end += read;
+        d_bytes += read;
+        return read > 0;
+    }
+
+   public:
+    explicit Input(std::FILE* file) : d_file(file), d_buffer(BufferSize) {}
+
+    //! Next line without its terminator; false at the end of the input.
+    bool line(const char*& begin, const char*& end) {
+        size_t scanned = d_begin;
+        for (;;) {
+            auto start = d_buffer.data();
+            auto newline = static_cast<const char*>(
+                std::memchr(start + scanned, '\n', d_end - scanned));
+            if (newline || (d_eof && d_begin < d_end)) {
+                begin = start + d_begin;
+                end = newline ? newline : start + d_end;
+                d_begin = newline ? newline + 1 - start : d_end;
+                if (end != begin && end[-1] == '\r') --end;
+                return true;
+            }
+            scanned = d_end - d_begin;
+            if (!fill() && d_begin == d_end) return false;
+        }
+    }
+
+    //! Reads exactly `bytes` into `out`; false at the end of the input.
+    bool read(char* out, size_t bytes) {
+        while (d_end - d_begin < bytes) {
+            if (!fill()) {
+                if (d_begin == d_end) return false;
+                throw std::runtime_error("Truncated binary row");
+            }
+        }
+        std::memcpy(out, d_buffer.data() + d_begin, bytes);
+        d_begin += bytes;
+        return true;
+    }
+
+    size_t bytes() const { return d_bytes; }
+};
+
+class Output {
+    std::vector<char> d_buffer;
+    size_t d_size = 0;
+    size_t d_bytes = 0;
+
+   public:
+    Output() : d_buffer(BufferSize) {}
+
+    //! Room for at least `bytes` more characters.
+    char* reserve(size_t bytes) {
+        if (d_buffer.size() - d_size < bytes) flush();
+        if (d_buffer.size() < bytes) d_buffer.resize(bytes);
+        return d_buffer.data() + d_size;
+    }
+    void commit(size_t bytes) { d_size += bytes; }
+    void write(const char* data, size_t bytes) {
+        std::memcpy(reserve(bytes), data, bytes);
+        commit(bytes);
+    }
+    void flush() {
+        if (d_size && std::fwrite(d_buffer.data(), 1, d_size, stdout) != d_size)
+            throw std::runtime_error("Cannot write output");
+        d_bytes += d_size;
+        d_size = 0;
+    }
+    size_t bytes() const { return d_bytes + d_size; }
+};
+
+// Input columns resolved to the variables they set, null when ignored.
+std::vector<VariableNode*> Bind(EvaluationContext& context,
+                                const std::vector<std::string>& columns) {
+    std::vector<VariableNode*> variables;
+    for (const auto& column : columns) {
+        if (!context.isKnownVariable(column)) {
+            std::cerr << "Ignoring column " << column << ": not a variable of the model"
+                      << std::endl;
+            variables.push_back(nullptr);
+            continue;
+        }
+        variables.push_back(context.variables().find(column)->second.get());
+    }
+    return variables;
+}
+
+std::string Row(size_t row) { return "row " + std::to_string(row) + ": "; }
+
+void Report(size_t rows, double seconds, size_t in, size_t out) {
+    auto elapsed = seconds > 0 ? seconds : 1e-9;
+    std::fprintf(stderr, "%llu rows in %.3fs: %.0f rows/s, %.1f MB/s in, %.1f MB/s out\n",
+                 static_cast<unsigned long long>(rows), seconds, rows / elapsed,
+                 in / elapsed / 1e6, out / elapsed / 1e6);
+}
+
+// Evaluates mapped .npy columns of `directory` into `results`.
+void RunColumns(EvaluationContext& context, const std::vector<std::string>& outputs,
+                const std::string& directory, const std::string& results, bool floats,
+                BatchEvaluator::Precision precision) {
+    BatchEvaluator batch(context, outputs);
+    std::vector<ColumnFile> columns;
+    size_t rows = 0, in = 0, out = 0;
+    for (const auto& name : batch.variables()) {
+        columns.push_back(ColumnFile::Open(directory + "/" + name + ".npy"));
+        const auto& column = columns.back();
+        if (columns.size() > 1 && column.rows() != rows)
+            throw std::runtime_error(column.fname() + " has " + std::to_string(column.rows()) +
+                                     " rows, expected " + std::to_string(rows));
+        rows = column.rows();
+        in += rows * (column.type() == ColumnFile::Double ? sizeof(double) : sizeof(float));
+        batch.bind(name, column);
+    }
+    if (columns.empty()) throw std::runtime_error("The outputs depend on no variable");
+    for (const auto& name : outputs) {
+        columns.push_back(ColumnFile::Create(results + "/" + name + ".npy",
+                                             floats ? ColumnFile::Float : ColumnFile::Double,
+                                             rows));
+        out += rows * (floats ? sizeof(float) : sizeof(double));
+        batch.bindResult(name, columns.back());
+    }
+    batch.setPrecision(precision);
+    batch.tune(rows);
+    if (precision != BatchEvaluator::Precision::Double) {
+        for (const auto& deviation : batch.validate(std::min<size_t>(rows, 1 << 16)))
+            std::fprintf(stderr,
+                         "%s: max deviation %.3g, relative %.3g at row %llu, %llu mismatches\n",
+                         deviation.output.c_str(), deviation.maxAbsolute, deviation.maxRelative,
+                         static_cast<unsigned long long>(deviation.row),
+                         static_cast<unsigned long long>(deviation.mismatches));
+    }
+    auto start = std::chrono::steady_clock::now();
+    batch.run(rows);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    Report(rows, elapsed.count(), in, out);
+}
+
+// Reduces the outputs over mapped .npy columns of `directory` to aggregates.
+void RunStatistics(EvaluationContext& context, const std::vector<std::string>& outputs,
+                   const std::string& directory, const Aggregate::Spec& spec, size_t threads) {
+    std::vector<ColumnFile> columns;
+    size_t rows = 0, in = 0;
+    for (const auto& name : BatchEvaluator(context, outputs).variables()) {
+        columns.push_back(ColumnFile::Open(directory + "/" + name + ".npy"));
+        const auto& column = columns.back();
+        if (columns.size() > 1 && column.rows() != rows)
+            throw std::runtime_error(column.fname() + " has " + std::to_string(column.rows()) +
+                                     " rows, expected " + std::to_string(rows));
+        rows = column.rows();
+        in += rows * (column.type() == ColumnFile::Double ? sizeof(double) : sizeof(float));
+    }
+    if (columns.empty()) throw std::runtime_error("The outputs depend on no variable");
+    auto bind = [&columns](BatchEvaluator& batch) {
+        const auto& names = batch.variables();
+        for (size_t v = 0; v < names.size(); ++v) batch.bind(names[v], columns[v]);
+    };
+    auto start = std::chrono::steady_clock::now();
+    auto aggregates = Aggregate::Evaluate(context, outputs, spec, bind, rows, threads);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "{";
+    for (size_t o = 0; o < outputs.size(); ++o) {
+        std::cout << (o ? ",\n " : "") << "\"" << outputs[o] << "\": ";
+        aggregates[o].write(std::cout);
+    }
+    std::cout << "}" << std::endl;
+    Report(rows, elapsed.count(), in, 0);
+}
+
+// "normal:0,1" and the like.
+MonteCarlo::Distribution ParseDistribution(const std::string& text) {
+    auto colon = text.find(':');
+    auto kind = text.substr(0, colon);
+    auto parameters = colon == std::string::npos ? std::vector<std::string>()
+                                                 : Split(text.substr(colon + 1));
+    if (parameters.size() != 2) throw std::runtime_error("Bad distribution " + text);
+    double first = std::strtod(parameters[0].c_str(), nullptr);
+    double second = std::strtod(parameters[1].c_str(), nullptr);
+    if (kind == "uniform") return MonteCarlo::Distribution::Uniform(first, second);
+    if (kind == "normal") return MonteCarlo::Distribution::Normal(first, second);
+    if (kind == "lognormal") return MonteCarlo::Distribution::LogNormal(first, second);
+    throw std::runtime_error("Unknown distribution " + kind);
+}
+
+void RunMonteCarlo(EvaluationContext& context, const std::vector<std::string>& outputs,
+                   const std::vector<std::string>& samples,
+                   const std::vector<std::string>& correlations,
+                   const MonteCarlo::Options& options) {
+    MonteCarlo engine(context, outputs);
+    for (const auto& sample : samples) {
+        auto equals = sample.find('=');
+        if (equals == std::string::npos) throw std::runtime_error("Bad sample " + sample);
+        engine.sample(sample.substr(0, equals), ParseDistribution(sample.substr(equals + 1)));
+    }
+    for (const auto& correlation : correlations) {
+        auto equals = correlation.find('=');
+        auto names = Split(correlation.substr(0, equals));
+        auto values = equals == std::string::npos ? std::vector<std::string>()
+                                                  : Split(correlation.substr(equals + 1));
+        size_t n = names.size();
+        if (values.size() != n * (n - 1) / 2)
+            throw std::runtime_error("Expected the upper triangle of " + std::to_string(n) +
+                                     " correlations: " + correlation);
+        std::vector<double> matrix(n * n, 1);
+        size_t next = 0;
+        for (size_t i = 0; i < n; ++i)
+            for (size_t j = i + 1; j < n; ++j, ++next)
+                matrix[i * n + j] = matrix[j * n + i] = std::strtod(values[next].c_str(), nullptr);
+        engine.correlate(names, matrix);
+    }
+    auto result = engine.run(options);
+    result.write(std::cout);
+    std::cout << std::endl;
+    Report(result.samples, result.seconds, 0, 0);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::string model, input, format = "csv", columns, results;
+    std::vector<std::string> outputs, variables;
+    bool floats = false, valid = true;
+    auto precision = BatchEvaluator::Precision::Double;
+    ChunkedPipeline::Options streaming;
+    bool stream = false, stats = false;
+    Aggregate::Spec spec;
+    spec.compression = 100;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> samples, correlations;
+    MonteCarlo::Options carlo;
+    for (int i = 1; i < argc && valid; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--outputs" && i + 1 < argc) {
+            outputs = Split(argv[++i]);
+        } else if (arg == "--input" && i + 1 < argc) {
+            input = argv[++i];
+        } else if (arg == "--format" && i + 1 < argc) {
+            format = argv[++i];
+        } else if (arg == "--variables" && i + 1 < argc) {
+            variables = Split(argv[++i]);
+        } else if (arg == "--columns" && i + 1 < argc) {
+            columns = argv[++i];
+        } else if (arg == "--results" && i + 1 < argc) {
+            results = argv[++i];
+        } else if (arg == "--float") {
+            floats = true;
+        } else if (arg == "--precision" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "single")
+                precision = BatchEvaluator::Precision::Single;
+            else if (mode == "mixed")
+                precision = BatchEvaluator::Precision::Mixed;
+            else
+                valid = mode == "double";
+        } else if (arg == "--memory" && i + 1 < argc) {
+            streaming.memoryBudget = std::strtoull(argv[++i], nullptr, 10) << 20;
+            stream = true;
+        } else if (arg == "--chunk-rows" && i + 1 < argc) {
+            streaming.chunkRows = std::strtoull(argv[++i], nullptr, 10);
+            stream = true;
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--bins" && i + 1 < argc) {
+            spec.bins = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--range" && i + 1 < argc) {
+            auto bounds = Split(argv[++i]);
+            valid = bounds.size() == 2;
+            if (valid) {
+                spec.low = std::strtod(bounds[0].c_str(), nullptr);
+                spec.high = std::strtod(bounds[1].c_str(), nullptr);
+            }
+        } else if (arg == "--top" && i + 1 < argc) {
+            spec.top = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--sample" && i + 1 < argc) {
+            samples.push_back(argv[++i]);
+        } else if (arg == "--correlate" && i + 1 < argc) {
+            correlations.push_back(argv[++i]);
+        } else if (arg == "--samples" && i + 1 < argc) {
+            carlo.samples = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            carlo.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--sobol") {
+            carlo.sequence = MonteCarlo::Sequence::Sobol;
+        } else if (arg == "--tolerance" && i + 1 < argc) {
+            carlo.tolerance = std::strtod(argv[++i], nullptr);
+        } else if (!arg.empty() && arg[0] != '-' && model.empty()) {
+            model = arg;
+        } else {
+            valid = false;
+        }
+    }
+    if (!valid || model.empty() || (format != "csv" && format != "binary") ||
+        (format == "binary" && variables.empty() && columns.empty()) ||
+        (stats ? columns.empty() || !results.empty() || stream
+               : columns.empty() != results.empty()) ||
+        (spec.bins && !(spec.high > spec.low)) || (!samples.empty() && !columns.empty()) ||
+        (stream && columns.empty()) ||
+        (stream && !streaming.memoryBudget && !streaming.chunkRows)) {
+        std::cerr << "usage: " << argv[0] << " MODEL [--outputs A,B,...] [--input FILE]"
+                  << " [--format csv|binary] [--variables X,Y,...]\n"
+                  << "       " << argv[0] << " MODEL [--outputs A,B,...] --columns DIR"
+                  << " --results DIR [--float]\n"
+                  << "         [--precision double|single|mixed] [--memory MB] [--chunk-rows N]\n"
+                  << "       " << argv[0] << " MODEL [--outputs A,B,...] --columns DIR --stats\n"
+                  << "         [--bins N --range LOW,HIGH] [--top K] [--threads N]\n"
+                  << "       " << argv[0] << " MODEL [--outputs A,B,...]"
+                  << " --sample NAME=KIND:A,B ...\n"
+                  << "         [--correlate X,Y,...=R,...] [--samples N] [--seed S] [--sobol]\n"
+                  << "         [--tolerance T] [--bins N --range LOW,HIGH] [--top K]"
+                  << " [--threads N]\n"
+                  << "  binary input needs --variables to name its columns" << std::endl;
+        return 1;
+    }
+
+    std::FILE* file = stdin;
+    size_t rows = 0;
+    try {
+        auto context = EvaluationParser::CreateFromFile(model);
+        if (outputs.empty()) {
+            std::set<std::string> seen;
+            for (const auto& expression : context.expressions()) {
+                auto name = static_cast<const ExpressionNode*>(expression.get())->name();
+                if (seen.insert(name).second) outputs.push_back(name);
+            }
+        }
+        if (stream) {
+            streaming.resultType = floats ? ColumnFile::Float : ColumnFile::Double;
+            streaming.precision = precision;
+            ChunkedPipeline pipeline(context, outputs, streaming);
+            pipeline.run(columns, results).write(std::cerr);
+            return 0;
+        }
+        if (!samples.empty()) {
+            carlo.threads = threads;
+            carlo.spec = spec;
+            RunMonteCarlo(context, outputs, samples, correlations, carlo);
+            return 0;
+        }
+        if (stats) {
+            RunStatistics(context, outputs, columns, spec, threads);
+            return 0;
+        }
+        if (!columns.empty()) {
+            RunColumns(context, outputs, columns, results, floats, precision);
+            return 0;
+        }
+        std::vector<EvalNode*> results;
+        for (const auto& name : outputs) {
+            if (!context.isKnownExpression(name))
+                throw std::runtime_error("Unknown expression " + name);
+            results.push_back(context.getExpression(name).get());
+        }
+
+        if (!input.empty() && input != "-") {
+            file = std::fopen(input.c_str(), "rb");
+            if (!file) throw std::runtime_error("Cannot open " + input);
+        }
+        Input in(file);
+        Output out;
+        auto start = std::chrono::steady_clock::now();
+
+        if (format == "binary") {
+            auto slots = Bind(context, variables);
+            std::vector<double> values(slots.size()), computed(results.size());
+            const auto rowBytes = values.size() * sizeof(double);
+            while (in.read(reinterpret_cast<char*>(values.data()), rowBytes)) {
+                for (size_t c = 0; c < slots.size(); ++c)
+                    if (slots[c]) slots[c]->set(values[c]);
+                for (size_t r = 0; r < results.size(); ++r) computed[r] = results[r]->eval();
+                out.write(reinterpret_cast<const char*>(computed.data()),
+                          computed.size() * sizeof(double));
+                ++rows;
+            }
+        } else {
+            const char *begin, *end;
+            if (!in.line(begin, end)) throw std::runtime_error("Missing csv header");
+            std::vector<std::string> columns;
+            for (auto field = begin;; ++field) {
+                auto comma = static_cast<const char*>(std::memchr(field, ',', end - field));
+                auto stop = comma ? comma : end;
+                columns.push_back(std::string(field, stop));
+                if (!comma) break;
+                field = comma;
+            }
+            for (auto& column : columns) {
+                auto first = column.find_first_not_of(" \t");
+                auto last = column.find_last_not_of(" \t");
+                column = first == std::string::npos ? std::string()
+                                                    : column.substr(first, last - first + 1);
+            }
+            auto slots = Bind(context, columns);
+
+            for (size_t r = 0; r < outputs.size(); ++r) {
+                if (r) out.write(",", 1);
+                out.write(outputs[r].data(), outputs[r].size());
+            }
+            out.write("\n", 1);
+
+            while (in.line(begin, end)) {
+                if (begin == end) continue;
+                auto p = begin;
+                for (size_t c = 0; c < slots.size(); ++c) {
+                    while (p != end && (*p == ' ' || *p == '\t')) ++p;
+                    double value;
+                    auto parsed = NumberText::Parse(p, end, value);
+                    if (!parsed)
+                        throw std::runtime_error(Row(rows + 1) + "expected a number in column " +
+                                                 columns[c]);
+                    p = parsed;
+                    while (p != end && (*p == ' ' || *p == '\t')) ++p;
+                    if (c + 1 < slots.size()) {
+                        if (p == end || *p != ',')
+                            throw std::runtime_error(Row(rows + 1) + "expected " +
+                                                     std::to_string(slots.size()) + " columns");
+                        ++p;
+                    }
+                    if (slots[c]) slots[c]->set(value);
+                }
+                if (p != end)
+                    throw std::runtime_error(Row(rows + 1) + "unexpected text after column " +
+                                             columns.back());
+
+                auto text = out.reserve(results.size() * (NumberText::MaxLength + 1));
+                size_t length = 0;
+                for (size_t r = 0; r < results.size(); ++r) {
+                    if (r) text[length++] = ',';
+                    length += NumberText::Format(results[r]->eval(), text + length);
+                }
+                text[length++] = '\n';
+                out.commit(length);
+                ++rows;
+            }
+        }
+        out.flush();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        Report(rows, elapsed.count(), in.bytes(), out.bytes());
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        if (file != stdin) std::fclose(file);
+        return 1;
+    }
+    if (file != stdin) std::fclose(file);
+    return 0;
 }
@@ -0,0 +1,32 @@
+#include "mapped_file.h"
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &fname) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open '" + fname + "'");
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw std::runtime_error("Cannot stat '" + fname + "'");
+    }
+    d_size = info.st_size;
+    if (d_size) {
+        void *data = mmap(nullptr, d_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Cannot map '" + fname + "'");
+        }
+        d_data = static_cast<const char *>(data);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (d_data) munmap(const_cast<char *>(d_data), d_size);
+}
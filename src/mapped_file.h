@@ -0,0 +1,26 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+//! Read-only memory mapping of a whole file.
+/*!
+  Pages are only brought in when touched, so large files cost address space
+  rather than resident memory.
+*/
+class MappedFile {
+    const char* d_data = nullptr;
+    size_t d_size = 0;
+
+   public:
+    explicit MappedFile(const std::string& fname);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return d_data; }
+    size_t size() const { return d_size; }
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "memory_usage.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "pugixml.hpp"
+
+namespace {
+
+std::atomic<size_t> g_current(0), g_peak(0);
+
+// Each block is prefixed with its size, keeping 16-byte alignment.
+const size_t Header = 16;
+
+void *Allocate(size_t size) {
+    auto block = static_cast<char *>(std::malloc(size + Header));
+    if (!block) return nullptr;
+    *reinterpret_cast<size_t *>(block) = size;
+    auto current = g_current += size;
+    auto peak = g_peak.load();
+    while (current > peak && !g_peak.compare_exchange_weak(peak, current)) {
+    }
+    return block + Header;
+}
+
+void Deallocate(void *data) {
+    if (!data) return;
+    auto block = static_cast<char *>(data) - Header;
+    g_current -= *reinterpret_cast<size_t *>(block);
+    std::free(block);
+}
+
+std::atomic<bool> g_installed(false);
+
+}  // namespace
+
+void DocumentMemory::Install() {
+    if (g_installed.exchange(true)) return;
+    pugi::set_memory_management_functions(Allocate, Deallocate);
+}
+
+bool DocumentMemory::Installed() { return g_installed; }
+
+size_t DocumentMemory::Current() { return g_current; }
+
+size_t DocumentMemory::Peak() { return g_peak; }
+
+void DocumentMemory::ResetPeak() { g_peak = g_current.load(); }
+
+size_t MemoryUsage::Block(size_t bytes) {
+    // glibc: 8 bytes of header, 16-byte granularity, 32-byte minimum.
+    auto block = (bytes + 8 + 15) & ~static_cast<size_t>(15);
+    return block < 32 ? 32 : block;
+}
+
+size_t MemoryUsage::String(const std::string &value) {
+    auto data = reinterpret_cast<const char *>(value.data());
+    auto object = reinterpret_cast<const char *>(&value);
+    // Short strings live inside the object itself.
+    if (data >= object && data < object + sizeof(value)) return 0;
+    return Block(value.capacity() + 1);
+}
+
+size_t MemoryUsage::total() const {
+    size_t result = names + expressionMap + variableMap + expressionList + caches;
+    for (size_t i = 0; i < NodeTypes; ++i) result += nodes[i];
+    return result;
+}
+
+void MemoryUsage::report(std::ostream &out) const {
+    static const char *types[NodeTypes] = {"constant", "variable", "expression",
+                                           "unary", "binary"};
+    char line[128];
+    for (size_t i = 0; i < NodeTypes; ++i) {
+        std::snprintf(line, sizeof(line), "%-16s %12zu bytes %10zu nodes\n",
+                      types[i], nodes[i], nodeCount[i]);
+        out << line;
+    }
+    const struct {
+        const char *name;
+        size_t bytes;
+    } parts[] = {{"names", names},
+                 {"expression map", expressionMap},
+                 {"variable map", variableMap},
+                 {"expression list", expressionList},
+                 {"constant pool", constantPool},
+                 {"caches", caches},
+                 {"total", total()},
+                 {"load peak", loadPeak}};
+    for (const auto &part : parts) {
+        std::snprintf(line, sizeof(line), "%-16s %12zu bytes\n", part.name,
+                      part.bytes);
+        out << line;
+    }
+}
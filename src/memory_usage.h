@@ -0,0 +1,68 @@
+#ifndef MEMORY_USAGE_H
+#define MEMORY_USAGE_H
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+//! Heap footprint of an EvaluationContext, in bytes.
+/*!
+  Computed from the sizes of the objects the context owns, rounded the way
+  glibc malloc rounds blocks, so it tracks what the process actually pays
+  without hooking the allocator. Nodes shared by several expressions are
+  counted once; nodes shared with another context are counted in both.
+*/
+struct MemoryUsage {
+    enum NodeType { Constant, Variable, Expression, UnaryOperator, BinaryOperator, NodeTypes };
+    size_t nodes[NodeTypes] = {};
+    size_t nodeCount[NodeTypes] = {};
+    //! Heap parts of names and operator types held by nodes.
+    size_t names = 0;
+    //! Tree nodes of the name maps, their keys included.
+    size_t expressionMap = 0;
+    size_t variableMap = 0;
+    //! The list of expressions in definition order.
+    size_t expressionList = 0;
+    //! Constants live in their nodes: the bytes of nodes[Constant], not added
+    //! again to total().
+    size_t constantPool = 0;
+    //! Profiling state and lazy loading indexes.
+    size_t caches = 0;
+    //! Highest footprint while the context was created by EvaluationParser,
+    //! the pugixml documents included; 0 for contexts built otherwise, or
+    //! before DocumentMemory::Install().
+    size_t loadPeak = 0;
+
+    size_t total() const;
+    void report(std::ostream& out) const;
+
+    //! Malloc block size for a request of `bytes`.
+    static size_t Block(size_t bytes);
+    //! Block holding an object created by std::make_shared.
+    static size_t SharedBlock(size_t bytes) { return Block(bytes + 16); }
+    static size_t String(const std::string& value);
+};
+
+//! Bytes allocated by pugixml, process wide.
+/*!
+  Counted by allocation hooks that Install() hands to pugixml in place of
+  its own, for the whole process. Nothing is counted, and the load peak of
+  contexts is 0, until then: an application that manages pugixml memory
+  itself does not call it.
+*/
+class DocumentMemory {
+   public:
+    //! Installs the counting hooks; later calls do nothing.
+    /*!
+      Must run before any pugixml document exists, e.g. first thing in
+      main: blocks allocated before are freed through the wrong function.
+    */
+    static void Install();
+    static bool Installed();
+    static size_t Current();
+    static size_t Peak();
+    //! Starts a new peak measurement at the current level.
+    static void ResetPeak();
+};
+
+#endif
@@ -0,0 +1,353 @@
+#include "model_analyzer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+struct Info {
+    // Per evaluation, over the expanded tree.
+    double evaluated = 0;
+    double transcendental = 0;
+    double cycles = 0;
+    double critical = 0;
+    size_t depth = 0;
+    // Within one expression body: references to expressions count as leaves.
+    uint64_t hash = 0;
+    size_t size = 0;
+    size_t chain = 0;  // same-operator nodes down the left side
+};
+
+std::string Label(const EvalNode *node) {
+    switch (node->kind()) {
+        case EvalNode::Kind::Constant:
+            return "constant";
+        case EvalNode::Kind::Variable:
+            return "variable";
+        case EvalNode::Kind::Expression:
+            return "expression";
+        default:
+            return node->operatorType();
+    }
+}
+
+uint64_t Combine(uint64_t seed, uint64_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+uint64_t Bits(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+bool IsConstant(const EvalNode *node, double *value) {
+    if (node->kind() != EvalNode::Kind::Constant) return false;
+    *value = static_cast<const ConstantNode *>(node)->value();
+    return true;
+}
+
+// Structural equality of two expression bodies.
+bool Equal(const EvalNode *a, const EvalNode *b) {
+    std::vector<std::pair<const EvalNode *, const EvalNode *>> pairs{{a, b}};
+    while (!pairs.empty()) {
+        auto pair = pairs.back();
+        pairs.pop_back();
+        auto left = pair.first, right = pair.second;
+        if (left == right) continue;
+        if (left->kind() != right->kind()) return false;
+        switch (left->kind()) {
+            case EvalNode::Kind::Constant:
+                if (Bits(static_cast<const ConstantNode *>(left)->value()) !=
+                    Bits(static_cast<const ConstantNode *>(right)->value()))
+                    return false;
+                break;
+            case EvalNode::Kind::Variable:
+                if (static_cast<const VariableNode *>(left)->name() !=
+                    static_cast<const VariableNode *>(right)->name())
+                    return false;
+                break;
+            case EvalNode::Kind::Expression:
+                return false;  // distinct definitions
+            default: {
+                if (left->operatorType() != right->operatorType()) return false;
+                auto lefts = left->children(), rights = right->children();
+                for (size_t i = 0; i < lefts.size(); ++i)
+                    pairs.emplace_back(lefts[i], rights[i]);
+            }
+        }
+    }
+    return true;
+}
+
+std::string Format(double value) {
+    char text[32];
+    std::snprintf(text, sizeof(text), value < 1e15 ? "%.0f" : "%.3g", value);
+    return text;
+}
+
+}  // namespace
+
+bool ModelAnalyzer::IsTranscendental(const std::string &type) {
+    return type == "sin" || type == "cos" || type == "exp" || type == "log" || type == "^";
+}
+
+double ModelAnalyzer::Cycles(EvalNode::Kind kind, const std::string &type) {
+    // A virtual call, and a std::function call for operators.
+    const double dispatch = 6;
+    switch (kind) {
+        case EvalNode::Kind::Constant:
+        case EvalNode::Kind::Variable:
+            return dispatch + 1;
+        case EvalNode::Kind::Expression:
+            return dispatch;
+        default:
+            break;
+    }
+    static const std::map<std::string, double> latency = {
+        {"+", 4},   {"-", 4},   {"*", 4},    {"min", 4},  {"max", 4},
+        {"/", 14},  {"^", 100}, {"exp", 40}, {"log", 40}, {"sin", 60},
+        {"cos", 60}, {"!", 1}};
+    auto known = latency.find(type);
+    return 2 * dispatch + (known != latency.end() ? known->second : 4);
+}
+
+const char *ModelAnalyzer::Name(Finding::Kind kind) {
+    static const char *names[] = {"repeated-subtree", "small-integer-power",
+                                  "division-by-constant", "deep-chain"};
+    return names[kind];
+}
+
+ModelAnalyzer::Report ModelAnalyzer::Analyze(const EvaluationContext &context) {
+    return Analyze(context, Options());
+}
+
+ModelAnalyzer::Report ModelAnalyzer::Analyze(const EvaluationContext &context,
+                                             const Options &options) {
+    Report report;
+    report.variables = context.variables().size();
+
+    // Named expressions: the last definition of each name.
+    std::map<std::string, const ExpressionNode *> named;
+    for (const auto &expression : context.expressions()) {
+        auto node = static_cast<const ExpressionNode *>(expression.get());
+        named[node->name()] = node;
+    }
+    report.expressions = named.size();
+
+    // Children before parents, without recursion: models can be very deep.
+    std::unordered_map<const EvalNode *, Info> infos;
+    std::vector<const ExpressionNode *> definitions;
+    std::vector<std::pair<const EvalNode *, bool>> stack;
+    for (const auto &expression : context.expressions())
+        stack.emplace_back(expression.get(), false);
+    for (const auto &variable : context.variables())
+        stack.emplace_back(variable.second.get(), false);
+    while (!stack.empty()) {
+        auto node = stack.back().first;
+        if (infos.count(node)) {
+            stack.pop_back();
+            continue;
+        }
+        auto children = node->children();
+        if (!stack.back().second) {
+            stack.back().second = true;
+            for (auto child : children)
+                if (!infos.count(child)) stack.emplace_back(child, false);
+            continue;
+        }
+        stack.pop_back();
+
+        Info info;
+        const auto &type = node->operatorType();
+        auto own = Cycles(node->kind(), type);
+        info.evaluated = 1;
+        info.cycles = info.critical = own;
+        info.transcendental = IsTranscendental(type) ? 1 : 0;
+        info.depth = 1;
+        info.size = 1;
+        info.hash = Combine(static_cast<uint64_t>(node->kind()), std::hash<std::string>()(type));
+        double slowest = 0;
+        for (auto child : children) {
+            const auto &other = infos[child];
+            info.evaluated += other.evaluated;
+            info.transcendental += other.transcendental;
+            info.cycles += other.cycles;
+            slowest = std::max(slowest, other.critical);
+            info.depth = std::max(info.depth, other.depth + 1);
+        }
+        info.critical += slowest;
+        switch (node->kind()) {
+            case EvalNode::Kind::Constant:
+                info.hash = Combine(info.hash, Bits(static_cast<const ConstantNode *>(node)->value()));
+                break;
+            case EvalNode::Kind::Variable:
+                info.hash = Combine(info.hash, std::hash<std::string>()(
+                                                   static_cast<const VariableNode *>(node)->name()));
+                break;
+            case EvalNode::Kind::Expression:
+                // As a subtree, a reference is a leaf identified by its target.
+                info.hash = Combine(info.hash, reinterpret_cast<uintptr_t>(node));
+                definitions.push_back(static_cast<const ExpressionNode *>(node));
+                break;
+            default:
+                for (auto child : children) {
+                    const auto &other = infos[child];
+                    info.hash = Combine(info.hash, other.hash);
+                    info.size += other.size;
+                }
+                info.chain = 1;
+                if (node->kind() == EvalNode::Kind::BinaryOperator &&
+                    children[0]->kind() == EvalNode::Kind::BinaryOperator &&
+                    children[0]->operatorType() == type)
+                    info.chain += infos[children[0]].chain;
+                break;
+        }
+        ++report.operators[Label(node)];
+        infos[node] = info;
+    }
+    report.distinctNodes = infos.size();
+
+    for (const auto &entry : named) {
+        const auto &info = infos[entry.second];
+        report.evaluatedNodes += info.evaluated;
+        report.transcendentalCalls += info.transcendental;
+        report.estimatedCycles += info.cycles;
+        report.criticalPathCycles = std::max(report.criticalPathCycles, info.critical);
+        report.maxDepth = std::max(report.maxDepth, info.depth);
+        report.costliest.emplace_back(entry.first, info.cycles);
+    }
+    if (report.distinctNodes)
+        report.sharingFactor = report.evaluatedNodes / report.distinctNodes;
+    std::stable_sort(report.costliest.begin(), report.costliest.end(),
+                     [](const std::pair<std::string, double> &a,
+                        const std::pair<std::string, double> &b) { return a.second > b.second; });
+    if (report.costliest.size() > options.costliest) report.costliest.resize(options.costliest);
+
+    // Lint each definition body; bodies are trees ending at references.
+    std::unordered_map<const EvalNode *, const ExpressionNode *> owners;
+    std::unordered_map<uint64_t, std::vector<const EvalNode *>> candidates;
+    for (auto definition : definitions) {
+        const EvalNode *longest = nullptr;
+        std::vector<const EvalNode *> body{definition->expression().get()};
+        while (!body.empty()) {
+            auto node = body.back();
+            body.pop_back();
+            if (node->kind() == EvalNode::Kind::Expression) continue;
+            owners[node] = definition;
+            const auto &info = infos[node];
+            if (info.size >= options.repeatedSubtreeNodes) candidates[info.hash].push_back(node);
+            if (info.chain && (!longest || info.chain > infos[longest].chain)) longest = node;
+            auto children = node->children();
+            body.insert(body.end(), children.begin(), children.end());
+
+            double value;
+            const auto &type = node->operatorType();
+            if (type == "^" && IsConstant(children[1], &value) && value == std::floor(value) &&
+                std::fabs(value) <= 4) {
+                report.findings.push_back(
+                    {Finding::SmallIntegerPower, definition->name(),
+                     "x ^ " + Format(value) + " calls pow; multiply instead"});
+            } else if (type == "/" && IsConstant(children[1], &value) && value != 0) {
+                report.findings.push_back(
+                    {Finding::DivisionByConstant, definition->name(),
+                     "division by constant " + Format(value) +
+                         "; multiply by its reciprocal"});
+            }
+        }
+        if (longest && infos[longest].chain > options.deepChain) {
+            report.findings.push_back(
+                {Finding::DeepChain, definition->name(),
+                 Format(infos[longest].chain) + " '" + longest->operatorType() +
+                     "' operations chained on the left: each waits for the previous one; "
+                     "balance the tree"});
+        }
+    }
+
+    // Largest repeated subtrees first; their own parts are not reported again.
+    std::vector<std::vector<const EvalNode *>> groups;
+    for (auto &candidate : candidates) {
+        auto &nodes = candidate.second;
+        if (nodes.size() < 2) continue;
+        std::vector<const EvalNode *> same{nodes[0]};
+        for (size_t i = 1; i < nodes.size(); ++i)
+            if (Equal(nodes[0], nodes[i])) same.push_back(nodes[i]);
+        if (same.size() > 1) groups.push_back(same);
+    }
+    std::sort(groups.begin(), groups.end(),
+              [&](const std::vector<const EvalNode *> &a, const std::vector<const EvalNode *> &b) {
+                  if (infos[a[0]].size != infos[b[0]].size)
+                      return infos[a[0]].size > infos[b[0]].size;
+                  return owners[a[0]]->name() < owners[b[0]]->name();
+              });
+    std::unordered_set<const EvalNode *> covered;
+    for (const auto &group : groups) {
+        if (std::all_of(group.begin(), group.end(),
+                        [&](const EvalNode *node) { return covered.count(node) > 0; }))
+            continue;
+        std::set<std::string> names;
+        for (auto node : group) {
+            names.insert(owners[node]->name());
+            std::vector<const EvalNode *> parts = node->children();
+            while (!parts.empty()) {
+                auto part = parts.back();
+                parts.pop_back();
+                if (part->kind() == EvalNode::Kind::Expression || !covered.insert(part).second)
+                    continue;
+                auto children = part->children();
+                parts.insert(parts.end(), children.begin(), children.end());
+            }
+        }
+        std::string where;
+        for (const auto &name : names) where += (where.empty() ? "" : ", ") + name;
+        report.findings.push_back(
+            {Finding::RepeatedSubtree, owners[group[0]]->name(),
+             "identical '" + group[0]->operatorType() + "' subtree of " +
+                 Format(infos[group[0]].size) + " nodes built " + Format(group.size()) +
+                 " times (in " + where + ")"});
+    }
+    return report;
+}
+
+void ModelAnalyzer::Report::write(std::ostream &out) const {
+    char line[160];
+    out << "Model\n";
+    std::snprintf(line, sizeof(line), "  %-22s %zu\n  %-22s %zu\n  %-22s %zu\n", "expressions",
+                  expressions, "variables", variables, "distinct nodes", distinctNodes);
+    out << line;
+    out << "Nodes by operator\n";
+    for (const auto &entry : operators) {
+        std::snprintf(line, sizeof(line), "  %-22s %zu\n", entry.first.c_str(), entry.second);
+        out << line;
+    }
+    out << "Per model evaluation (every expression once)\n";
+    const struct {
+        const char *name;
+        double value;
+    } costs[] = {{"evaluated nodes", evaluatedNodes},
+                 {"transcendental calls", transcendentalCalls},
+                 {"estimated cycles", estimatedCycles},
+                 {"critical path cycles", criticalPathCycles},
+                 {"maximum depth", static_cast<double>(maxDepth)}};
+    for (const auto &cost : costs) {
+        std::snprintf(line, sizeof(line), "  %-22s %s\n", cost.name, Format(cost.value).c_str());
+        out << line;
+    }
+    std::snprintf(line, sizeof(line), "  %-22s %.2f\n", "sharing factor", sharingFactor);
+    out << line;
+    out << "Costliest expressions (estimated cycles per calc)\n";
+    for (const auto &entry : costliest) {
+        std::snprintf(line, sizeof(line), "  %-22s %s\n", entry.first.c_str(),
+                      Format(entry.second).c_str());
+        out << line;
+    }
+    out << "Findings: " << findings.size() << "\n";
+    for (const auto &finding : findings)
+        out << "  [" << Name(finding.kind) << "] " << finding.expression << ": " << finding.message
+            << "\n";
+}
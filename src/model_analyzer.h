@@ -0,0 +1,70 @@
+#ifndef MODEL_ANALYZER_H
+#define MODEL_ANALYZER_H
+
+#include <cstddef>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "evaluation.h"
+
+//! Static cost of a model and the patterns that make it slow.
+/*!
+  Evaluation does not cache: an expression referenced twice is evaluated
+  twice. Costs are therefore counted over the expanded tree, per model
+  evaluation, i.e. one calc of every expression name. Cycles are estimates
+  from a per-operator table (dispatch included), good for comparing models
+  and finding hot spots, not for predicting wall time.
+*/
+class ModelAnalyzer {
+   public:
+    struct Options {
+        //! Smallest subtree (in nodes) reported when repeated.
+        size_t repeatedSubtreeNodes = 4;
+        //! Longest left-leaning chain of one operator left unreported.
+        size_t deepChain = 32;
+        //! Expressions listed by cost.
+        size_t costliest = 10;
+    };
+
+    struct Finding {
+        enum Kind { RepeatedSubtree, SmallIntegerPower, DivisionByConstant, DeepChain };
+        Kind kind;
+        std::string expression;
+        std::string message;
+    };
+
+    struct Report {
+        size_t expressions = 0;
+        size_t variables = 0;
+        size_t distinctNodes = 0;
+        //! Distinct nodes by operator type, "constant", "variable" or
+        //! "expression".
+        std::map<std::string, size_t> operators;
+        // Per model evaluation.
+        double evaluatedNodes = 0;
+        double transcendentalCalls = 0;
+        double estimatedCycles = 0;
+        //! Longest chain of dependent operations, in estimated cycles.
+        double criticalPathCycles = 0;
+        size_t maxDepth = 0;
+        //! evaluatedNodes / distinctNodes: how often a node runs per evaluation.
+        double sharingFactor = 0;
+        //! Expression names and estimated cycles per calc, costliest first.
+        std::vector<std::pair<std::string, double>> costliest;
+        std::vector<Finding> findings;
+
+        void write(std::ostream& out) const;
+    };
+
+    static Report Analyze(const EvaluationContext& context);
+    static Report Analyze(const EvaluationContext& context, const Options& options);
+    //! Estimated cycles of one evaluation of a node, dispatch included.
+    static double Cycles(EvalNode::Kind kind, const std::string& type = std::string());
+    static bool IsTranscendental(const std::string& type);
+    static const char* Name(Finding::Kind kind);
+};
+
+#endif
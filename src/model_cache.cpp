@@ -0,0 +1,152 @@
+#include "model_cache.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "compiled_model.h"
+
+namespace {
+
+const char Extension[] = ".evcm";
+
+std::string Hex(uint64_t value) {
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx",
+                  static_cast<unsigned long long>(value));
+    return buffer;
+}
+
+bool EndsWith(const std::string &value, const std::string &suffix) {
+    return value.size() >= suffix.size() &&
+           value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}  // namespace
+
+ModelCache::ModelCache(const std::string &directory, size_t maxBytes)
+    : d_directory(directory),
+      d_maxBytes(maxBytes),
+      d_hits(0),
+      d_misses(0),
+      d_writes(0),
+      d_evictions(0),
+      d_errors(0) {}
+
+uint64_t ModelCache::Hash(const char *data, size_t size, uint64_t seed) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string ModelCache::Key(const std::string &contents,
+                            const std::string &signature) {
+    auto seed = Hash(signature.data(), signature.size());
+    return Hex(Hash(contents.data(), contents.size(), seed)) + "-" +
+           Hex(contents.size());
+}
+
+std::string ModelCache::path(const std::string &key) const {
+    return d_directory + "/" + key + Extension;
+}
+
+bool ModelCache::load(const std::string &key, EvaluationContext &context) {
+    auto fname = path(key);
+    std::ifstream file(fname.c_str(), std::ios::in | std::ios::binary);
+    if (!file) {
+        ++d_misses;
+        return false;
+    }
+    try {
+        context = CompiledModel::Read(file);
+    } catch (const std::exception &) {
+        // Corrupt or from an incompatible build: drop it and rebuild.
+        std::remove(fname.c_str());
+        ++d_errors;
+        ++d_misses;
+        return false;
+    }
+    // Touch the entry so eviction sees it as recently used.
+    utime(fname.c_str(), nullptr);
+    ++d_hits;
+    return true;
+}
+
+void ModelCache::store(const std::string &key, const EvaluationContext &context) {
+    static std::atomic<unsigned> counter(0);
+    auto fname = path(key);
+    auto temporary = fname + ".tmp." + std::to_string(getpid()) + "." +
+                     std::to_string(counter++);
+    {
+        std::ofstream file(temporary.c_str(),
+                           std::ios::out | std::ios::binary | std::ios::trunc);
+        try {
+            if (file) CompiledModel::Write(context, file);
+            file.close();
+        } catch (const std::exception &) {
+            file.setstate(std::ios::failbit);
+        }
+        if (!file) {
+            std::remove(temporary.c_str());
+            ++d_errors;
+            return;
+        }
+    }
+    if (std::rename(temporary.c_str(), fname.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        ++d_errors;
+        return;
+    }
+    ++d_writes;
+    evict();
+}
+
+void ModelCache::evict() {
+    struct Entry {
+        std::string path;
+        off_t size;
+        time_t mtime;
+    };
+    std::vector<Entry> entries;
+    size_t total = 0;
+    auto dir = opendir(d_directory.c_str());
+    if (!dir) return;
+    while (auto entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (!EndsWith(name, Extension)) continue;
+        auto fname = d_directory + "/" + name;
+        struct stat info;
+        if (stat(fname.c_str(), &info) != 0) continue;
+        entries.push_back(Entry{fname, info.st_size, info.st_mtime});
+        total += info.st_size;
+    }
+    closedir(dir);
+    if (total <= d_maxBytes) return;
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) { return a.mtime < b.mtime; });
+    for (const auto &entry : entries) {
+        if (total <= d_maxBytes) break;
+        if (std::remove(entry.path.c_str()) == 0) ++d_evictions;
+        total -= entry.size;
+    }
+}
+
+ModelCache::Statistics ModelCache::statistics() const {
+    Statistics statistics;
+    statistics.hits = d_hits;
+    statistics.misses = d_misses;
+    statistics.writes = d_writes;
+    statistics.evictions = d_evictions;
+    statistics.errors = d_errors;
+    return statistics;
+}
@@ -0,0 +1,52 @@
+#ifndef MODEL_CACHE_H
+#define MODEL_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "evaluation.h"
+
+//! On-disk cache of compiled models shared by every process using a directory.
+/*!
+  Entries are written to a temporary file and renamed into place, so a reader
+  never sees a partial entry. When the directory grows past the size bound the
+  least recently used entries are removed.
+*/
+class ModelCache {
+    std::string d_directory;
+    size_t d_maxBytes;
+    std::atomic<size_t> d_hits, d_misses, d_writes, d_evictions, d_errors;
+
+    std::string path(const std::string& key) const;
+    void evict();
+
+   public:
+    struct Statistics {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t writes = 0;
+        size_t evictions = 0;
+        //! Unreadable entries (treated as misses) and failed writes.
+        size_t errors = 0;
+    };
+
+    //! The directory must exist; maxBytes bounds the total size of entries.
+    ModelCache(const std::string& directory, size_t maxBytes);
+
+    //! Key for a model: hash of its contents combined with the compiler signature.
+    static std::string Key(const std::string& contents,
+                           const std::string& signature);
+    static uint64_t Hash(const char* data, size_t size, uint64_t seed = 0);
+
+    //! Fills context and returns true on a hit.
+    bool load(const std::string& key, EvaluationContext& context);
+    //! Best effort: failures are counted but never thrown.
+    void store(const std::string& key, const EvaluationContext& context);
+
+    Statistics statistics() const;
+    const std::string& directory() const { return d_directory; }
+};
+
+#endif
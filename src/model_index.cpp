@@ -0,0 +1,208 @@
+#include "model_index.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "memory_usage.h"
+
+const size_t ModelIndex::npos = static_cast<size_t>(-1);
+
+namespace {
+
+class Scanner {
+    const char *d_data;
+    size_t d_size;
+    size_t d_pos = 0;
+
+   public:
+    Scanner(const char *data, size_t size) : d_data(data), d_size(size) {}
+
+    size_t pos() const { return d_pos; }
+    bool done() const { return d_pos >= d_size; }
+    bool at(const char *token) const {
+        auto length = std::strlen(token);
+        return d_size - d_pos >= length &&
+               std::memcmp(d_data + d_pos, token, length) == 0;
+    }
+    void fail(const char *what) const {
+        throw std::runtime_error(std::string("Invalid model file: ") + what +
+                                 " at offset " + std::to_string(d_pos));
+    }
+    void skipTo(const char *token) {
+        auto length = std::strlen(token);
+        while (!done() && !at(token)) ++d_pos;
+        if (done()) fail("unterminated markup");
+        d_pos += length;
+    }
+    void skipSpace() {
+        while (!done() && std::strchr(" \t\r\n", d_data[d_pos])) ++d_pos;
+    }
+    // Skips comments, processing instructions, CDATA and doctype.
+    // Returns false when the next markup is an element or end tag.
+    bool skipMisc() {
+        if (at("<!--")) {
+            skipTo("-->");
+        } else if (at("<![CDATA[")) {
+            skipTo("]]>");
+        } else if (at("<?")) {
+            skipTo("?>");
+        } else if (at("<!")) {
+            skipTo(">");
+        } else {
+            return false;
+        }
+        return true;
+    }
+    std::string name() {
+        auto start = d_pos;
+        while (!done() && !std::strchr(" \t\r\n/>", d_data[d_pos])) ++d_pos;
+        return std::string(d_data + start, d_pos - start);
+    }
+    // Reads the rest of a start tag after its name. Returns true when the
+    // element is self-closing; fills `value` with the attribute `wanted`.
+    bool attributes(std::string *value, const char *wanted = "value") {
+        for (;;) {
+            skipSpace();
+            if (done()) fail("unterminated tag");
+            if (at("/>")) {
+                d_pos += 2;
+                return true;
+            }
+            if (at(">")) {
+                ++d_pos;
+                return false;
+            }
+            auto start = d_pos;
+            while (!done() && !std::strchr(" \t\r\n=", d_data[d_pos])) ++d_pos;
+            std::string attribute(d_data + start, d_pos - start);
+            skipSpace();
+            if (!at("=")) fail("expected '='");
+            ++d_pos;
+            skipSpace();
+            if (done() || (d_data[d_pos] != '"' && d_data[d_pos] != '\''))
+                fail("expected quoted attribute");
+            auto quote = d_data[d_pos++];
+            start = d_pos;
+            while (!done() && d_data[d_pos] != quote) ++d_pos;
+            if (done()) fail("unterminated attribute");
+            if (value && attribute == wanted)
+                *value = unescape(std::string(d_data + start, d_pos - start));
+            ++d_pos;
+        }
+    }
+    // Skips the content and end tag of an element whose start tag was read.
+    void element() {
+        size_t depth = 1;
+        while (depth) {
+            while (!done() && d_data[d_pos] != '<') ++d_pos;
+            if (done()) fail("unterminated element");
+            if (skipMisc()) continue;
+            if (at("</")) {
+                skipTo(">");
+                --depth;
+                continue;
+            }
+            ++d_pos;
+            name();
+            if (!attributes(nullptr)) ++depth;
+        }
+    }
+    static std::string unescape(const std::string &text) {
+        static const char *entities[][2] = {{"&lt;", "<"},
+                                            {"&gt;", ">"},
+                                            {"&amp;", "&"},
+                                            {"&quot;", "\""},
+                                            {"&apos;", "'"}};
+        std::string result;
+        for (size_t i = 0; i < text.size();) {
+            bool replaced = false;
+            if (text[i] == '&') {
+                for (const auto &entity : entities) {
+                    if (text.compare(i, std::strlen(entity[0]), entity[0]) == 0) {
+                        result += entity[1];
+                        i += std::strlen(entity[0]);
+                        replaced = true;
+                        break;
+                    }
+                }
+            }
+            if (!replaced) result += text[i++];
+        }
+        return result;
+    }
+};
+
+}  // namespace
+
+void ModelIndex::scan(const char *data, size_t size,
+                      const IncludeHandler &include) {
+    Scanner scanner(data, size);
+    // Prolog up to the document element.
+    for (;;) {
+        scanner.skipSpace();
+        if (scanner.done()) scanner.fail("missing root element");
+        if (!scanner.skipMisc()) break;
+    }
+    if (!scanner.at("<")) scanner.fail("expected root element");
+    scanner.skipTo("<");
+    if (scanner.name() != "root") scanner.fail("expected root element");
+    if (scanner.attributes(nullptr)) return;
+
+    for (;;) {
+        scanner.skipSpace();
+        if (scanner.done()) scanner.fail("unterminated root element");
+        if (scanner.at("<![CDATA[") || !scanner.at("<"))
+            throw std::runtime_error(
+                "Should have only expression/variable at root level");
+        if (scanner.skipMisc()) continue;
+        if (scanner.at("</")) break;
+
+        Definition definition;
+        auto offset = scanner.pos();
+        scanner.skipTo("<");
+        auto element = scanner.name();
+        if (element == "include") {
+            std::string file;
+            if (!scanner.attributes(&file, "file")) scanner.element();
+            if (!include)
+                throw std::runtime_error("Includes are not supported here");
+            include(file);
+            continue;
+        }
+        if (element != "variable")
+            throw std::runtime_error(
+                "Should have only expression/variable at root level");
+        if (!scanner.attributes(&definition.name)) scanner.element();
+        definition.data = data + offset;
+        definition.length = scanner.pos() - offset;
+        d_positions[definition.name].push_back(d_definitions.size());
+        d_definitions.push_back(definition);
+    }
+}
+
+size_t ModelIndex::last(const std::string &name) const {
+    auto positions = d_positions.find(name);
+    if (positions == d_positions.end()) return npos;
+    return positions->second.back();
+}
+
+size_t ModelIndex::before(const std::string &name, size_t position) const {
+    auto positions = d_positions.find(name);
+    if (positions == d_positions.end()) return npos;
+    const auto &list = positions->second;
+    auto it = std::lower_bound(list.begin(), list.end(), position);
+    if (it == list.begin()) return npos;
+    return *(--it);
+}
+
+size_t ModelIndex::memoryUsage() const {
+    size_t bytes = MemoryUsage::Block(d_definitions.capacity() * sizeof(Definition));
+    for (const auto &definition : d_definitions)
+        bytes += MemoryUsage::String(definition.name);
+    for (const auto &positions : d_positions) {
+        bytes += MemoryUsage::Block(4 * sizeof(void *) + sizeof(positions)) +
+                 MemoryUsage::String(positions.first) +
+                 MemoryUsage::Block(positions.second.capacity() * sizeof(size_t));
+    }
+    return bytes;
+}
@@ -0,0 +1,51 @@
+#ifndef MODEL_INDEX_H
+#define MODEL_INDEX_H
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+//! Positions of the top-level definitions of a model file.
+/*!
+  Built by a light scan of the raw XML text: only the root element's
+  children are delimited and named, their contents are left for pugixml to
+  parse when (and if) a definition is needed. Several buffers may be scanned
+  into one index, definitions being numbered in scan order.
+*/
+class ModelIndex {
+   public:
+    struct Definition {
+        std::string name;
+        //! The whole <variable> element, inside the scanned buffer.
+        const char* data;
+        size_t length;
+    };
+    //! Called with the file attribute of each <include> element.
+    using IncludeHandler = std::function<void(const std::string&)>;
+    static const size_t npos;
+
+    //! Appends the definitions of a model file, which must outlive the index.
+    /*!
+      Throws std::runtime_error when the text is not a well-formed model, or
+      when it includes other files and no handler is given. The handler runs
+      where the include appears, so it can scan the included file in place.
+    */
+    void scan(const char* data, size_t size,
+              const IncludeHandler& include = IncludeHandler());
+
+    const std::vector<Definition>& definitions() const { return d_definitions; }
+    //! Position of the definition in effect after the whole file, or npos.
+    size_t last(const std::string& name) const;
+    //! Position of the definition a reference at `position` resolves to, or npos.
+    size_t before(const std::string& name, size_t position) const;
+    //! Heap bytes held by the index.
+    size_t memoryUsage() const;
+
+   private:
+    std::vector<Definition> d_definitions;
+    std::map<std::string, std::vector<size_t>> d_positions;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "model_library.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "model_cache.h"
+#include "tracer.h"
+
+ModelLibrary::ModelLibrary(size_t threads)
+    : d_threads(threads ? threads : std::thread::hardware_concurrency()),
+      d_reads(0),
+      d_parses(0),
+      d_reuses(0) {
+    if (!d_threads) d_threads = 1;
+}
+
+std::string ModelLibrary::ReadFile(const std::string &fname) {
+    EVALUATION_TRACE("io", "read file", Tracer::Detail(fname));
+    std::ifstream file(fname.c_str(), std::ios::in | std::ios::binary);
+    if (!file) {
+        throw std::runtime_error(std::string("Invalid file for EvaluationParser of '")
+                + fname + "' : File was not found");
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+std::string ModelLibrary::Resolve(const std::string &from,
+                                  const std::string &include) {
+    auto path = include;
+    auto slash = from.rfind('/');
+    if (!include.empty() && include[0] != '/' && slash != std::string::npos)
+        path = from.substr(0, slash + 1) + include;
+    char canonical[PATH_MAX];
+    if (!realpath(path.c_str(), canonical)) {
+        throw std::runtime_error(std::string("Invalid file for EvaluationParser of '")
+                + path + "' : File was not found");
+    }
+    return canonical;
+}
+
+ModelLibrary::ModelPtr ModelLibrary::get(const std::string &path) {
+    auto contents = ReadFile(path);
+    ++d_reads;
+    auto key = std::make_pair(ModelCache::Hash(contents.data(), contents.size()),
+                              contents.size());
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        auto known = d_models.find(key);
+        if (known != d_models.end()) {
+            ++d_reuses;
+            return known->second;
+        }
+    }
+
+    EVALUATION_TRACE("parse", "parse XML", Tracer::Detail(path));
+    std::shared_ptr<Model> model(new Model);
+    model->hash = key.first;
+    auto result = model->document.load_buffer(contents.data(), contents.size());
+    if (result.status != pugi::xml_parse_status::status_ok) {
+        throw std::runtime_error(std::string("Invalid file for EvaluationParser of '")
+                + path + "' : "
+                + result.description());
+    }
+    for (const auto &node : model->document.child("root")) {
+        if (node.name() == std::string("include")) {
+            model->includes.push_back(node.attribute("file").value());
+        } else if (node.name() != std::string("variable")) {
+            throw std::runtime_error(
+                "Should have only expression/variable at root level");
+        }
+    }
+    ++d_parses;
+
+    std::lock_guard<std::mutex> lock(d_mutex);
+    // Another thread may have parsed the same contents meanwhile.
+    auto inserted = d_models.insert(std::make_pair(key, ModelPtr(model)));
+    return inserted.first->second;
+}
+
+ModelLibrary::Snapshot ModelLibrary::load(const std::string &fname) {
+    EVALUATION_TRACE("load", "load files", Tracer::Detail(fname));
+    Snapshot snapshot;
+    snapshot.root = Resolve(std::string(), fname);
+    std::vector<std::string> level{snapshot.root};
+    std::set<std::string> seen(level.begin(), level.end());
+    while (!level.empty()) {
+        // Files of one level do not depend on each other: read them in parallel.
+        std::vector<ModelPtr> models(level.size());
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < level.size(); i = next++)
+                models[i] = get(level[i]);
+        };
+        std::vector<std::future<void>> workers;
+        for (size_t i = 1; i < std::min(d_threads, level.size()); ++i)
+            workers.push_back(std::async(std::launch::async, [&]() {
+                Tracer::NameThread("model library");
+                worker();
+            }));
+        worker();
+        for (auto &result : workers) result.get();
+
+        std::vector<std::string> includes;
+        for (size_t i = 0; i < level.size(); ++i) {
+            snapshot.files[level[i]] = models[i];
+            // Resolved here, not in get(): the same contents may sit in
+            // several directories, each with includes of its own.
+            auto &resolved = snapshot.includes[level[i]];
+            for (const auto &file : models[i]->includes) {
+                resolved.push_back(Resolve(level[i], file));
+                if (seen.insert(resolved.back()).second) includes.push_back(resolved.back());
+            }
+        }
+        level.swap(includes);
+    }
+    return snapshot;
+}
+
+ModelLibrary::Statistics ModelLibrary::statistics() const {
+    Statistics statistics;
+    statistics.reads = d_reads;
+    statistics.parses = d_parses;
+    statistics.reuses = d_reuses;
+    return statistics;
+}
+
+size_t ModelLibrary::size() const {
+    std::lock_guard<std::mutex> lock(d_mutex);
+    return d_models.size();
+}
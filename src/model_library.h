@@ -0,0 +1,73 @@
+#ifndef MODEL_LIBRARY_H
+#define MODEL_LIBRARY_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "pugixml.hpp"
+
+//! Parsed model files shared by every context built from them.
+/*!
+  A model file may pull in others with <include file="..."/> at root level,
+  paths being relative to the including file. Files are keyed by content
+  hash, so a library included from several places (or under several paths)
+  is parsed once and kept for later loads. Only the parsed documents are
+  shared: each context still builds its own nodes and variables, and the
+  includes of a file are resolved against its own path on every load.
+*/
+class ModelLibrary {
+   public:
+    struct Model {
+        uint64_t hash;
+        pugi::xml_document document;
+        //! Included files as written, in document order.
+        std::vector<std::string> includes;
+    };
+    using ModelPtr = std::shared_ptr<const Model>;
+
+    //! Files of one load by canonical path; `root` is the file asked for.
+    struct Snapshot {
+        std::string root;
+        std::map<std::string, ModelPtr> files;
+        //! Canonical paths of the files each file includes, in document order.
+        std::map<std::string, std::vector<std::string>> includes;
+    };
+
+    struct Statistics {
+        size_t reads = 0;
+        size_t parses = 0;
+        //! Files whose contents were already parsed.
+        size_t reuses = 0;
+    };
+
+    //! threads bounds the files read and parsed concurrently (0: one per core).
+    explicit ModelLibrary(size_t threads = 0);
+
+    //! Loads a file and everything it includes, one include level at a time.
+    Snapshot load(const std::string& fname);
+
+    Statistics statistics() const;
+    //! Distinct models held.
+    size_t size() const;
+
+    static std::string ReadFile(const std::string& fname);
+    //! Canonical path of `include` as written in the file `from`.
+    static std::string Resolve(const std::string& from, const std::string& include);
+
+   private:
+    ModelPtr get(const std::string& path);
+
+    size_t d_threads;
+    mutable std::mutex d_mutex;
+    // By content hash and size.
+    std::map<std::pair<uint64_t, size_t>, ModelPtr> d_models;
+    std::atomic<size_t> d_reads, d_parses, d_reuses;
+};
+
+#endif
@@ -0,0 +1,399 @@
+#include "monte_carlo.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include "batch_evaluator.h"
+#include "number_text.h"
+
+namespace {
+
+const double Pi = 3.14159265358979323846;
+
+// Primitive polynomials (degree, coefficients) and initial direction
+// numbers of dimensions 2 and up, from new-joe-kuo-6.21201.
+struct Polynomial {
+    unsigned degree;
+    unsigned coefficients;
+    unsigned initial[7];
+};
+const Polynomial Polynomials[Sobol::MaxDimensions - 1] = {
+    {1, 0, {1}},
+    {2, 1, {1, 3}},
+    {3, 1, {1, 3, 1}},
+    {3, 2, {1, 1, 1}},
+    {4, 1, {1, 1, 3, 3}},
+    {4, 4, {1, 3, 5, 13}},
+    {5, 2, {1, 1, 5, 5, 17}},
+    {5, 4, {1, 1, 5, 5, 5}},
+    {5, 7, {1, 1, 7, 11, 19}},
+    {5, 11, {1, 1, 5, 1, 1}},
+    {5, 13, {1, 1, 1, 3, 11}},
+    {5, 14, {1, 3, 5, 5, 31}},
+    {6, 1, {1, 3, 3, 9, 7, 49}},
+    {6, 13, {1, 1, 1, 15, 21, 21}},
+    {6, 16, {1, 3, 1, 13, 27, 49}},
+    {6, 19, {1, 1, 1, 15, 7, 5}},
+    {6, 22, {1, 3, 1, 15, 13, 25}},
+    {6, 25, {1, 1, 5, 5, 19, 61}},
+    {7, 1, {1, 3, 7, 11, 23, 15, 103}},
+    {7, 4, {1, 3, 7, 13, 13, 15, 69}},
+};
+
+// (high, low) words of a * b.
+inline void MultiplyWide(uint32_t a, uint32_t b, uint32_t& high, uint32_t& low) {
+    uint64_t product = static_cast<uint64_t>(a) * b;
+    high = static_cast<uint32_t>(product >> 32);
+    low = static_cast<uint32_t>(product);
+}
+
+// 53 random bits of two words, centred in their interval of (0, 1).
+inline double Uniform(uint32_t high, uint32_t low) {
+    uint64_t bits = (static_cast<uint64_t>(high) << 32 | low) >> 11;
+    return (bits + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+}  // namespace
+
+Philox::Philox(uint64_t seed) {
+    d_key[0] = static_cast<uint32_t>(seed);
+    d_key[1] = static_cast<uint32_t>(seed >> 32);
+}
+
+void Philox::generate(uint32_t counter[4]) const {
+    uint32_t key[2] = {d_key[0], d_key[1]};
+    for (int round = 0; round < 10; ++round) {
+        uint32_t high0, low0, high1, low1;
+        MultiplyWide(0xD2511F53, counter[0], high0, low0);
+        MultiplyWide(0xCD9E8D57, counter[2], high1, low1);
+        uint32_t next[4] = {high1 ^ counter[1] ^ key[0], low1, high0 ^ counter[3] ^ key[1],
+                            low0};
+        std::copy(next, next + 4, counter);
+        key[0] += 0x9E3779B9;
+        key[1] += 0xBB67AE85;
+    }
+}
+
+void Philox::fill(uint64_t first, size_t count, uint32_t dimension, double* out) const {
+    // One block of four words is two uniforms: samples 2n and 2n + 1.
+    for (uint64_t sample = first; sample < first + count;) {
+        uint64_t pair = sample / 2;
+        uint32_t counter[4] = {static_cast<uint32_t>(pair), static_cast<uint32_t>(pair >> 32),
+                               dimension, 0};
+        generate(counter);
+        if (sample % 2 == 0) out[sample++ - first] = Uniform(counter[0], counter[1]);
+        if (sample < first + count) out[sample++ - first] = Uniform(counter[2], counter[3]);
+    }
+}
+
+Sobol::Sobol(size_t dimensions) : d_directions(dimensions * 32) {
+    if (dimensions > MaxDimensions)
+        throw std::runtime_error("Sobol sequence supports up to " +
+                                 std::to_string(MaxDimensions) + " dimensions");
+    for (size_t d = 0; d < dimensions; ++d) {
+        uint32_t* v = &d_directions[d * 32];
+        if (d == 0) {
+            for (unsigned k = 0; k < 32; ++k) v[k] = 1u << (31 - k);
+            continue;
+        }
+        const auto& polynomial = Polynomials[d - 1];
+        unsigned s = polynomial.degree;
+        for (unsigned k = 0; k < s; ++k) v[k] = polynomial.initial[k] << (31 - k);
+        for (unsigned k = s; k < 32; ++k) {
+            v[k] = v[k - s] ^ (v[k - s] >> s);
+            for (unsigned j = 1; j < s; ++j)
+                if ((polynomial.coefficients >> (s - 1 - j)) & 1) v[k] ^= v[k - j];
+        }
+    }
+}
+
+void Sobol::fill(uint64_t first, size_t count, size_t dimension, double* out) const {
+    if (first + count > (uint64_t(1) << 32))
+        throw std::runtime_error("Sobol sequence has 2^32 points");
+    const uint32_t* v = &d_directions[dimension * 32];
+    // Point n is the xor of the directions of the bits of its Gray code;
+    // consecutive codes differ in the lowest set bit of n.
+    uint64_t gray = first ^ (first >> 1);
+    uint32_t x = 0;
+    for (unsigned b = 0; b < 32; ++b)
+        if ((gray >> b) & 1) x ^= v[b];
+    for (size_t i = 0; i < count; ++i) {
+        if (i) {
+            uint64_t n = first + i;
+            unsigned bit = 0;
+            while (!((n >> bit) & 1)) ++bit;
+            x ^= v[bit];
+        }
+        out[i] = (x + 0.5) * (1.0 / 4294967296.0);
+    }
+}
+
+MonteCarlo::Distribution MonteCarlo::Distribution::Uniform(double low, double high) {
+    if (!(low < high)) throw std::runtime_error("Uniform distribution needs low < high");
+    return Distribution{Kind::Uniform, low, high};
+}
+
+MonteCarlo::Distribution MonteCarlo::Distribution::Normal(double mean, double deviation) {
+    if (!(deviation >= 0)) throw std::runtime_error("Negative standard deviation");
+    return Distribution{Kind::Normal, mean, deviation};
+}
+
+MonteCarlo::Distribution MonteCarlo::Distribution::LogNormal(double mu, double sigma) {
+    if (!(sigma >= 0)) throw std::runtime_error("Negative standard deviation");
+    return Distribution{Kind::LogNormal, mu, sigma};
+}
+
+struct MonteCarlo::Worker {
+    std::unique_ptr<BatchEvaluator> batch;
+    // A block of samples per variable, and of results per output.
+    std::vector<std::vector<double>> values;
+    std::vector<std::vector<double>> results;
+    std::vector<Aggregate> aggregates;
+    std::exception_ptr error;
+};
+
+MonteCarlo::MonteCarlo(EvaluationContext& context, const std::vector<std::string>& outputs)
+    : d_context(context), d_outputs(outputs) {
+    BatchEvaluator check(context, outputs);
+}
+
+void MonteCarlo::sample(const std::string& name, const Distribution& distribution) {
+    if (!d_context.isKnownVariable(name)) throw std::runtime_error("Unknown variable " + name);
+    for (auto& variable : d_variables) {
+        if (variable.name != name) continue;
+        if (variable.group >= 0 && distribution.kind == Distribution::Kind::Uniform)
+            throw std::runtime_error("Correlated variable " + name + " must be normal");
+        variable.distribution = distribution;
+        return;
+    }
+    d_variables.push_back(Variable{name, distribution, -1});
+}
+
+void MonteCarlo::correlate(const std::vector<std::string>& names,
+                           const std::vector<double>& correlation) {
+    size_t n = names.size();
+    if (correlation.size() != n * n)
+        throw std::runtime_error("Correlation matrix must be " + std::to_string(n) + "x" +
+                                 std::to_string(n));
+    Group group;
+    for (const auto& name : names) {
+        auto variable = std::find_if(d_variables.begin(), d_variables.end(),
+                                     [&name](const Variable& v) { return v.name == name; });
+        if (variable == d_variables.end())
+            throw std::runtime_error("Variable " + name + " is not sampled");
+        if (variable->distribution.kind == Distribution::Kind::Uniform)
+            throw std::runtime_error("Correlated variable " + name + " must be normal");
+        if (variable->group >= 0)
+            throw std::runtime_error("Variable " + name + " is already correlated");
+        group.members.push_back(variable - d_variables.begin());
+    }
+    // Cholesky: correlation = L L^T, column by column.
+    group.factor.assign(n * n, 0);
+    auto& l = group.factor;
+    for (size_t i = 0; i < n; ++i) {
+        if (correlation[i * n + i] != 1)
+            throw std::runtime_error("Correlation matrix needs a unit diagonal");
+        for (size_t j = 0; j < i; ++j)
+            if (correlation[i * n + j] != correlation[j * n + i])
+                throw std::runtime_error("Correlation matrix is not symmetric");
+    }
+    for (size_t j = 0; j < n; ++j) {
+        double diagonal = correlation[j * n + j];
+        for (size_t k = 0; k < j; ++k) diagonal -= l[j * n + k] * l[j * n + k];
+        if (!(diagonal > 0))
+            throw std::runtime_error("Correlation matrix is not positive definite");
+        l[j * n + j] = std::sqrt(diagonal);
+        for (size_t i = j + 1; i < n; ++i) {
+            double sum = correlation[i * n + j];
+            for (size_t k = 0; k < j; ++k) sum -= l[i * n + k] * l[j * n + k];
+            l[i * n + j] = sum / l[j * n + j];
+        }
+    }
+    for (auto member : group.members) d_variables[member].group = static_cast<int>(d_groups.size());
+    d_groups.push_back(group);
+}
+
+void MonteCarlo::draw(Worker& worker, uint64_t first, size_t count, const Philox& philox,
+                      const Sobol* sobol) const {
+    for (size_t v = 0; v < d_variables.size(); ++v) {
+        double* values = worker.values[v].data();
+        if (sobol)
+            sobol->fill(first, count, v, values);
+        else
+            philox.fill(first, count, static_cast<uint32_t>(v), values);
+        const auto& distribution = d_variables[v].distribution;
+        if (distribution.kind == Distribution::Kind::Uniform) {
+            double width = distribution.second - distribution.first;
+            for (size_t i = 0; i < count; ++i) values[i] = distribution.first + width * values[i];
+        } else {
+            for (size_t i = 0; i < count; ++i) values[i] = InverseNormal(values[i]);
+        }
+    }
+    // Correlate standard normals: z <- L z, last row first so that it is in place.
+    for (const auto& group : d_groups) {
+        size_t n = group.members.size();
+        for (size_t i = n; i-- > 0;) {
+            double* out = worker.values[group.members[i]].data();
+            const double* row = &group.factor[i * n];
+            for (size_t r = 0; r < count; ++r) {
+                double sum = 0;
+                for (size_t j = 0; j <= i; ++j) sum += row[j] * worker.values[group.members[j]][r];
+                out[r] = sum;
+            }
+        }
+    }
+    for (size_t v = 0; v < d_variables.size(); ++v) {
+        double* values = worker.values[v].data();
+        const auto& distribution = d_variables[v].distribution;
+        if (distribution.kind == Distribution::Kind::Normal) {
+            for (size_t i = 0; i < count; ++i)
+                values[i] = distribution.first + distribution.second * values[i];
+        } else if (distribution.kind == Distribution::Kind::LogNormal) {
+            for (size_t i = 0; i < count; ++i)
+                values[i] = std::exp(distribution.first + distribution.second * values[i]);
+        }
+    }
+}
+
+MonteCarlo::Result MonteCarlo::run() { return run(Options()); }
+
+MonteCarlo::Result MonteCarlo::run(const Options& options) {
+    auto start = std::chrono::steady_clock::now();
+    const size_t block = BatchEvaluator::BlockRows;
+    size_t threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+    threads = std::max<size_t>(1, threads);
+    Philox philox(options.seed);
+    std::unique_ptr<Sobol> sobol;
+    if (options.sequence == Sequence::Sobol) {
+        sobol.reset(new Sobol(d_variables.size()));
+        if (options.samples > (uint64_t(1) << 32))
+            throw std::runtime_error("Sobol sequence has 2^32 points");
+    }
+
+    std::vector<Worker> workers(threads);
+    for (auto& worker : workers) {
+        worker.batch.reset(new BatchEvaluator(d_context, d_outputs));
+        auto needed = worker.batch->variables();
+        worker.values.assign(d_variables.size(), std::vector<double>(block));
+        for (size_t v = 0; v < d_variables.size(); ++v)
+            if (std::binary_search(needed.begin(), needed.end(), d_variables[v].name))
+                worker.batch->bind(d_variables[v].name, worker.values[v].data());
+        worker.results.assign(d_outputs.size(), std::vector<double>(block));
+        for (size_t o = 0; o < d_outputs.size(); ++o)
+            worker.batch->bindResult(d_outputs[o], worker.results[o].data());
+    }
+
+    Result result;
+    result.outputs = d_outputs;
+    result.aggregates.assign(d_outputs.size(), Aggregate(options.spec));
+    while (result.samples < options.samples) {
+        // Rounds double, so that checkpoints are spread evenly on a log scale.
+        uint64_t first = result.samples;
+        uint64_t end = std::min<uint64_t>(options.samples, first ? 2 * first : block * threads);
+        uint64_t blocks = (end - first + block - 1) / block;
+        std::vector<std::thread> running;
+        for (size_t t = 0; t < threads; ++t) {
+            uint64_t from = first + blocks * t / threads * block;
+            uint64_t to = std::min<uint64_t>(end, first + blocks * (t + 1) / threads * block);
+            auto& worker = workers[t];
+            worker.aggregates.assign(d_outputs.size(), Aggregate(options.spec));
+            auto work = [this, &worker, &philox, &sobol, from, to] {
+                try {
+                    for (uint64_t at = from; at < to; at += BatchEvaluator::BlockRows) {
+                        auto count = static_cast<size_t>(
+                            std::min<uint64_t>(BatchEvaluator::BlockRows, to - at));
+                        draw(worker, at, count, philox, sobol.get());
+                        worker.batch->run(count);
+                        for (size_t o = 0; o < worker.results.size(); ++o)
+                            worker.aggregates[o].add(worker.results[o].data(), count, at);
+                    }
+                } catch (...) {
+                    worker.error = std::current_exception();
+                }
+            };
+            if (t + 1 == threads)
+                work();
+            else
+                running.emplace_back(work);
+        }
+        for (auto& thread : running) thread.join();
+        for (auto& worker : workers)
+            if (worker.error) std::rethrow_exception(worker.error);
+        for (auto& worker : workers)
+            for (size_t o = 0; o < d_outputs.size(); ++o)
+                result.aggregates[o].merge(worker.aggregates[o]);
+        result.samples = end;
+
+        Checkpoint checkpoint;
+        checkpoint.samples = end;
+        bool converged = options.tolerance > 0;
+        for (const auto& aggregate : result.aggregates) {
+            double mean = aggregate.mean();
+            double error = std::sqrt(aggregate.variance() / aggregate.count());
+            checkpoint.means.push_back(mean);
+            checkpoint.errors.push_back(error);
+            converged = converged && error <= options.tolerance * std::fabs(mean);
+        }
+        result.convergence.push_back(checkpoint);
+        if (converged) break;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+    return result;
+}
+
+void MonteCarlo::Result::write(std::ostream& out) {
+    out << "{\"samples\": " << samples << ", \"seconds\": " << NumberText::Json(seconds)
+        << ",\n \"outputs\": {";
+    for (size_t o = 0; o < outputs.size(); ++o) {
+        out << (o ? ",\n  " : "") << "\"" << outputs[o] << "\": ";
+        aggregates[o].write(out);
+    }
+    out << "},\n \"convergence\": [";
+    for (size_t c = 0; c < convergence.size(); ++c) {
+        out << (c ? ",\n  " : "") << "{\"samples\": " << convergence[c].samples;
+        for (size_t o = 0; o < outputs.size(); ++o)
+            out << ", \"" << outputs[o]
+                << "\": {\"mean\": " << NumberText::Json(convergence[c].means[o])
+                << ", \"error\": " << NumberText::Json(convergence[c].errors[o]) << "}";
+        out << "}";
+    }
+    out << "]}";
+}
+
+double MonteCarlo::InverseNormal(double p) {
+    if (!(p > 0)) return p == 0 ? -std::numeric_limits<double>::infinity() : p;
+    if (!(p < 1)) return p == 1 ? std::numeric_limits<double>::infinity() : p;
+    // Acklam's rational approximations (relative error 1.2e-9), then one
+    // step of Halley's method on the exact distribution function.
+    static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02,
+                               -2.759285104469687e+02, 1.383577518672690e+02,
+                               -3.066479806614716e+01, 2.506628277459239e+00};
+    static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02,
+                               -1.556989798598866e+02, 6.680131188771972e+01,
+                               -1.328068155288572e+01};
+    static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01,
+                               -2.400758277161838e+00, -2.549732539343734e+00,
+                               4.374664141464968e+00,  2.938163982698783e+00};
+    static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01,
+                               2.445134137142996e+00, 3.754408661907416e+00};
+    const double low = 0.02425;
+    double x;
+    if (p < low || p > 1 - low) {
+        double q = std::sqrt(-2 * std::log(p < low ? p : 1 - p));
+        x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+            ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+        if (p > low) x = -x;
+    } else {
+        double q = p - 0.5, r = q * q;
+        x = (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q /
+            (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+    }
+    double e = 0.5 * std::erfc(-x / std::sqrt(2.0)) - p;
+    double u = e * std::sqrt(2 * Pi) * std::exp(x * x / 2);
+    return x - u / (1 + x * u / 2);
+}
@@ -0,0 +1,151 @@
+#ifndef MONTE_CARLO_H
+#define MONTE_CARLO_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "aggregate.h"
+#include "evaluation.h"
+
+//! Philox4x32-10 counter-based random numbers.
+/*!
+  Output block n of a stream is a bijection of the counter n under the
+  key: any element of any stream is computed directly, without state, so
+  threads draw from disjoint counters and the numbers do not depend on how
+  the work is split.
+*/
+class Philox {
+    uint32_t d_key[2];
+
+   public:
+    explicit Philox(uint64_t seed);
+    //! The four words of `counter` under the key, in place.
+    void generate(uint32_t counter[4]) const;
+    //! Uniforms in (0, 1) of `dimension` for the samples [first, first + count).
+    void fill(uint64_t first, size_t count, uint32_t dimension, double* out) const;
+};
+
+//! Sobol low-discrepancy sequence, Joe and Kuo direction numbers.
+/*!
+  Points are 32-bit fractions shifted by half a step, so that no
+  coordinate is exactly 0; the first 2^k points of every dimension still
+  fall one in each interval of width 2^-k.
+*/
+class Sobol {
+   public:
+    static const size_t MaxDimensions = 21;
+
+   private:
+    std::vector<uint32_t> d_directions;
+
+   public:
+    explicit Sobol(size_t dimensions);
+    //! Coordinate `dimension` of the points [first, first + count).
+    void fill(uint64_t first, size_t count, size_t dimension, double* out) const;
+};
+
+//! Evaluates expressions over random samples of their variables.
+/*!
+  Every sampled variable gets a distribution and a dimension of the random
+  sequence, in the order sample() is called; groups of normal or
+  lognormal variables can be correlated through the Cholesky factor of
+  their correlation matrix. Samples are drawn a block at a time into the
+  inputs of a BatchEvaluator per thread, and the outputs reduced to
+  Aggregates without being stored, so memory does not grow with the
+  number of samples.
+
+  Sample i is the same whatever the number of threads: pseudo-random
+  samples come from a Philox stream keyed by the seed, quasi-random ones
+  are point i of a Sobol sequence. The run is split into rounds that
+  double in size, and the mean and standard error of every output are
+  recorded after each one; with a tolerance, the run stops at the first
+  round where every output is known within it. For Sobol samples the
+  error reported is that of independent samples, which overstates the
+  error of the quasi-random estimate.
+*/
+class MonteCarlo {
+   public:
+    struct Distribution {
+        enum class Kind { Uniform, Normal, LogNormal };
+        Kind kind;
+        //! Low and high, mean and standard deviation, or those of the log.
+        double first, second;
+
+        static Distribution Uniform(double low, double high);
+        static Distribution Normal(double mean, double deviation);
+        static Distribution LogNormal(double mu, double sigma);
+    };
+    enum class Sequence { Philox, Sobol };
+
+    struct Options {
+        uint64_t samples = 1 << 20;
+        uint64_t seed = 0;
+        Sequence sequence = Sequence::Philox;
+        //! 0 for one per hardware thread.
+        size_t threads = 0;
+        //! Stop once every standard error is within tolerance * |mean|; 0 never.
+        double tolerance = 0;
+        Aggregate::Spec spec;
+    };
+    //! Estimates after the first `samples` samples.
+    struct Checkpoint {
+        uint64_t samples;
+        std::vector<double> means;
+        std::vector<double> errors;
+    };
+    struct Result {
+        std::vector<std::string> outputs;
+        std::vector<Aggregate> aggregates;
+        std::vector<Checkpoint> convergence;
+        uint64_t samples = 0;
+        double seconds = 0;
+        //! JSON object of the aggregates and the convergence of the means.
+        void write(std::ostream& out);
+    };
+
+   private:
+    struct Variable {
+        std::string name;
+        Distribution distribution;
+        // Correlated group, or -1.
+        int group;
+    };
+    struct Group {
+        std::vector<size_t> members;
+        // Lower triangular Cholesky factor, row-major.
+        std::vector<double> factor;
+    };
+    struct Worker;
+
+    EvaluationContext& d_context;
+    std::vector<std::string> d_outputs;
+    std::vector<Variable> d_variables;
+    std::vector<Group> d_groups;
+
+    void draw(Worker& worker, uint64_t first, size_t count, const Philox& philox,
+              const Sobol* sobol) const;
+
+   public:
+    //! Compiles `outputs` of `context`, which must outlive the engine.
+    MonteCarlo(EvaluationContext& context, const std::vector<std::string>& outputs);
+
+    //! Draws variable `name` from `distribution`, replacing any earlier one.
+    void sample(const std::string& name, const Distribution& distribution);
+    //! Correlates sampled normal or lognormal variables.
+    /*!
+      `correlation` is the row-major matrix of `names`, of the normals
+      themselves for lognormals. Throws unless it is a symmetric positive
+      definite matrix with a unit diagonal.
+    */
+    void correlate(const std::vector<std::string>& names, const std::vector<double>& correlation);
+
+    Result run();
+    Result run(const Options& options);
+
+    //! Standard normal quantile of `p` in (0, 1), to full double precision.
+    static double InverseNormal(double p);
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include "number_text.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace {
+
+// Powers of ten that are exact doubles: m * 10^e and m / 10^e round once.
+const double ExactPowers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                              1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                              1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+const int MaxExactPower = 22;
+const uint64_t MaxExactMantissa = uint64_t(1) << 53;
+
+const uint64_t Powers[] = {1ULL,
+                           10ULL,
+                           100ULL,
+                           1000ULL,
+                           10000ULL,
+                           100000ULL,
+                           1000000ULL,
+                           10000000ULL,
+                           100000000ULL,
+                           1000000000ULL,
+                           10000000000ULL,
+                           100000000000ULL,
+                           1000000000000ULL,
+                           10000000000000ULL,
+                           100000000000000ULL,
+                           1000000000000000ULL,
+                           10000000000000000ULL,
+                           100000000000000000ULL};
+
+// 10^n in extended precision for every scale Format can need: doubles span
+// decimal exponents [-324, 308] and at most 17 digits are kept.
+struct ScalePowers {
+    static const int Low = -310;
+    static const int High = 345;
+    long double values[High - Low + 1];
+    ScalePowers() {
+        for (int n = Low; n <= High; ++n) values[n - Low] = std::pow(10.0L, n);
+    }
+    long double operator()(int n) const { return values[n - Low]; }
+};
+
+const ScalePowers& Scales() {
+    static const ScalePowers scales;
+    return scales;
+}
+
+bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// strtod on [begin, end), which holds a complete token.
+const char* Fallback(const char* begin, const char* end, double& value) {
+    char copy[64];
+    std::string longer;
+    const char* text = copy;
+    size_t length = end - begin;
+    if (length < sizeof(copy)) {
+        std::memcpy(copy, begin, length);
+        copy[length] = '\0';
+    } else {
+        longer.assign(begin, end);
+        text = longer.c_str();
+    }
+    char* stop;
+    value = std::strtod(text, &stop);
+    if (stop == text) return nullptr;
+    return begin + (stop - text);
+}
+
+// Whether mantissa * 10^exponent reads back as `value`.
+bool RoundTrips(uint64_t mantissa, int exponent, double value) {
+    if (mantissa <= MaxExactMantissa && exponent >= -MaxExactPower &&
+        exponent <= MaxExactPower) {
+        double back = static_cast<double>(mantissa);
+        back = exponent < 0 ? back / ExactPowers[-exponent] : back * ExactPowers[exponent];
+        return back == value;
+    }
+    char text[48];
+    std::snprintf(text, sizeof(text), "%llue%d", static_cast<unsigned long long>(mantissa),
+                  exponent);
+    return std::strtod(text, nullptr) == value;
+}
+
+// The `precision` leading digits of value (> 0), correctly rounded, and
+// the decimal exponent of the first one.
+uint64_t Digits(double value, int precision, int& exponent) {
+    const auto& scales = Scales();
+    for (;;) {
+        long double scaled = value * scales(precision - 1 - exponent);
+        auto digits = static_cast<uint64_t>(std::llround(scaled));
+        if (digits >= Powers[precision]) {
+            ++exponent;
+        } else if (digits < Powers[precision - 1]) {
+            --exponent;
+        } else {
+            return digits;
+        }
+    }
+}
+
+char* WriteInteger(uint64_t value, char* out) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (count) *out++ = digits[--count];
+    return out;
+}
+
+}  // namespace
+
+const char* NumberText::Parse(const char* begin, const char* end, double& value) {
+    const char* p = begin;
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false, truncated = false;
+    for (; p != end && IsDigit(*p); ++p) {
+        any = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) ++digits;
+        } else {
+            truncated = true;
+            ++exponent;
+        }
+    }
+    if (p != end && *p == '.') {
+        for (++p; p != end && IsDigit(*p); ++p) {
+            any = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) ++digits;
+                --exponent;
+            } else {
+                truncated = true;
+            }
+        }
+    }
+    if (!any) {
+        // inf, infinity and nan are left to strtod.
+        if (p != end && (*p == 'i' || *p == 'I' || *p == 'n' || *p == 'N')) {
+            const char* token = p;
+            while (token != end && ((*token | 0x20) >= 'a' && (*token | 0x20) <= 'z')) ++token;
+            return Fallback(begin, token, value);
+        }
+        return nullptr;
+    }
+    if (p != end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool negativeExponent = false;
+        if (q != end && (*q == '-' || *q == '+')) negativeExponent = *q++ == '-';
+        if (q != end && IsDigit(*q)) {
+            int written = 0;
+            for (; q != end && IsDigit(*q); ++q) {
+                if (written < 100000) written = written * 10 + (*q - '0');
+            }
+            exponent += negativeExponent ? -written : written;
+            p = q;
+        }
+    }
+
+    if (truncated || mantissa > MaxExactMantissa ||
+        (mantissa && (exponent < -MaxExactPower || exponent > MaxExactPower)))
+        return Fallback(begin, p, value);
+    double result = static_cast<double>(mantissa);
+    if (mantissa)
+        result = exponent < 0 ? result / ExactPowers[-exponent] : result * ExactPowers[exponent];
+    value = negative ? -result : result;
+    return p;
+}
+
+size_t NumberText::Format(double value, char* out) {
+    char* p = out;
+    if (std::isnan(value)) {
+        std::memcpy(p, "nan", 3);
+        return 3;
+    }
+    if (std::signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+    if (std::isinf(value)) {
+        std::memcpy(p, "inf", 3);
+        return p + 3 - out;
+    }
+    if (value < 9007199254740992.0 && value == std::floor(value))
+        return WriteInteger(static_cast<uint64_t>(value), p) - out;
+
+    int exponent = static_cast<int>(std::floor(std::log10(value)));
+    int precision = 15;
+    uint64_t digits = Digits(value, precision, exponent);
+    while (precision < 17 && !RoundTrips(digits, exponent - precision + 1, value))
+        digits = Digits(value, ++precision, exponent);
+    while (precision > 1 && digits % 10 == 0) {
+        digits /= 10;
+        --precision;
+    }
+    char text[20];
+    WriteInteger(digits, text);
+
+    if (exponent >= -4 && exponent < 17) {
+        if (exponent < 0) {
+            *p++ = '0';
+            *p++ = '.';
+            for (int zero = -1; zero > exponent; --zero) *p++ = '0';
+            std::memcpy(p, text, precision);
+            return p + precision - out;
+        }
+        for (int i = 0; i <= exponent; ++i) *p++ = i < precision ? text[i] : '0';
+        if (precision > exponent + 1) {
+            *p++ = '.';
+            std::memcpy(p, text + exponent + 1, precision - exponent - 1);
+            p += precision - exponent - 1;
+        }
+        return p - out;
+    }
+    *p++ = text[0];
+    if (precision > 1) {
+        *p++ = '.';
+        std::memcpy(p, text + 1, precision - 1);
+        p += precision - 1;
+    }
+    *p++ = 'e';
+    *p++ = exponent < 0 ? '-' : '+';
+    unsigned magnitude = exponent < 0 ? -exponent : exponent;
+    if (magnitude < 10) *p++ = '0';
+    return WriteInteger(magnitude, p) - out;
+}
+
+std::string NumberText::Json(double value) {
+    if (!std::isfinite(value)) return "null";
+    char text[MaxLength];
+    return std::string(text, Format(value, text));
+}
@@ -0,0 +1,36 @@
+#ifndef NUMBER_TEXT_H
+#define NUMBER_TEXT_H
+
+#include <cstddef>
+#include <string>
+
+//! Allocation-free conversions between doubles and decimal text.
+/*!
+  Parse reads decimal numbers, inf and nan as strtod does in the C locale.
+  Decimals with up to 19 significant digits and a small exponent (the
+  usual case for data files) are converted exactly without strtod,
+  anything else falls back to it on a stack copy.
+
+  Format writes the shortest of 15, 16 or 17 significant digits that reads
+  back as the same double, fixed for decimal exponents in [-4, 17) and
+  scientific otherwise, like %g. It never writes more than MaxLength
+  characters and does not null-terminate.
+*/
+class NumberText {
+   public:
+    static const size_t MaxLength = 32;
+
+    //! Parses a number at the start of [begin, end).
+    /*!
+      Returns the end of the number, or nullptr when [begin, end) does not
+      start with one. Leading blanks are not skipped.
+    */
+    static const char* Parse(const char* begin, const char* end, double& value);
+
+    //! Writes `value` to `out`, returns the number of characters written.
+    static size_t Format(double value, char* out);
+    //! `value` as a JSON number, as Format writes it; null when not finite.
+    static std::string Json(double value);
+};
+
+#endif
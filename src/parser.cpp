@@ -1,9 +1,18 @@
 #include "parser.h"
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <set>
 
+#include "compiled_model.h"
 #include "evaluation.h"
+#include "latency_stats.h"
+#include "mapped_file.h"
+#include "model_cache.h"
+#include "model_index.h"
+#include "model_library.h"
+#include "tracer.h"
 
 #include "pugixml.hpp"
 
@@ -36,8 +45,18 @@ BinaryOperatorNode::Function EvaluationParser::GetBinaryFunction(
 
 namespace {
 
+using Resolver = EvaluationParser::Resolver;
+
+EvalNode::Ptr GetOrCreateVariable(EvaluationContext &context,
+                                  const std::string &name) {
+    if (context.isKnownVariable(name)) return context.getVariable(name);
+    auto variable = std::make_shared<VariableNode>(name);
+    context.addVariable(name, variable);
+    return variable;
+}
+
 EvalNode::Ptr CreateNode(const pugi::xml_node &node, EvaluationContext &context,
-                         size_t level) {
+                         size_t level, const Resolver &resolve = Resolver()) {
     // Constants
     if (node.name() == std::string("constant")) {
         auto value = node.attribute("value").value();
@@ -54,29 +73,25 @@ EvalNode::Ptr CreateNode(const pugi::xml_node &node, EvaluationContext &context,
                 CreateNode(first, context, ++level));
             context.addExpression(variable_name, expression);
             return expression;
+        } else if (resolve) {
+            return resolve(variable_name);
         } else {
             // Check if we know the expression
             if (context.isKnownExpression(variable_name)) {
                 return context.getExpression(variable_name);
-                // Check if we know the variable
-            } else if (context.isKnownVariable(variable_name)) {
-                return context.getVariable(variable_name);
-            } else {
-                // else create a new variable
-                auto variable = std::make_shared<VariableNode>(variable_name);
-                context.addVariable(variable_name, variable);
-                return variable;
             }
+            // else it is a variable, known or new
+            return GetOrCreateVariable(context, variable_name);
         }
     }
     // Unary operation
     if (node.name() == std::string("un_op")) {
         auto first = *std::begin(node.children());
         // map the right operation
-        auto unary_function =
-            EvaluationParser::GetUnaryFunction(node.attribute("type").value());
+        auto type = node.attribute("type").value();
+        auto unary_function = EvaluationParser::GetUnaryFunction(type);
         return std::make_shared<UnaryOperatorNode>(
-            CreateNode(first, context, ++level), unary_function);
+            CreateNode(first, context, ++level, resolve), unary_function, type);
     }
     // Binary operation
     if (node.name() == std::string("bin_op")) {
@@ -85,38 +100,214 @@ EvalNode::Ptr CreateNode(const pugi::xml_node &node, EvaluationContext &context,
         auto iter = std::begin(children);
         auto left = *iter;
         auto right = *(++iter);
-        auto binary_function =
-            EvaluationParser::GetBinaryFunction(node.attribute("type").value());
+        auto type = node.attribute("type").value();
+        auto binary_function = EvaluationParser::GetBinaryFunction(type);
         ++level;
         return std::make_shared<BinaryOperatorNode>(
-            CreateNode(left, context, level), CreateNode(right, context, level),
-            binary_function);
+            CreateNode(left, context, level, resolve),
+            CreateNode(right, context, level, resolve), binary_function, type);
     }
     throw std::runtime_error(std::string("Unknown node = ") + node.name());
 }
 
+// Builds the definitions of a loaded file in order, each included file
+// taking the place of its <include> the first time its contents are seen.
+void Instantiate(const ModelLibrary::Snapshot &snapshot, const std::string &path,
+                 EvaluationContext &context, std::set<uint64_t> &seen) {
+    const auto &model = snapshot.files.at(path);
+    if (!seen.insert(model->hash).second) return;
+    EVALUATION_TRACE("build", "CreateNode", Tracer::Detail(path));
+    size_t include = 0;
+    for (const auto &expr_ : model->document.child("root")) {
+        if (expr_.name() == std::string("include")) {
+            Instantiate(snapshot, snapshot.includes.at(path)[include++], context, seen);
+            continue;
+        }
+        auto level = 0;
+        CreateNode(expr_, context, level);
+    }
+}
+
+// Cache key of a file and the files it includes.
+std::string CacheKey(const std::string &fname) {
+    auto contents = ModelLibrary::ReadFile(fname);
+    auto signature = CompiledModel::Signature();
+    std::set<std::string> seen;
+    std::function<void(const std::string &, const std::string &)> scan =
+        [&](const std::string &path, const std::string &text) {
+            ModelIndex index;
+            index.scan(text.data(), text.size(), [&](const std::string &file) {
+                auto include = ModelLibrary::Resolve(path, file);
+                if (!seen.insert(include).second) return;
+                auto included = ModelLibrary::ReadFile(include);
+                signature += ";" + ModelCache::Key(included, std::string());
+                scan(include, included);
+            });
+        };
+    scan(fname, contents);
+    return ModelCache::Key(contents, signature);
+}
+
+// Builds the expressions of a file as they are asked for. A reference inside
+// a definition resolves to the latest definition of that name before it, or
+// to a variable, exactly as when the whole file is read in order.
+class LazyLoader : public ExpressionLoader {
+    std::vector<std::unique_ptr<MappedFile>> d_files;
+    ModelIndex d_index;
+    // Built expressions by definition position.
+    std::vector<ExpressionNode::Ptr> d_built;
+
+    // Indexes a file and, in place, the files it includes once each.
+    void index(const std::string &path, std::set<uint64_t> &seen) {
+        d_files.emplace_back(new MappedFile(path));
+        const auto &file = *d_files.back();
+        if (!seen.insert(ModelCache::Hash(file.data(), file.size())).second) {
+            d_files.pop_back();
+            return;
+        }
+        d_index.scan(file.data(), file.size(), [&](const std::string &include) {
+            index(ModelLibrary::Resolve(path, include), seen);
+        });
+    }
+
+   public:
+    explicit LazyLoader(const std::string &fname) {
+        std::set<uint64_t> seen;
+        index(fname, seen);
+        d_built.resize(d_index.definitions().size());
+    }
+
+    virtual bool load(const std::string &name, EvaluationContext &context) {
+        auto position = d_index.last(name);
+        if (position == ModelIndex::npos) return false;
+        EVALUATION_TRACE("load", "lazy load", Tracer::Detail(name));
+
+        // Parse the definitions the expression needs that are not built yet.
+        // Ordered by position: dependencies always come first.
+        std::map<size_t, std::unique_ptr<pugi::xml_document>> pending;
+        std::vector<size_t> todo{position};
+        Tracer::Span parse("parse", "parse fragments");
+        while (!todo.empty()) {
+            auto current = todo.back();
+            todo.pop_back();
+            if (d_built[current] || pending.count(current)) continue;
+            auto &doc = pending[current];
+            doc.reset(new pugi::xml_document);
+            const auto &definition = d_index.definitions()[current];
+            auto result = doc->load_buffer(definition.data, definition.length);
+            if (result.status != pugi::xml_parse_status::status_ok) {
+                throw std::runtime_error(
+                    std::string("Invalid definition of '") + definition.name +
+                    "' : " + result.description());
+            }
+            std::vector<pugi::xml_node> nodes{doc->first_child()};
+            while (!nodes.empty()) {
+                auto node = nodes.back();
+                nodes.pop_back();
+                for (const auto &child : node.children()) {
+                    nodes.push_back(child);
+                    if (child.name() != std::string("variable")) continue;
+                    auto target =
+                        d_index.before(child.attribute("value").value(), current);
+                    if (target != ModelIndex::npos) todo.push_back(target);
+                }
+            }
+        }
+
+        parse.end();
+        EVALUATION_TRACE("build", "CreateNode");
+        for (const auto &entry : pending) {
+            auto current = entry.first;
+            auto root = entry.second->first_child();
+            auto expression_name = root.attribute("value").value();
+            auto expression = std::make_shared<ExpressionNode>(
+                expression_name,
+                CreateNode(*std::begin(root.children()), context, 1,
+                           [&](const std::string &reference) {
+                               auto target = d_index.before(reference, current);
+                               if (target != ModelIndex::npos)
+                                   return EvalNode::Ptr(d_built[target]);
+                               return GetOrCreateVariable(context, reference);
+                           }));
+            d_built[current] = expression;
+            if (d_index.last(expression_name) == current)
+                context.addExpression(expression_name, expression);
+        }
+        if (!context.isKnownExpression(name))
+            context.addExpression(name, d_built[position]);
+        return true;
+    }
+
+    virtual size_t memoryUsage() const {
+        return d_index.memoryUsage() +
+               MemoryUsage::Block(d_built.capacity() * sizeof(ExpressionNode::Ptr)) +
+               d_files.size() * MemoryUsage::Block(sizeof(MappedFile));
+    }
+};
+
 }  // namespace
 
 EvaluationContext EvaluationParser::CreateFromFile(const std::string &fname) {
-    pugi::xml_document doc;
+    ModelLibrary library;
+    return CreateFromFile(fname, library);
+}
+
+EvaluationContext EvaluationParser::CreateFromFile(const std::string &fname,
+                                                   ModelLibrary &library) {
+    EVALUATION_TRACE("load", "CreateFromFile", Tracer::Detail(fname));
+    LatencyStats::Timer timer(LatencyStats::Load);
+    DocumentMemory::ResetPeak();
+    auto baseline = DocumentMemory::Current();
+    auto snapshot = library.load(fname);
+    // We need to keep track of expressions and variables
+    auto context = EvaluationContext{};
+    std::set<uint64_t> seen;
+    Instantiate(snapshot, snapshot.root, context, seen);
+    context.setLoadDocumentPeak(DocumentMemory::Peak() - baseline);
+    return context;
+}
 
-    pugi::xml_parse_result result = doc.load_file(fname.c_str());
+ExpressionNode::Ptr EvaluationParser::CreateDefinition(
+    const char *data, size_t size, EvaluationContext &context,
+    const Resolver &resolve) {
+    pugi::xml_document doc;
+    auto result = doc.load_buffer(data, size);
     if (result.status != pugi::xml_parse_status::status_ok) {
-        throw std::runtime_error(std::string("Invalid file for EvaluationParser of '")
-                + fname + "' : " 
-                + result.description());
+        throw std::runtime_error(std::string("Invalid definition: ") +
+                                 result.description());
     }
-    // We need to keep track of expressions and variables
+    auto root = doc.first_child();
+    return std::make_shared<ExpressionNode>(
+        root.attribute("value").value(),
+        CreateNode(*std::begin(root.children()), context, 1, resolve));
+}
+
+EvaluationContext EvaluationParser::CreateLazyFromFile(
+    const std::string &fname, const std::vector<std::string> &outputs) {
+    EVALUATION_TRACE("load", "CreateLazyFromFile", Tracer::Detail(fname));
+    LatencyStats::Timer timer(LatencyStats::Load);
+    DocumentMemory::ResetPeak();
+    auto baseline = DocumentMemory::Current();
     auto context = EvaluationContext{};
-    for (const auto &expr_ : doc.child("root")) {
-        // we should always have an expression
-        auto node_name = expr_.name();
-        if (node_name != std::string("variable")) {
-            throw std::runtime_error(
-                "Should have only expression/variable at root level");
-        }
-        auto level = 0;
-        CreateNode(expr_, context, level);
+    auto loader = std::make_shared<LazyLoader>(fname);
+    context.setLoader(loader);
+    for (const auto &output : outputs) {
+        if (!loader->load(output, context))
+            throw std::runtime_error("Unknown output: " + output);
     }
+    context.setLoadDocumentPeak(DocumentMemory::Peak() - baseline);
+    return context;
+}
+
+EvaluationContext EvaluationParser::CreateFromFile(const std::string &fname,
+                                                   ModelCache &cache) {
+    LatencyStats::Timer timer(LatencyStats::Load);
+    auto key = CacheKey(fname);
+    auto context = EvaluationContext{};
+    if (cache.load(key, context)) return context;
+    // Timed by CreateFromFile.
+    timer.cancel();
+    context = CreateFromFile(fname);
+    cache.store(key, context);
     return context;
 }
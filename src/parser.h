@@ -1,15 +1,53 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <functional>
+#include <vector>
+
 #include "evaluation.h"
 
+class ModelCache;
+class ModelLibrary;
+
 class EvaluationParser {
    public:
+    //! Maps a name referenced inside an expression onto its node.
+    using Resolver = std::function<EvalNode::Ptr(const std::string&)>;
     static UnaryOperatorNode::Function GetUnaryFunction(
         const std::string& name);
     static BinaryOperatorNode::Function GetBinaryFunction(
         const std::string& name);
     static EvaluationContext CreateFromFile(const std::string& fname);
+    //! Same as above, reusing the files already parsed by the library.
+    /*!
+      Files included with <include file="..."/> are read in parallel and
+      built once per context at the place of their first include.
+    */
+    static EvaluationContext CreateFromFile(const std::string& fname,
+                                            ModelLibrary& library);
+    //! Same as above but consults an on-disk cache of compiled models first.
+    /*!
+      The cache is keyed by the file contents and the compiled model format,
+      a miss parses the file and stores the result for the next process.
+    */
+    static EvaluationContext CreateFromFile(const std::string& fname,
+                                            ModelCache& cache);
+    //! Builds only the expressions the outputs depend on.
+    /*!
+      Top-level definitions are indexed without being parsed; any other
+      expression is built on first use by EvaluationContext::calc. The file
+      must stay in place while the context is alive.
+    */
+    static EvaluationContext CreateLazyFromFile(
+        const std::string& fname, const std::vector<std::string>& outputs);
+    //! Builds one top-level <variable> element given as XML text.
+    /*!
+      The expression is not added to the context; references to other names
+      are handed to `resolve`.
+    */
+    static ExpressionNode::Ptr CreateDefinition(const char* data, size_t size,
+                                                EvaluationContext& context,
+                                                const Resolver& resolve);
 };
 
 #endif
@@ -0,0 +1,113 @@
+#include "perf_counters.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+PerfCounters::Sample &PerfCounters::Sample::operator+=(const Sample &other) {
+    for (size_t i = 0; i < EventCount; ++i) values[i] += other.values[i];
+    return *this;
+}
+
+PerfCounters::Sample PerfCounters::Sample::operator-(const Sample &other) const {
+    Sample result;
+    for (size_t i = 0; i < EventCount; ++i)
+        result.values[i] = values[i] - std::min(values[i], other.values[i]);
+    return result;
+}
+
+const char *PerfCounters::Name(Event event) {
+    static const char *names[EventCount] = {"cycles", "instructions",
+                                            "l1d_misses", "llc_misses",
+                                            "branch_misses"};
+    return names[event];
+}
+
+#ifdef __linux__
+
+namespace {
+
+int Open(uint32_t type, uint64_t config, int group) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // User space only: allowed at perf_event_paranoid 2 and what we evaluate.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+}
+
+}  // namespace
+
+PerfCounters::PerfCounters() {
+    const uint64_t cache_read_miss =
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const struct {
+        Event event;
+        uint32_t type;
+        uint64_t config;
+    } events[EventCount] = {
+        {Cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {Instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {L1DMisses, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | cache_read_miss},
+        {LLCMisses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {BranchMisses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+    for (const auto &event : events) {
+        int fd = Open(event.type, event.config, d_leader);
+        if (fd < 0) continue;
+        if (d_leader < 0) d_leader = fd;
+        d_fds.push_back(fd);
+        d_events.push_back(event.event);
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for (auto fd : d_fds) close(fd);
+}
+
+PerfCounters::Sample PerfCounters::read() const {
+    Sample sample;
+    if (d_leader < 0) return sample;
+    // nr, time enabled, time running, one value per event
+    uint64_t buffer[3 + EventCount];
+    auto size = ::read(d_leader, buffer, sizeof(buffer));
+    if (size < static_cast<ssize_t>(3 * sizeof(uint64_t))) return sample;
+    auto enabled = buffer[1], running = buffer[2];
+    double scale = running ? static_cast<double>(enabled) / running : 1.0;
+    for (size_t i = 0; i < buffer[0] && i < d_events.size(); ++i)
+        sample[d_events[i]] = static_cast<uint64_t>(buffer[3 + i] * scale);
+    return sample;
+}
+
+#else
+
+PerfCounters::PerfCounters() {}
+PerfCounters::~PerfCounters() {}
+PerfCounters::Sample PerfCounters::read() const { return Sample(); }
+
+#endif
+
+bool PerfCounters::has(Event event) const {
+    return std::find(d_events.begin(), d_events.end(), event) != d_events.end();
+}
+
+std::string PerfCounters::json(const Sample &sample, double per) const {
+    std::string result = "{";
+    char value[64];
+    for (size_t i = 0; i < d_events.size(); ++i) {
+        std::snprintf(value, sizeof(value), "%s\"%s\": %.6g", i ? ", " : "",
+                      Name(d_events[i]), sample[d_events[i]] / per);
+        result += value;
+    }
+    return result + "}";
+}
@@ -0,0 +1,57 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//! Hardware performance counters of the calling thread (Linux perf events).
+/*!
+  Events the kernel or the machine refuses (no PMU in a VM, restrictive
+  perf_event_paranoid, another OS) are left out: reading them yields zero
+  and `has` says so, so callers never have to special-case a missing PMU.
+  Counts are scaled when the kernel multiplexes the counters.
+*/
+class PerfCounters {
+   public:
+    enum Event {
+        Cycles,
+        Instructions,
+        L1DMisses,
+        LLCMisses,
+        BranchMisses,
+        EventCount
+    };
+
+    struct Sample {
+        uint64_t values[EventCount] = {};
+        uint64_t& operator[](size_t event) { return values[event]; }
+        uint64_t operator[](size_t event) const { return values[event]; }
+        Sample& operator+=(const Sample& other);
+        Sample operator-(const Sample& other) const;
+    };
+
+    //! Opens the counters for the calling thread only.
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    //! True when at least one event could be opened.
+    bool available() const { return !d_events.empty(); }
+    bool has(Event event) const;
+    //! Running totals since the counters were opened.
+    Sample read() const;
+
+    static const char* Name(Event event);
+    //! {"cycles": ..., ...} over the available events, each divided by `per`.
+    std::string json(const Sample& sample, double per = 1) const;
+
+   private:
+    int d_leader = -1;
+    std::vector<int> d_fds;
+    std::vector<Event> d_events;  // in group read order
+};
+
+#endif
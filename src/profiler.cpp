@@ -0,0 +1,200 @@
+#include "profiler.h"
+
+#include "memory_usage.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+const size_t Profiler::Root = static_cast<size_t>(-1);
+
+Profiler::Profiler(bool hardwareCounters) {
+    useHardwareCounters(hardwareCounters);
+}
+
+void Profiler::useHardwareCounters(bool enabled) {
+    if (enabled && !d_counters)
+        d_counters.reset(new PerfCounters);
+    else if (!enabled)
+        d_counters.reset();
+}
+
+uint64_t Profiler::Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+double Profiler::SecondsPerTick() {
+    // Calibrated once against the steady clock.
+    static const double seconds = []() {
+        auto start = std::chrono::steady_clock::now();
+        auto ticks = Now();
+        std::chrono::duration<double> elapsed;
+        do {
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < 0.005);
+        return elapsed.count() / static_cast<double>(Now() - ticks);
+    }();
+    return seconds;
+}
+
+size_t Profiler::add(const ExpressionNode *expression) {
+    auto inserted = d_ids.insert(std::make_pair(expression->name(), d_names.size()));
+    if (inserted.second) d_names.push_back(expression->name());
+    return inserted.first->second;
+}
+
+void Profiler::enter(size_t id) {
+    auto parent = d_stack.empty() ? Root : d_stack.back().call;
+    auto key = (static_cast<uint64_t>(parent + 1) << 32) | id;
+    auto child = d_children.find(key);
+    size_t call;
+    if (child == d_children.end()) {
+        call = d_calls.size();
+        d_calls.push_back(Call());
+        d_calls.back().expression = id;
+        d_calls.back().parent = parent;
+        d_children[key] = call;
+    } else {
+        call = child->second;
+    }
+    d_stack.push_back(Frame());
+    auto &frame = d_stack.back();
+    frame.call = call;
+    frame.children = 0;
+    if (d_counters) frame.startCounters = d_counters->read();
+    frame.start = Now();
+}
+
+void Profiler::exit() {
+    auto elapsed = Now() - d_stack.back().start;
+    const auto &frame = d_stack.back();
+    auto &call = d_calls[frame.call];
+    ++call.calls;
+    call.inclusive += elapsed;
+    call.exclusive += elapsed - std::min(elapsed, frame.children);
+    PerfCounters::Sample counters;
+    if (d_counters) {
+        counters = d_counters->read() - frame.startCounters;
+        call.inclusiveCounters += counters;
+        call.exclusiveCounters += counters - frame.childCounters;
+    }
+    d_stack.pop_back();
+    if (!d_stack.empty()) {
+        d_stack.back().children += elapsed;
+        d_stack.back().childCounters += counters;
+    }
+}
+
+std::vector<Profiler::Entry> Profiler::totals() const {
+    std::vector<Entry> entries(d_names.size());
+    auto tick = SecondsPerTick();
+    for (const auto &call : d_calls) {
+        auto &entry = entries[call.expression];
+        entry.calls += call.calls;
+        entry.inclusiveSeconds += call.inclusive * tick;
+        entry.exclusiveSeconds += call.exclusive * tick;
+        entry.inclusiveCounters += call.inclusiveCounters;
+        entry.exclusiveCounters += call.exclusiveCounters;
+    }
+    for (size_t i = 0; i < entries.size(); ++i) entries[i].name = d_names[i];
+    return entries;
+}
+
+std::map<std::string, Profiler::Entry> Profiler::measurements() const {
+    auto entries = totals();
+    std::map<std::string, Entry> result;
+    for (const auto &id : d_ids)
+        if (entries[id.second].calls) result[id.first] = entries[id.second];
+    return result;
+}
+
+std::vector<Profiler::Entry> Profiler::hotspots() const {
+    auto entries = totals();
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [](const Entry &entry) { return !entry.calls; }),
+                  entries.end());
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.exclusiveSeconds > b.exclusiveSeconds;
+    });
+    return entries;
+}
+
+void Profiler::report(std::ostream &out, size_t top) const {
+    auto entries = hotspots();
+    double total = 0;
+    for (const auto &entry : entries) total += entry.exclusiveSeconds;
+    // Exclusive hardware counts, for the events that could be opened.
+    std::vector<PerfCounters::Event> events;
+    for (size_t e = 0; d_counters && e < PerfCounters::EventCount; ++e) {
+        auto event = static_cast<PerfCounters::Event>(e);
+        if (d_counters->has(event)) events.push_back(event);
+    }
+    char line[256];
+    std::snprintf(line, sizeof(line), "%12s %14s %14s %7s", "calls",
+                  "inclusive(ms)", "exclusive(ms)", "excl%");
+    out << line;
+    for (auto event : events) {
+        std::snprintf(line, sizeof(line), " %14s", PerfCounters::Name(event));
+        out << line;
+    }
+    out << "  expression\n";
+    for (size_t i = 0; i < entries.size() && i < top; ++i) {
+        const auto &entry = entries[i];
+        std::snprintf(line, sizeof(line), "%12llu %14.3f %14.3f %6.1f%%",
+                      static_cast<unsigned long long>(entry.calls),
+                      entry.inclusiveSeconds * 1e3, entry.exclusiveSeconds * 1e3,
+                      total > 0 ? 100 * entry.exclusiveSeconds / total : 0.0);
+        out << line;
+        for (auto event : events) {
+            std::snprintf(line, sizeof(line), " %14llu",
+                          static_cast<unsigned long long>(
+                              entry.exclusiveCounters[event]));
+            out << line;
+        }
+        out << "  " << entry.name << "\n";
+    }
+}
+
+void Profiler::writeFolded(std::ostream &out) const {
+    auto tick = SecondsPerTick();
+    for (const auto &call : d_calls) {
+        if (!call.exclusive) continue;
+        std::vector<size_t> path;
+        for (auto current = &call;; current = &d_calls[current->parent]) {
+            path.push_back(current->expression);
+            if (current->parent == Root) break;
+        }
+        for (auto it = path.rbegin(); it != path.rend(); ++it)
+            out << (it == path.rbegin() ? "" : ";") << d_names[*it];
+        out << " " << static_cast<uint64_t>(call.exclusive * tick * 1e9) << "\n";
+    }
+}
+
+void Profiler::reset() {
+    d_calls.clear();
+    d_children.clear();
+    d_stack.clear();
+}
+
+size_t Profiler::memoryUsage() const {
+    size_t bytes = MemoryUsage::Block(d_calls.capacity() * sizeof(Call)) +
+                   MemoryUsage::Block(d_stack.capacity() * sizeof(Frame)) +
+                   MemoryUsage::Block(d_names.capacity() * sizeof(std::string)) +
+                   d_ids.size() * MemoryUsage::Block(4 * sizeof(void *) +
+                                                     sizeof(*d_ids.begin())) +
+                   d_children.size() * MemoryUsage::Block(
+                                           sizeof(void *) + sizeof(*d_children.begin())) +
+                   MemoryUsage::Block(d_children.bucket_count() * sizeof(void *));
+    for (const auto &name : d_names) bytes += 2 * MemoryUsage::String(name);
+    if (d_counters) bytes += MemoryUsage::Block(sizeof(PerfCounters));
+    return bytes;
+}
@@ -0,0 +1,125 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "evaluation.h"
+#include "perf_counters.h"
+
+//! Call counts and timings of the expressions of a context.
+/*!
+  Time is read from the CPU timestamp counter where there is one. Inclusive
+  time of an expression covers the expressions it calls; exclusive time does
+  not. Timings are also kept per call path for flame graphs. Hardware
+  counters can be read around each expression as well; that costs a system
+  call per evaluation, so it is off by default.
+*/
+class Profiler {
+   public:
+    struct Entry {
+        std::string name;
+        uint64_t calls = 0;
+        double inclusiveSeconds = 0;
+        double exclusiveSeconds = 0;
+        //! Zero unless hardware counters are in use.
+        PerfCounters::Sample inclusiveCounters;
+        PerfCounters::Sample exclusiveCounters;
+    };
+
+    explicit Profiler(bool hardwareCounters = false);
+    void useHardwareCounters(bool enabled);
+    //! Null when not in use.
+    const PerfCounters* counters() const { return d_counters.get(); }
+
+    //! Cheap timestamp, in ticks.
+    static uint64_t Now();
+    static double SecondsPerTick();
+
+    //! Id of an expression, registering it on first use.
+    /*!
+      Ids go by name: an expression rebuilt under the same name, as on a
+      reload, adds to the measurements of the one it replaces.
+    */
+    size_t add(const ExpressionNode* expression);
+
+    //! Every expression called at least once, most exclusive time first.
+    std::vector<Entry> hotspots() const;
+    //! Totals of every expression called at least once, by name.
+    std::map<std::string, Entry> measurements() const;
+    void report(std::ostream& out, size_t top = 20) const;
+    //! One "caller;callee exclusive-nanoseconds" line per call path, the
+    //! input format of flamegraph.pl and speedscope.
+    void writeFolded(std::ostream& out) const;
+    void reset();
+    //! Heap bytes held by the measurements.
+    size_t memoryUsage() const;
+
+    //! Times one evaluation of expression `id`, unwinding on exceptions.
+    class Scope {
+        Profiler& d_profiler;
+
+       public:
+        Scope(Profiler& profiler, size_t id) : d_profiler(profiler) {
+            profiler.enter(id);
+        }
+        ~Scope() { d_profiler.exit(); }
+    };
+
+   private:
+    // A node of the call tree: one expression reached along one path.
+    struct Call {
+        size_t expression;
+        size_t parent;
+        uint64_t calls = 0;
+        uint64_t inclusive = 0;
+        uint64_t exclusive = 0;
+        PerfCounters::Sample inclusiveCounters;
+        PerfCounters::Sample exclusiveCounters;
+    };
+    struct Frame {
+        size_t call;
+        uint64_t start;
+        uint64_t children;
+        PerfCounters::Sample startCounters;
+        PerfCounters::Sample childCounters;
+    };
+    static const size_t Root;
+
+    void enter(size_t id);
+    void exit();
+    // Totals by id, over all call paths.
+    std::vector<Entry> totals() const;
+
+    std::map<std::string, size_t> d_ids;
+    std::vector<std::string> d_names;
+    std::vector<Call> d_calls;
+    std::unordered_map<uint64_t, size_t> d_children;  // (parent, expression)
+    std::vector<Frame> d_stack;
+    std::unique_ptr<PerfCounters> d_counters;
+};
+
+//! Evaluates an expression under a Profiler::Scope.
+class ProfiledNode : public EvalNode {
+    std::shared_ptr<Profiler> d_profiler;
+    size_t d_id;
+    EvalNode::Ptr d_expression;
+
+   public:
+    ProfiledNode(const std::shared_ptr<Profiler>& profiler, size_t id,
+                 const EvalNode::Ptr& expression)
+        : d_profiler(profiler), d_id(id), d_expression(expression) {}
+    virtual double eval() {
+        Profiler::Scope scope(*d_profiler, d_id);
+        return d_expression->eval();
+    }
+    virtual Kind kind() const { return d_expression->kind(); }
+};
+
+#endif
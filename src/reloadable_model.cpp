@@ -0,0 +1,128 @@
+#include "reloadable_model.h"
+#include <atomic>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include "parser.h"
+#include "tracer.h"
+
+ReloadableModel::ReloadableModel(const std::string &fname) : d_fname(fname) {
+    d_stamp = stamp();
+    std::atomic_store(&d_current, std::make_shared<EvaluationContext>(
+                                      EvaluationParser::CreateFromFile(fname)));
+    d_statistics.version = 1;
+    d_thread = std::thread(&ReloadableModel::run, this);
+}
+
+ReloadableModel::~ReloadableModel() {
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_stop = true;
+    }
+    d_wakeup.notify_all();
+    d_thread.join();
+}
+
+ReloadableModel::ContextPtr ReloadableModel::acquire() const {
+    return std::atomic_load(&d_current);
+}
+
+void ReloadableModel::setVariable(const std::string &name, double value) {
+    std::lock_guard<std::mutex> lock(d_valuesMutex);
+    d_values[name] = value;
+    acquire()->setVariable(name, value);
+}
+
+void ReloadableModel::reload() {
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_requested = true;
+    }
+    d_wakeup.notify_all();
+}
+
+void ReloadableModel::watch(std::chrono::milliseconds interval) {
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_interval = interval;
+        d_rescheduled = true;
+    }
+    d_wakeup.notify_all();
+}
+
+void ReloadableModel::wait() {
+    std::unique_lock<std::mutex> lock(d_mutex);
+    d_done.wait(lock, [this]() { return !d_requested && !d_busy; });
+}
+
+ReloadableModel::Statistics ReloadableModel::statistics() const {
+    std::lock_guard<std::mutex> lock(d_mutex);
+    return d_statistics;
+}
+
+ReloadableModel::Stamp ReloadableModel::stamp() const {
+    Stamp result;
+    struct stat info;
+    if (stat(d_fname.c_str(), &info) == 0) {
+        result.size = info.st_size;
+        result.mtime = static_cast<long long>(info.st_mtim.tv_sec) * 1000000000LL +
+                       info.st_mtim.tv_nsec;
+    }
+    return result;
+}
+
+void ReloadableModel::rebuild() {
+    EVALUATION_TRACE("load", "reload", Tracer::Detail(d_fname));
+    auto start = std::chrono::steady_clock::now();
+    std::string error;
+    try {
+        auto context = std::make_shared<EvaluationContext>(
+            EvaluationParser::CreateFromFile(d_fname));
+        std::lock_guard<std::mutex> lock(d_valuesMutex);
+        for (const auto &value : d_values)
+            context->setVariable(value.first, value.second);
+        std::atomic_store(&d_current, context);
+    } catch (const std::exception &e) {
+        error = e.what();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::lock_guard<std::mutex> lock(d_mutex);
+    d_statistics.lastReloadSeconds = elapsed.count();
+    if (error.empty()) {
+        ++d_statistics.version;
+    } else {
+        ++d_statistics.failures;
+        d_statistics.lastError = error;
+    }
+}
+
+void ReloadableModel::run() {
+    Tracer::NameThread("reload watcher");
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (!d_stop) {
+        auto woken = [this]() { return d_stop || d_requested || d_rescheduled; };
+        if (d_interval.count())
+            d_wakeup.wait_for(lock, d_interval, woken);
+        else
+            d_wakeup.wait(lock, woken);
+        if (d_stop) break;
+        // A new interval applies from now on, whatever the wait was for.
+        d_rescheduled = false;
+
+        // Stamp before reading so a write during the rebuild is seen next time.
+        auto current = stamp();
+        if (!d_requested && current == d_stamp) continue;
+        d_stamp = current;
+        d_requested = false;
+        d_busy = true;
+        lock.unlock();
+        rebuild();
+        lock.lock();
+        d_busy = false;
+        d_done.notify_all();
+    }
+    d_done.notify_all();
+}
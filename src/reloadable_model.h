@@ -0,0 +1,90 @@
+#ifndef RELOADABLE_MODEL_H
+#define RELOADABLE_MODEL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "evaluation.h"
+
+//! A model file that can be reloaded while it is being evaluated.
+/*!
+  New versions are built on a background thread and published atomically:
+  calls that already acquired a version finish on it, later calls see the
+  new one, and a version is freed when its last reader releases it. Values
+  given to setVariable are kept and applied to every new version. A reload
+  that fails leaves the current version in place.
+
+  As with EvaluationContext, setting variables while another thread
+  evaluates the same version is left to the caller to synchronize.
+*/
+class ReloadableModel {
+   public:
+    using ContextPtr = std::shared_ptr<EvaluationContext>;
+
+    struct Statistics {
+        //! Number of versions published, the first load included.
+        size_t version = 0;
+        size_t failures = 0;
+        double lastReloadSeconds = 0;
+        std::string lastError;
+    };
+
+    //! Loads the first version synchronously; throws if that fails.
+    explicit ReloadableModel(const std::string& fname);
+    ~ReloadableModel();
+    ReloadableModel(const ReloadableModel&) = delete;
+    ReloadableModel& operator=(const ReloadableModel&) = delete;
+
+    //! The current version, kept alive as long as the pointer is held.
+    ContextPtr acquire() const;
+    double calc(const std::string& expression_name) {
+        return acquire()->calc(expression_name);
+    }
+    void setVariable(const std::string& name, double value);
+
+    //! Requests a rebuild in the background and returns immediately.
+    void reload();
+    //! Also reloads whenever the file's size or modification time changes,
+    //! checked every interval. A zero interval stops watching.
+    void watch(std::chrono::milliseconds interval);
+    //! Blocks until requested reloads have been published or have failed.
+    void wait();
+
+    Statistics statistics() const;
+
+   private:
+    struct Stamp {
+        long long size = -1;
+        long long mtime = -1;
+        bool operator==(const Stamp& other) const {
+            return size == other.size && mtime == other.mtime;
+        }
+    };
+    Stamp stamp() const;
+    void rebuild();
+    void run();
+
+    std::string d_fname;
+    ContextPtr d_current;  // accessed with std::atomic_load/atomic_store
+
+    std::mutex d_valuesMutex;  // orders setVariable with publication
+    std::map<std::string, double> d_values;
+
+    mutable std::mutex d_mutex;
+    std::condition_variable d_wakeup, d_done;
+    bool d_stop = false;
+    bool d_requested = false;
+    bool d_busy = false;
+    bool d_rescheduled = false;  // watch() changed the interval
+    std::chrono::milliseconds d_interval{0};
+    Stamp d_stamp;
+    Statistics d_statistics;
+    std::thread d_thread;
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "tracer.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+namespace {
+
+struct Event {
+    const char *category;
+    const char *name;
+    const char *detail;
+    uint64_t start;
+    uint64_t end;
+};
+
+// Filled by its thread only; readers see the first `used` events.
+struct Chunk {
+    static const size_t Capacity = 1024;
+    Event events[Capacity];
+    std::atomic<size_t> used;
+    std::atomic<Chunk *> next;
+    Chunk() : used(0), next(nullptr) {}
+};
+
+struct Buffer {
+    uint64_t tid = 0;
+    std::string name;  // under g_mutex
+    Chunk head;
+    Chunk *tail = &head;
+
+    ~Buffer() {
+        for (auto chunk = head.next.load(); chunk;) {
+            auto next = chunk->next.load();
+            delete chunk;
+            chunk = next;
+        }
+    }
+
+    void append(const Event &event) {
+        auto chunk = tail;
+        auto used = chunk->used.load(std::memory_order_relaxed);
+        if (used == Chunk::Capacity) {
+            auto fresh = new Chunk;
+            chunk->next.store(fresh, std::memory_order_release);
+            tail = chunk = fresh;
+            used = 0;
+        }
+        chunk->events[used] = event;
+        chunk->used.store(used + 1, std::memory_order_release);
+    }
+};
+
+std::atomic<bool> g_recording(false);
+// Bumped by Clear so that threads drop their stale buffer.
+std::atomic<uint64_t> g_generation(1);
+std::mutex g_mutex;
+std::vector<std::unique_ptr<Buffer>> g_buffers;
+uint64_t g_tids = 0;
+std::set<std::string> g_strings;
+
+thread_local Buffer *t_buffer = nullptr;
+thread_local uint64_t t_generation = 0;
+thread_local std::string t_name;
+
+const auto g_origin = std::chrono::steady_clock::now();
+
+uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - g_origin)
+        .count();
+}
+
+Buffer &ThreadBuffer() {
+    auto generation = g_generation.load(std::memory_order_acquire);
+    if (t_buffer && t_generation == generation) return *t_buffer;
+    std::unique_ptr<Buffer> buffer(new Buffer);
+    std::lock_guard<std::mutex> lock(g_mutex);
+    buffer->tid = ++g_tids;
+    buffer->name = t_name;
+    t_buffer = buffer.get();
+    t_generation = generation;
+    g_buffers.push_back(std::move(buffer));
+    return *t_buffer;
+}
+
+void WriteString(std::ostream &out, const char *value) {
+    out << '"';
+    for (; *value; ++value) {
+        auto c = static_cast<unsigned char>(*value);
+        if (c == '"' || c == '\\') {
+            out << '\\' << *value;
+        } else if (c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else {
+            out << *value;
+        }
+    }
+    out << '"';
+}
+
+}  // namespace
+
+void Tracer::Start() { g_recording = true; }
+
+void Tracer::Stop() { g_recording = false; }
+
+bool Tracer::IsRecording() { return g_recording.load(std::memory_order_relaxed); }
+
+void Tracer::Clear() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_buffers.clear();
+    g_tids = 0;
+    ++g_generation;
+}
+
+void Tracer::NameThread(const std::string &name) {
+    // Buffers are created by the first span, so that naming costs nothing.
+    t_name = name;
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (t_buffer && t_generation == g_generation) t_buffer->name = name;
+}
+
+const char *Tracer::Intern(const std::string &name) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    return g_strings.insert(name).first->c_str();
+}
+
+const char *Tracer::Detail(const std::string &detail) {
+    return IsRecording() ? Intern(detail) : nullptr;
+}
+
+void Tracer::Write(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    out << "{\"traceEvents\": [";
+    const char *separator = "\n";
+    char times[96];
+    for (const auto &buffer : g_buffers) {
+        if (!buffer->name.empty()) {
+            out << separator << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, "
+                << "\"tid\": " << buffer->tid << ", \"args\": {\"name\": ";
+            WriteString(out, buffer->name.c_str());
+            out << "}}";
+            separator = ",\n";
+        }
+        for (auto chunk = &buffer->head; chunk;
+             chunk = chunk->next.load(std::memory_order_acquire)) {
+            auto used = chunk->used.load(std::memory_order_acquire);
+            for (size_t i = 0; i < used; ++i) {
+                const auto &event = chunk->events[i];
+                out << separator << "{\"ph\": \"X\", \"cat\": ";
+                WriteString(out, event.category);
+                out << ", \"name\": ";
+                WriteString(out, event.name);
+                // Microseconds, the unit of the format.
+                std::snprintf(times, sizeof(times), "%.3f, \"dur\": %.3f",
+                              event.start / 1e3, (event.end - event.start) / 1e3);
+                out << ", \"ts\": " << times << ", \"pid\": 1, \"tid\": " << buffer->tid;
+                if (event.detail) {
+                    out << ", \"args\": {\"detail\": ";
+                    WriteString(out, event.detail);
+                    out << "}";
+                }
+                out << "}";
+                separator = ",\n";
+            }
+        }
+    }
+    out << "\n], \"displayTimeUnit\": \"ns\"}\n";
+}
+
+Tracer::Span::Span(const char *category, const char *name, const char *detail)
+    : d_category(category),
+      d_name(name),
+      d_detail(detail),
+      d_start(IsRecording() ? Now() : 0) {}
+
+void Tracer::Span::end() {
+    if (!d_start) return;
+    ThreadBuffer().append(Event{d_category, d_name, d_detail, d_start, Now()});
+    d_start = 0;
+}
@@ -0,0 +1,78 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "evaluation.h"
+
+//! Timestamped spans of the whole process, written in Chrome trace format.
+/*!
+  The output opens in Perfetto (ui.perfetto.dev) and chrome://tracing, one
+  track per thread. Each thread appends to a buffer of its own: recording a
+  span takes no lock and never waits for another thread, so tracing does not
+  serialize the multi-threaded phases it measures. Buffers outlive their
+  threads until Clear. Nothing is recorded, and a span costs one atomic load,
+  while the tracer is stopped.
+*/
+class Tracer {
+   public:
+    static void Start();
+    static void Stop();
+    static bool IsRecording();
+    //! Drops what was recorded; no thread may be inside a span meanwhile.
+    static void Clear();
+    //! {"traceEvents": [...]} with the spans recorded so far.
+    static void Write(std::ostream& out);
+    //! Names the track of the calling thread.
+    static void NameThread(const std::string& name);
+    //! A copy of `name` that lives as long as the process, for span names.
+    static const char* Intern(const std::string& name);
+    //! Intern(detail) while recording, null otherwise: keeps the lock of
+    //! Intern off untraced runs.
+    static const char* Detail(const std::string& detail);
+
+    //! Records the lifetime of the object as a span of the calling thread.
+    /*!
+      `category` and `name` (and `detail`, an argument shown with the span)
+      must outlive the trace: literals or interned strings.
+    */
+    class Span {
+        const char* d_category;
+        const char* d_name;
+        const char* d_detail;
+        uint64_t d_start;
+
+       public:
+        Span(const char* category, const char* name, const char* detail = nullptr);
+        ~Span() { end(); }
+        //! Ends the span before the end of the scope.
+        void end();
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+    };
+};
+
+//! Evaluates an expression under a Tracer::Span.
+class TracedNode : public EvalNode {
+    const char* d_name;
+    EvalNode::Ptr d_expression;
+
+   public:
+    TracedNode(const char* name, const EvalNode::Ptr& expression)
+        : d_name(name), d_expression(expression) {}
+    virtual double eval() {
+        Tracer::Span span("eval", d_name);
+        return d_expression->eval();
+    }
+    virtual Kind kind() const { return d_expression->kind(); }
+};
+
+#define EVALUATION_TRACE_JOIN2(a, b) a##b
+#define EVALUATION_TRACE_JOIN(a, b) EVALUATION_TRACE_JOIN2(a, b)
+//! Traces the rest of the enclosing scope.
+#define EVALUATION_TRACE(...) \
+    Tracer::Span EVALUATION_TRACE_JOIN(trace_span_, __LINE__)(__VA_ARGS__)
+
+#endif
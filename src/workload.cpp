@@ -0,0 +1,148 @@
+#include "workload.h"
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include "evaluation.h"
+
+const uint32_t WorkloadRecorder::Version = 1;
+
+namespace {
+
+const char Magic[4] = {'E', 'V', 'W', 'L'};
+
+// Record tags; a name record gives the next id to its name.
+enum Tag : unsigned char { NameTag, SetTag, CalcTag };
+
+void WriteVarint(std::ostream &out, uint64_t value) {
+    char bytes[10];
+    size_t size = 0;
+    do {
+        bytes[size++] = static_cast<char>((value & 0x7f) | (value > 0x7f ? 0x80 : 0));
+        value >>= 7;
+    } while (value);
+    out.write(bytes, size);
+}
+
+uint64_t ReadVarint(std::istream &in) {
+    uint64_t value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        auto byte = in.get();
+        if (byte == std::char_traits<char>::eof())
+            throw std::runtime_error("Truncated workload");
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Invalid workload");
+}
+
+void WriteDouble(std::ostream &out, double value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+double ReadDouble(std::istream &in) {
+    double value;
+    if (!in.read(reinterpret_cast<char *>(&value), sizeof(value)))
+        throw std::runtime_error("Truncated workload");
+    return value;
+}
+
+bool Same(double a, double b) { return a == b || (a != a && b != b); }
+
+}  // namespace
+
+WorkloadRecorder::WorkloadRecorder(std::ostream &out) : d_out(out) {
+    d_out.write(Magic, sizeof(Magic));
+    d_out.write(reinterpret_cast<const char *>(&Version), sizeof(Version));
+}
+
+uint64_t WorkloadRecorder::id(const std::string &name) {
+    auto known = d_ids.find(name);
+    if (known != d_ids.end()) return known->second;
+    d_out.put(NameTag);
+    WriteVarint(d_out, name.size());
+    d_out.write(name.data(), name.size());
+    auto id = d_ids.size();
+    d_ids[name] = id;
+    return id;
+}
+
+void WorkloadRecorder::setVariable(const std::string &name, double value) {
+    auto name_id = id(name);
+    d_out.put(SetTag);
+    WriteVarint(d_out, name_id);
+    WriteDouble(d_out, value);
+    ++d_operations;
+}
+
+void WorkloadRecorder::calc(const std::string &name, double result) {
+    auto name_id = id(name);
+    d_out.put(CalcTag);
+    WriteVarint(d_out, name_id);
+    WriteDouble(d_out, result);
+    ++d_operations;
+}
+
+WorkloadBackend::~WorkloadBackend() {}
+
+void ContextBackend::setVariable(const std::string &name, double value) {
+    d_context.setVariable(name, value);
+}
+
+double ContextBackend::calc(const std::string &name) { return d_context.calc(name); }
+
+Workload Workload::Read(std::istream &in) {
+    char magic[sizeof(Magic)];
+    uint32_t version = 0;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, Magic, sizeof(Magic)) != 0 ||
+        !in.read(reinterpret_cast<char *>(&version), sizeof(version)))
+        throw std::runtime_error("Not a workload");
+    if (version != WorkloadRecorder::Version)
+        throw std::runtime_error("Unsupported workload version");
+
+    Workload workload;
+    for (auto tag = in.get(); tag != std::char_traits<char>::eof(); tag = in.get()) {
+        if (tag == NameTag) {
+            auto size = ReadVarint(in);
+            std::string name(size, '\0');
+            if (size && !in.read(&name[0], size))
+                throw std::runtime_error("Truncated workload");
+            workload.d_names.push_back(name);
+            continue;
+        }
+        if (tag != SetTag && tag != CalcTag) throw std::runtime_error("Invalid workload");
+        Operation operation;
+        operation.type = tag == SetTag ? SetVariable : Calc;
+        auto name = ReadVarint(in);
+        if (name >= workload.d_names.size()) throw std::runtime_error("Invalid workload");
+        operation.name = static_cast<uint32_t>(name);
+        operation.value = ReadDouble(in);
+        workload.d_operations.push_back(operation);
+    }
+    return workload;
+}
+
+Workload::Result Workload::replay(WorkloadBackend &backend, size_t repeat) const {
+    typedef std::chrono::steady_clock Clock;
+    Result result;
+    auto start = Clock::now();
+    for (size_t round = 0; round < repeat; ++round) {
+        for (const auto &operation : d_operations) {
+            const auto &name = d_names[operation.name];
+            if (operation.type == SetVariable) {
+                backend.setVariable(name, operation.value);
+                continue;
+            }
+            auto call = Clock::now();
+            auto value = backend.calc(name);
+            result.calcLatency.record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - call)
+                    .count());
+            if (!Same(value, operation.value)) ++result.mismatches;
+            ++result.calcs;
+        }
+        result.operations += d_operations.size();
+    }
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return result;
+}
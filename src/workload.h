@@ -0,0 +1,91 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "latency_stats.h"
+
+//! Logs the setVariable and calc calls made on an EvaluationContext.
+/*!
+  Attach with EvaluationContext::setRecorder. The trace is compact: a name
+  is written once and referred to by a varint id afterwards, so a call
+  takes a few bytes plus the value (or, for calc, the result, which replay
+  checks). Not thread safe, like the context.
+*/
+class WorkloadRecorder {
+   public:
+    static const uint32_t Version;
+
+    //! Writes to `out`, which must outlive the recorder.
+    explicit WorkloadRecorder(std::ostream& out);
+    void setVariable(const std::string& name, double value);
+    void calc(const std::string& name, double result);
+    uint64_t operations() const { return d_operations; }
+
+   private:
+    uint64_t id(const std::string& name);
+
+    std::ostream& d_out;
+    std::unordered_map<std::string, uint64_t> d_ids;
+    uint64_t d_operations = 0;
+};
+
+//! What a Workload is replayed against.
+class WorkloadBackend {
+   public:
+    virtual void setVariable(const std::string& name, double value) = 0;
+    virtual double calc(const std::string& name) = 0;
+    virtual ~WorkloadBackend();
+};
+
+class EvaluationContext;
+
+//! Replays on an EvaluationContext, through its public calls.
+class ContextBackend : public WorkloadBackend {
+    EvaluationContext& d_context;
+
+   public:
+    explicit ContextBackend(EvaluationContext& context) : d_context(context) {}
+    virtual void setVariable(const std::string& name, double value);
+    virtual double calc(const std::string& name);
+};
+
+//! A recorded trace, read in full so that replay does no I/O.
+class Workload {
+   public:
+    enum Type { SetVariable, Calc };
+    struct Operation {
+        Type type;
+        uint32_t name;  // index in names()
+        double value;   // set value or recorded result
+    };
+
+    struct Result {
+        uint64_t operations = 0;
+        uint64_t calcs = 0;
+        double seconds = 0;
+        //! calc calls whose result differs from the recorded one.
+        uint64_t mismatches = 0;
+        //! Latency of each calc call.
+        LatencyHistogram calcLatency;
+    };
+
+    static Workload Read(std::istream& in);
+
+    const std::vector<std::string>& names() const { return d_names; }
+    const std::vector<Operation>& operations() const { return d_operations; }
+
+    //! Runs the operations `repeat` times, as fast as the backend goes.
+    Result replay(WorkloadBackend& backend, size_t repeat = 1) const;
+
+   private:
+    std::vector<std::string> d_names;
+    std::vector<Operation> d_operations;
+};
+
+#endif
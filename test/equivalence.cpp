@@ -0,0 +1,545 @@
+// Differential test: random models run through every evaluation backend
+// must give the results of the reference tree interpreter
+// (EvaluationParser::CreateFromFile, then calc).
+//
+// EVALUATION_EQUIVALENCE_SEED and EVALUATION_EQUIVALENCE_MODELS pick the
+// models. A mismatch is shrunk to a small model and one input row, printed
+// with the seed so that it can be replayed.
+
+#define BOOST_TEST_MODULE EquivalenceTests
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/batch_evaluator.h"
+#include "../src/compiled_model.h"
+#include "../src/evaluation.h"
+#include "../src/incremental_model.h"
+#include "../src/model_cache.h"
+#include "../src/parser.h"
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+// A definition body, kept apart from EvalNode so that it can be shrunk.
+struct Tree {
+    enum Kind { Constant, Name, Unary, Binary };
+    Kind kind;
+    double value;
+    std::string text;  // name or operator
+    std::vector<Tree> children;
+
+    size_t size() const {
+        size_t result = 1;
+        for (const auto& child : children) result += child.size();
+        return result;
+    }
+};
+
+struct Definition {
+    std::string name;
+    Tree body;
+};
+
+typedef std::map<std::string, double> Row;
+
+struct Model {
+    std::vector<Definition> definitions;
+
+    std::string xml() const {
+        std::ostringstream out;
+        out << "<root>";
+        for (const auto& definition : definitions) {
+            out << "<variable value=\"" << definition.name << "\">";
+            Write(out, definition.body);
+            out << "</variable>";
+        }
+        out << "</root>\n";
+        return out.str();
+    }
+
+    // Latest definition before `position`, or -1: the name is a variable.
+    int resolve(const std::string& name, size_t position) const {
+        for (size_t i = position; i-- > 0;)
+            if (definitions[i].name == name) return static_cast<int>(i);
+        return -1;
+    }
+
+    std::vector<std::string> outputs() const {
+        std::set<std::string> names;
+        for (const auto& definition : definitions) names.insert(definition.name);
+        return std::vector<std::string>(names.begin(), names.end());
+    }
+
+    std::vector<std::string> variables() const {
+        std::set<std::string> names;
+        for (size_t i = 0; i < definitions.size(); ++i) {
+            std::vector<const Tree*> nodes{&definitions[i].body};
+            while (!nodes.empty()) {
+                auto node = nodes.back();
+                nodes.pop_back();
+                if (node->kind == Tree::Name && resolve(node->text, i) < 0)
+                    names.insert(node->text);
+                for (const auto& child : node->children) nodes.push_back(&child);
+            }
+        }
+        return std::vector<std::string>(names.begin(), names.end());
+    }
+
+    size_t size() const {
+        size_t result = 0;
+        for (const auto& definition : definitions) result += definition.body.size();
+        return result;
+    }
+
+   private:
+    static void Write(std::ostream& out, const Tree& tree) {
+        char value[40];
+        switch (tree.kind) {
+            case Tree::Constant:
+                std::snprintf(value, sizeof(value), "%.17g", tree.value);
+                out << "<constant value=\"" << value << "\"/>";
+                break;
+            case Tree::Name:
+                out << "<variable value=\"" << tree.text << "\"/>";
+                break;
+            case Tree::Unary:
+            case Tree::Binary:
+                out << (tree.kind == Tree::Unary ? "<un_op" : "<bin_op") << " type=\""
+                    << tree.text << "\">";
+                for (const auto& child : tree.children) Write(out, child);
+                out << (tree.kind == Tree::Unary ? "</un_op>" : "</bin_op>");
+                break;
+        }
+    }
+};
+
+// Value of a definition with what it takes to compare it: the rounding
+// budget in units of the backend's epsilon, and the largest intermediate
+// magnitude, the scale of any cancellation.
+struct Expected {
+    double value = 0;
+    double budget = 0;
+    double magnitude = 0;
+};
+
+// Rounding error allowed per operation, in units of epsilon: correctly
+// rounded operations, then libm functions.
+double Ulps(const std::string& op) {
+    if (op == "exp" || op == "log" || op == "sin" || op == "cos") return 2;
+    if (op == "^") return 4;
+    return 1;
+}
+
+Expected Evaluate(const Model& model, const Tree& tree, size_t position, const Row& row) {
+    Expected result;
+    switch (tree.kind) {
+        case Tree::Constant:
+            result.value = tree.value;
+            break;
+        case Tree::Name: {
+            auto target = model.resolve(tree.text, position);
+            if (target < 0) {
+                result.value = row.at(tree.text);
+            } else {
+                result = Evaluate(model, model.definitions[target].body, target, row);
+            }
+            break;
+        }
+        case Tree::Unary: {
+            auto operand = Evaluate(model, tree.children[0], position, row);
+            result.value = EvaluationParser::GetUnaryFunction(tree.text)(operand.value);
+            result.budget = operand.budget + Ulps(tree.text);
+            result.magnitude = operand.magnitude;
+            break;
+        }
+        case Tree::Binary: {
+            auto left = Evaluate(model, tree.children[0], position, row);
+            auto right = Evaluate(model, tree.children[1], position, row);
+            result.value = EvaluationParser::GetBinaryFunction(tree.text)(left.value, right.value);
+            result.budget = left.budget + right.budget + Ulps(tree.text);
+            result.magnitude = std::max(left.magnitude, right.magnitude);
+            break;
+        }
+    }
+    if (std::isfinite(result.value))
+        result.magnitude = std::max(result.magnitude, std::fabs(result.value));
+    return result;
+}
+
+bool Matches(double expected, double actual, const Expected& bound, double epsilon) {
+    if (std::isnan(expected) || std::isnan(actual)) return std::isnan(expected) && std::isnan(actual);
+    if (std::isinf(expected) || std::isinf(actual)) return expected == actual;
+    auto scale = std::max(std::max(std::fabs(expected), std::fabs(actual)), bound.magnitude);
+    return std::fabs(expected - actual) <=
+           bound.budget * epsilon * scale + std::numeric_limits<double>::denorm_min();
+}
+
+//! Results of every output on every row, row major.
+typedef std::vector<double> Results;
+
+struct Backend {
+    std::string name;
+    //! Unit roundoff of the backend's arithmetic.
+    double epsilon;
+    std::function<Results(const std::string& fname, const Model& model,
+                          const std::vector<Row>& rows)>
+        run;
+};
+
+Results Run(EvaluationContext& context, const Model& model, const std::vector<Row>& rows) {
+    Results results;
+    auto outputs = model.outputs();
+    for (const auto& row : rows) {
+        for (const auto& variable : row) context.setVariable(variable.first, variable.second);
+        for (const auto& output : outputs) results.push_back(context.calc(output));
+    }
+    return results;
+}
+
+// Through a BatchEvaluator over columns; `tileRows` 0 keeps its own tile.
+Results RunBatch(const std::string& fname, const Model& model, const std::vector<Row>& rows,
+                 size_t tileRows) {
+    auto context = EvaluationParser::CreateFromFile(fname);
+    auto outputs = model.outputs();
+    BatchEvaluator batch(context, outputs);
+    if (tileRows) batch.setTileRows(tileRows);
+    std::map<std::string, std::vector<double>> inputs;
+    for (const auto& row : rows)
+        for (const auto& variable : row) inputs[variable.first].push_back(variable.second);
+    for (const auto& name : batch.variables()) batch.bind(name, inputs.at(name).data());
+    std::vector<std::vector<double>> columns(outputs.size(), std::vector<double>(rows.size()));
+    for (size_t o = 0; o < outputs.size(); ++o) batch.bindResult(outputs[o], columns[o].data());
+    batch.run(rows.size());
+    Results results;
+    for (size_t r = 0; r < rows.size(); ++r)
+        for (const auto& column : columns) results.push_back(column[r]);
+    return results;
+}
+
+// Everything there is to compare against the reference. New evaluation
+// paths register here.
+std::vector<Backend> Backends() {
+    const double epsilon = DBL_EPSILON / 2;
+    std::vector<Backend> backends;
+    backends.push_back({"lazy", epsilon, [](const std::string& fname, const Model& model,
+                                            const std::vector<Row>& rows) {
+                            auto context =
+                                EvaluationParser::CreateLazyFromFile(fname, model.outputs());
+                            return Run(context, model, rows);
+                        }});
+    backends.push_back({"compiled", epsilon, [](const std::string& fname, const Model& model,
+                                                const std::vector<Row>& rows) {
+                            std::stringstream binary;
+                            CompiledModel::Write(EvaluationParser::CreateFromFile(fname), binary);
+                            auto context = CompiledModel::Read(binary);
+                            return Run(context, model, rows);
+                        }});
+    backends.push_back({"cache", epsilon, [](const std::string& fname, const Model& model,
+                                             const std::vector<Row>& rows) {
+                            auto directory = fs::path(fname).parent_path() / "cache";
+                            ModelCache cache(directory.string(), 1 << 20);
+                            EvaluationParser::CreateFromFile(fname, cache);
+                            auto context = EvaluationParser::CreateFromFile(fname, cache);
+                            fs::remove_all(directory);
+                            return Run(context, model, rows);
+                        }});
+    backends.push_back({"incremental", epsilon, [](const std::string& fname, const Model& model,
+                                                   const std::vector<Row>& rows) {
+                            IncrementalModel incremental(fname);
+                            return Run(incremental.context(), model, rows);
+                        }});
+    backends.push_back({"instrumented", epsilon, [](const std::string& fname, const Model& model,
+                                                    const std::vector<Row>& rows) {
+                            auto context = EvaluationParser::CreateFromFile(fname);
+                            context.enableProfiling();
+                            context.enableTracing();
+                            return Run(context, model, rows);
+                        }});
+    backends.push_back({"batch", epsilon, [](const std::string& fname, const Model& model,
+                                             const std::vector<Row>& rows) {
+                            return RunBatch(fname, model, rows, 0);
+                        }});
+    // Tiles of three rows: every block ends in a partial tile, and
+    // registers are reused many times over.
+    backends.push_back({"tiled", epsilon, [](const std::string& fname, const Model& model,
+                                             const std::vector<Row>& rows) {
+                            return RunBatch(fname, model, rows, 3);
+                        }});
+    return backends;
+}
+
+class Generator {
+    std::mt19937_64 d_random;
+
+    double uniform(double low, double high) {
+        return std::uniform_real_distribution<double>(low, high)(d_random);
+    }
+    size_t pick(size_t count) {
+        return std::uniform_int_distribution<size_t>(0, count - 1)(d_random);
+    }
+
+   public:
+    explicit Generator(uint64_t seed) : d_random(seed) {}
+
+    Tree tree(size_t depth) {
+        static const char* unary[] = {"-", "!", "cos", "sin", "exp", "log"};
+        static const char* binary[] = {"+", "-", "*", "/", "max", "min", "^"};
+        static const char* names[] = {"A", "B", "C", "D", "x", "y", "z"};
+        Tree result;
+        auto choice = uniform(0, 1);
+        if (depth == 0 || choice < 0.3) {
+            if (uniform(0, 1) < 0.4) {
+                result.kind = Tree::Constant;
+                // Small integers reach the special cases of pow and friends.
+                result.value = uniform(0, 1) < 0.5 ? static_cast<double>(pick(7)) - 3
+                                                   : uniform(-5, 5);
+            } else {
+                result.kind = Tree::Name;
+                result.text = names[pick(7)];
+            }
+        } else if (choice < 0.5) {
+            result.kind = Tree::Unary;
+            result.text = unary[pick(6)];
+            result.children.push_back(tree(depth - 1));
+        } else {
+            result.kind = Tree::Binary;
+            result.text = binary[pick(7)];
+            result.children.push_back(tree(depth - 1));
+            result.children.push_back(tree(depth - 1));
+        }
+        return result;
+    }
+
+    // Names are reused: references resolve to the latest definition before
+    // them, and redefinitions come up.
+    Model model() {
+        static const char* names[] = {"A", "B", "C", "D"};
+        Model result;
+        auto count = 1 + pick(6);
+        for (size_t i = 0; i < count; ++i)
+            result.definitions.push_back({names[pick(4)], tree(1 + pick(5))});
+        return result;
+    }
+
+    std::vector<Row> rows(const Model& model, size_t count) {
+        std::vector<Row> result(count);
+        for (auto& row : result) {
+            for (const auto& variable : model.variables()) {
+                auto choice = uniform(0, 1);
+                row[variable] = choice < 0.1 ? 0.0 : choice < 0.2 ? 1.0 : uniform(-3, 3);
+            }
+        }
+        return result;
+    }
+};
+
+struct Scratch {
+    fs::path path;
+    Scratch() : path(fs::temp_directory_path() / fs::unique_path("eval-equiv-%%%%-%%%%")) {
+        fs::create_directories(path);
+    }
+    ~Scratch() { fs::remove_all(path); }
+    std::string write(const Model& model) const {
+        auto fname = (path / "model.xml").string();
+        std::ofstream(fname.c_str()) << model.xml();
+        return fname;
+    }
+};
+
+// The variables of `model`, from `values` where they are there.
+Row Inputs(const Model& model, const Row& values) {
+    Row row;
+    for (const auto& variable : model.variables()) {
+        auto value = values.find(variable);
+        row[variable] = value != values.end() ? value->second : 0.5;
+    }
+    return row;
+}
+
+// First output differing from the reference, or -1.
+int Mismatch(const Scratch& scratch, const Backend& backend, const Model& model,
+             std::vector<Row> rows, Results* expected, Results* actual) {
+    for (auto& row : rows) row = Inputs(model, row);
+    auto fname = scratch.write(model);
+    auto context = EvaluationParser::CreateFromFile(fname);
+    *expected = Run(context, model, rows);
+    try {
+        *actual = backend.run(fname, model, rows);
+    } catch (const std::exception& error) {
+        BOOST_TEST_MESSAGE(backend.name << " threw: " << error.what());
+        actual->clear();
+        return 0;
+    }
+    auto outputs = model.outputs();
+    for (size_t r = 0, i = 0; r < rows.size(); ++r) {
+        for (size_t o = 0; o < outputs.size(); ++o, ++i) {
+            auto position = model.resolve(outputs[o], model.definitions.size());
+            auto bound = Evaluate(model, model.definitions[position].body, position, rows[r]);
+            if (i >= actual->size() || !Matches((*expected)[i], (*actual)[i], bound, backend.epsilon))
+                return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+// Smaller models, one edit away: a definition dropped, a node replaced by
+// a child or by its value on `row`.
+std::vector<Model> Shrinks(const Model& model, const Row& row) {
+    std::vector<Model> result;
+    for (size_t d = 0; model.definitions.size() > 1 && d < model.definitions.size(); ++d) {
+        result.push_back(model);
+        result.back().definitions.erase(result.back().definitions.begin() + d);
+    }
+    for (size_t d = 0; d < model.definitions.size(); ++d) {
+        size_t count = model.definitions[d].body.size();
+        for (size_t n = 0; n < count; ++n) {
+            auto nodes = [](Model& copy, size_t definition) {
+                std::vector<Tree*> found, stack{&copy.definitions[definition].body};
+                while (!stack.empty()) {
+                    auto node = stack.back();
+                    stack.pop_back();
+                    found.push_back(node);
+                    for (auto& child : node->children) stack.push_back(&child);
+                }
+                return found;
+            };
+            Model probe = model;
+            auto node = nodes(probe, d)[n];
+            if (node->kind == Tree::Constant) continue;
+            for (size_t c = 0; c < node->children.size(); ++c) {
+                result.push_back(model);
+                auto target = nodes(result.back(), d)[n];
+                Tree child = target->children[c];
+                *target = child;
+            }
+            auto value = Evaluate(model, *node, d, Inputs(model, row)).value;
+            if (std::isfinite(value)) {
+                result.push_back(model);
+                auto target = nodes(result.back(), d)[n];
+                target->kind = Tree::Constant;
+                target->value = value;
+                target->text.clear();
+                target->children.clear();
+            }
+        }
+    }
+    return result;
+}
+
+// The smallest model found that still fails on `row`.
+Model Minimize(const Scratch& scratch, const Backend& backend, Model model, const Row& row) {
+    Results expected, actual;
+    for (bool shrunk = true; shrunk;) {
+        shrunk = false;
+        for (const auto& candidate : Shrinks(model, row)) {
+            if (candidate.size() >= model.size() &&
+                candidate.definitions.size() >= model.definitions.size())
+                continue;
+            if (Mismatch(scratch, backend, candidate, {row}, &expected, &actual) < 0) continue;
+            model = candidate;
+            shrunk = true;
+            break;
+        }
+    }
+    return model;
+}
+
+size_t EnvironmentValue(const char* name, size_t fallback) {
+    auto value = std::getenv(name);
+    return value ? std::strtoull(value, nullptr, 10) : fallback;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(Backends_MatchTheTreeInterpreter)
+{
+    auto seed = EnvironmentValue("EVALUATION_EQUIVALENCE_SEED", 20161001);
+    auto models = EnvironmentValue("EVALUATION_EQUIVALENCE_MODELS", 200);
+    auto backends = Backends();
+    Scratch scratch;
+    size_t failures = 0;
+    for (size_t m = 0; m < models && failures < 5; ++m) {
+        Generator generator(seed + m);
+        auto model = generator.model();
+        auto rows = generator.rows(model, 4);
+        for (const auto& backend : backends) {
+            Results expected, actual;
+            auto index = Mismatch(scratch, backend, model, rows, &expected, &actual);
+            if (index < 0) continue;
+            ++failures;
+
+            // Down to the failing row, then to the smallest model still failing.
+            auto outputs = model.outputs();
+            auto smallest = Minimize(scratch, backend, model, rows[index / outputs.size()]);
+            std::vector<Row> row{Inputs(smallest, rows[index / outputs.size()])};
+            Mismatch(scratch, backend, smallest, row, &expected, &actual);
+            std::ostringstream repro;
+            repro.precision(17);
+            repro << "backend " << backend.name << " differs (EVALUATION_EQUIVALENCE_SEED="
+                  << seed + m << " EVALUATION_EQUIVALENCE_MODELS=1)\n"
+                  << smallest.xml() << "inputs:";
+            for (const auto& variable : row[0]) repro << " " << variable.first << "=" << variable.second;
+            outputs = smallest.outputs();
+            for (size_t o = 0; o < outputs.size(); ++o) {
+                repro << "\n  " << outputs[o] << ": reference " << expected[o] << ", "
+                      << backend.name << " ";
+                if (o < actual.size()) repro << actual[o]; else repro << "(threw)";
+            }
+            BOOST_ERROR(repro.str());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Shrinking_KeepsAFailureSmall)
+{
+    // A backend that gets min wrong: the repro must come down to the min.
+    Backend broken{"broken-min", DBL_EPSILON / 2,
+                   [](const std::string& fname, const Model& model, const std::vector<Row>& rows) {
+                       auto text = model.xml();
+                       for (auto at = text.find("\"min\""); at != std::string::npos;
+                            at = text.find("\"min\"", at))
+                           text.replace(at, 5, "\"max\"");
+                       std::ofstream(fname.c_str()) << text;
+                       auto context = EvaluationParser::CreateFromFile(fname);
+                       return Run(context, model, rows);
+                   }};
+    Generator generator(7);
+    Model model;
+    model.definitions.push_back({"A", generator.tree(4)});
+    Tree min;
+    min.kind = Tree::Binary;
+    min.text = "min";
+    min.children.resize(2);
+    min.children[0].kind = min.children[1].kind = Tree::Name;
+    min.children[0].text = "x";
+    min.children[1].text = "y";
+    Tree sum;
+    sum.kind = Tree::Binary;
+    sum.text = "+";
+    sum.children.push_back(generator.tree(3));
+    sum.children.push_back(min);
+    model.definitions.push_back({"B", sum});
+    Row row{{"x", 1}, {"y", 2}};
+
+    Scratch scratch;
+    Results expected, actual;
+    BOOST_REQUIRE(Mismatch(scratch, broken, model, {row}, &expected, &actual) >= 0);
+    auto smallest = Minimize(scratch, broken, model, row);
+    BOOST_CHECK_EQUAL(smallest.definitions.size(), 1u);
+    BOOST_CHECK_EQUAL(smallest.size(), 3u);
+    BOOST_CHECK_EQUAL(smallest.definitions[0].body.text, "min");
+}
@@ -1,8 +1,1266 @@
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
 
+#include "../src/aggregate.h"
+#include "../src/batch_evaluator.h"
+#include "../src/chunked_pipeline.h"
+#include "../src/column_file.h"
 #include "../src/evaluation.h"
+#include "../src/graph_export.h"
+#include "../src/grid_sweep.h"
+#include "../src/incremental_model.h"
+#include "../src/latency_stats.h"
+#include "../src/model_analyzer.h"
+#include "../src/model_cache.h"
+#include "../src/model_library.h"
+#include "../src/monte_carlo.h"
+#include "../src/number_text.h"
+#include "../src/parser.h"
+#include "../src/perf_counters.h"
+#include "../src/profiler.h"
+#include "../src/reloadable_model.h"
+#include "../src/tracer.h"
+#include "../src/workload.h"
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+// Temporary directory removed at the end of a test.
+struct ScratchDirectory {
+    fs::path path;
+    ScratchDirectory()
+        : path(fs::temp_directory_path() / fs::unique_path("eval-%%%%-%%%%")) {
+        fs::create_directories(path);
+    }
+    ~ScratchDirectory() { fs::remove_all(path); }
+    std::string write(const std::string& name, const std::string& contents) {
+        auto fname = (path / name).string();
+        std::ofstream(fname.c_str()) << contents;
+        return fname;
+    }
+};
+
+// X = 3, Y = X + z * X
+const char* SharedModel =
+    "<root>"
+    "<variable value=\"X\"><constant value=\"3\"/></variable>"
+    "<variable value=\"Y\"><bin_op type=\"+\"><variable value=\"X\"/>"
+    "<bin_op type=\"*\"><variable value=\"z\"/><variable value=\"X\"/>"
+    "</bin_op></bin_op></variable>"
+    "</root>";
+
+// Counts pugixml memory for MemoryUsage::loadPeak, before any document exists.
+struct InstallDocumentMemory {
+    InstallDocumentMemory() { DocumentMemory::Install(); }
+};
+
+}  // namespace
+
+BOOST_GLOBAL_FIXTURE(InstallDocumentMemory);
 
 BOOST_AUTO_TEST_CASE(TODO_Test)
 {
 }
 
+BOOST_AUTO_TEST_CASE(ModelCache_HitAfterMiss)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write("model.xml", SharedModel);
+    ModelCache cache(scratch.path.string(), 1 << 20);
+
+    auto first = EvaluationParser::CreateFromFile(fname, cache);
+    auto second = EvaluationParser::CreateFromFile(fname, cache);
+    auto statistics = cache.statistics();
+    BOOST_CHECK_EQUAL(statistics.misses, 1u);
+    BOOST_CHECK_EQUAL(statistics.hits, 1u);
+    BOOST_CHECK_EQUAL(statistics.writes, 1u);
+
+    first.setVariable("z", 2);
+    second.setVariable("z", 2);
+    BOOST_CHECK_EQUAL(first.calc("Y"), 9);
+    BOOST_CHECK_EQUAL(second.calc("Y"), 9);
+    // Shared subexpressions stay shared after a round trip.
+    BOOST_CHECK_EQUAL(second.expressions().size(), 2u);
+    BOOST_CHECK_EQUAL(second.variables().size(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(ModelCache_CorruptEntryIsAMiss)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write("model.xml", SharedModel);
+    ModelCache cache(scratch.path.string(), 1 << 20);
+    EvaluationParser::CreateFromFile(fname, cache);
+    for (fs::directory_iterator it(scratch.path), end; it != end; ++it)
+        if (it->path().extension() == ".evcm")
+            std::ofstream(it->path().string().c_str()) << "garbage";
+
+    auto context = EvaluationParser::CreateFromFile(fname, cache);
+    context.setVariable("z", 1);
+    BOOST_CHECK_EQUAL(context.calc("Y"), 6);
+    BOOST_CHECK_EQUAL(cache.statistics().errors, 1u);
+    BOOST_CHECK_EQUAL(cache.statistics().misses, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(ModelCache_EvictsBeyondBound)
+{
+    ScratchDirectory scratch;
+    ModelCache cache(scratch.path.string(), 1);
+    auto fname = scratch.write("model.xml", SharedModel);
+    EvaluationParser::CreateFromFile(fname, cache);
+    BOOST_CHECK_EQUAL(cache.statistics().evictions, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(LazyLoading_BuildsOnlyWhatIsNeeded)
+{
+    ScratchDirectory scratch;
+    // A = z, B = A * 2, C = w, A = 10 (redefined: B still sees the first A)
+    auto fname = scratch.write(
+        "model.xml",
+        "<?xml version=\"1.0\"?><root><!-- A = z -->"
+        "<variable value=\"A\"><variable value=\"z\"/></variable>"
+        "<variable value=\"B\"><bin_op type=\"*\"><variable value=\"A\"/>"
+        "<constant value=\"2\"/></bin_op></variable>"
+        "<variable value=\"C\"><variable value=\"w\"/></variable>"
+        "<variable value=\"A\"><constant value=\"10\"/></variable>"
+        "</root>");
+
+    auto context = EvaluationParser::CreateLazyFromFile(fname, {"B"});
+    BOOST_CHECK(context.isKnownExpression("B"));
+    BOOST_CHECK(!context.isKnownExpression("C"));
+    BOOST_CHECK(!context.isKnownVariable("w"));
+
+    context.setVariable("z", 4);
+    BOOST_CHECK_EQUAL(context.calc("B"), 8);
+    BOOST_CHECK_EQUAL(context.calc("A"), 10);
+
+    // Variables may be set before the expression using them is loaded.
+    context.setVariable("w", 5);
+    BOOST_CHECK_EQUAL(context.calc("C"), 5);
+    BOOST_CHECK_THROW(context.calc("D"), std::runtime_error);
+    BOOST_CHECK_THROW(EvaluationParser::CreateLazyFromFile(fname, {"D"}),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(Includes_DiamondIsBuiltOnce)
+{
+    ScratchDirectory scratch;
+    fs::create_directories(scratch.path / "lib");
+    // lib/base.xml: R = r + 1, included by both curves.
+    scratch.write("lib/base.xml",
+                  "<root><variable value=\"R\"><bin_op type=\"+\">"
+                  "<variable value=\"r\"/><constant value=\"1\"/>"
+                  "</bin_op></variable></root>");
+    scratch.write("lib/left.xml",
+                  "<root><include file=\"base.xml\"/><variable value=\"L\">"
+                  "<bin_op type=\"*\"><variable value=\"R\"/>"
+                  "<constant value=\"2\"/></bin_op></variable></root>");
+    // Same contents under another name: deduplicated by hash.
+    scratch.write("lib/copy.xml",
+                  "<root><variable value=\"R\"><bin_op type=\"+\">"
+                  "<variable value=\"r\"/><constant value=\"1\"/>"
+                  "</bin_op></variable></root>");
+    scratch.write("right.xml",
+                  "<root><include file=\"lib/copy.xml\"/><variable value=\"S\">"
+                  "<bin_op type=\"*\"><variable value=\"R\"/>"
+                  "<constant value=\"3\"/></bin_op></variable></root>");
+    auto fname = scratch.write(
+        "model.xml",
+        "<root><include file=\"lib/left.xml\"/><include file=\"right.xml\"/>"
+        "<variable value=\"T\"><bin_op type=\"+\"><variable value=\"L\"/>"
+        "<variable value=\"S\"/></bin_op></variable></root>");
+
+    ModelLibrary library(4);
+    auto context = EvaluationParser::CreateFromFile(fname, library);
+    BOOST_CHECK_EQUAL(context.expressions().size(), 4u);
+    context.setVariable("r", 1);
+    BOOST_CHECK_EQUAL(context.calc("T"), 10);
+    BOOST_CHECK_EQUAL(library.size(), 4u);
+    BOOST_CHECK_EQUAL(library.statistics().parses, 4u);
+
+    // A second context shares the parsed files but not the variables.
+    auto other = EvaluationParser::CreateFromFile(fname, library);
+    BOOST_CHECK_EQUAL(library.statistics().parses, 4u);
+    other.setVariable("r", 2);
+    BOOST_CHECK_EQUAL(other.calc("T"), 15);
+    BOOST_CHECK_EQUAL(context.calc("T"), 10);
+
+    auto lazy = EvaluationParser::CreateLazyFromFile(fname, {"T"});
+    lazy.setVariable("r", 1);
+    BOOST_CHECK_EQUAL(lazy.calc("T"), 10);
+}
+
+BOOST_AUTO_TEST_CASE(Includes_ResolvedAgainstEachIncludingFile)
+{
+    ScratchDirectory scratch;
+    fs::create_directories(scratch.path / "a");
+    fs::create_directories(scratch.path / "b");
+    // The same model text in both directories, next to different libraries.
+    const char* model =
+        "<root><include file=\"lib.xml\"/><variable value=\"T\">"
+        "<variable value=\"K\"/></variable></root>";
+    auto first = scratch.write("a/model.xml", model);
+    auto second = scratch.write("b/model.xml", model);
+    scratch.write("a/lib.xml", "<root><variable value=\"K\"><constant value=\"1\"/>"
+                               "</variable></root>");
+    scratch.write("b/lib.xml", "<root><variable value=\"K\"><constant value=\"2\"/>"
+                               "</variable></root>");
+
+    ModelLibrary library(2);
+    BOOST_CHECK_EQUAL(EvaluationParser::CreateFromFile(first, library).calc("T"), 1);
+    BOOST_CHECK_EQUAL(EvaluationParser::CreateFromFile(second, library).calc("T"), 2);
+    // The model text itself is still parsed once.
+    BOOST_CHECK_EQUAL(library.statistics().parses, 3u);
+    auto snapshot = library.load(second);
+    BOOST_CHECK_EQUAL(snapshot.includes.at(snapshot.root).size(), 1u);
+    BOOST_CHECK_EQUAL(snapshot.includes.at(snapshot.root)[0],
+                      ModelLibrary::Resolve(second, "lib.xml"));
+}
+
+BOOST_AUTO_TEST_CASE(ReloadableModel_SwapsVersions)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write(
+        "model.xml",
+        "<root><variable value=\"Y\"><bin_op type=\"+\"><variable value=\"x\"/>"
+        "<constant value=\"1\"/></bin_op></variable></root>");
+    ReloadableModel model(fname);
+    model.setVariable("x", 2);
+    BOOST_CHECK_EQUAL(model.calc("Y"), 3);
+
+    // An evaluation in flight keeps its version.
+    auto old = model.acquire();
+    scratch.write("model.xml",
+                  "<root><variable value=\"Y\"><bin_op type=\"*\">"
+                  "<variable value=\"x\"/><constant value=\"10\"/>"
+                  "</bin_op></variable></root>");
+    model.reload();
+    model.wait();
+    BOOST_CHECK_EQUAL(model.statistics().version, 2u);
+    BOOST_CHECK_EQUAL(model.calc("Y"), 20);
+    BOOST_CHECK_EQUAL(old->calc("Y"), 3);
+
+    // A broken file leaves the current version in place.
+    scratch.write("model.xml", "<root><variable value=\"Y\"><bogus/>");
+    model.reload();
+    model.wait();
+    BOOST_CHECK_EQUAL(model.statistics().failures, 1u);
+    BOOST_CHECK_EQUAL(model.calc("Y"), 20);
+}
+
+BOOST_AUTO_TEST_CASE(ReloadableModel_WatchesFile)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write(
+        "model.xml", "<root><variable value=\"Y\"><constant value=\"1\"/>"
+                     "</variable></root>");
+    ReloadableModel model(fname);
+    model.watch(std::chrono::milliseconds(5));
+    scratch.write("model.xml",
+                  "<root><variable value=\"Y\"><constant value=\"42\"/>"
+                  "</variable></root>");
+    for (int i = 0; i < 1000 && model.statistics().version < 2; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    BOOST_CHECK_EQUAL(model.calc("Y"), 42);
+}
+
+BOOST_AUTO_TEST_CASE(ReloadableModel_WatchesOnceIdle)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write(
+        "model.xml", "<root><variable value=\"Y\"><constant value=\"1\"/>"
+                     "</variable></root>");
+    ReloadableModel model(fname);
+    // Let the watcher go to sleep with no interval before asking for one.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    model.watch(std::chrono::milliseconds(5));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    scratch.write("model.xml",
+                  "<root><variable value=\"Y\"><constant value=\"42\"/>"
+                  "</variable></root>");
+    for (int i = 0; i < 1000 && model.statistics().version < 2; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    BOOST_CHECK_EQUAL(model.statistics().version, 2u);
+    BOOST_CHECK_EQUAL(model.calc("Y"), 42);
+}
+
+BOOST_AUTO_TEST_CASE(IncrementalModel_RebuildsChangedAndDependents)
+{
+    ScratchDirectory scratch;
+    auto model = [](const char* a) {
+        return std::string("<root><variable value=\"A\"><bin_op type=\"+\">"
+                           "<variable value=\"x\"/><constant value=\"") +
+               a +
+               "\"/></bin_op></variable>"
+               "<variable value=\"B\"><bin_op type=\"*\"><variable value=\"A\"/>"
+               "<constant value=\"2\"/></bin_op></variable>"
+               "<variable value=\"C\"><variable value=\"y\"/></variable></root>";
+    };
+    auto fname = scratch.write("model.xml", model("1"));
+    IncrementalModel incremental(fname);
+    auto& context = incremental.context();
+    context.setVariable("x", 1);
+    context.setVariable("y", 5);
+    BOOST_CHECK_EQUAL(context.calc("B"), 4);
+    auto c = context.getExpression("C");
+
+    // Whitespace only: nothing is rebuilt.
+    scratch.write("model.xml", "\n  " + model("1") + "\n");
+    auto report = incremental.reload();
+    BOOST_CHECK_EQUAL(report.rebuilt, 0u);
+    BOOST_CHECK_EQUAL(report.reused, 3u);
+
+    scratch.write("model.xml", model("2"));
+    report = incremental.reload();
+    BOOST_CHECK_EQUAL(report.definitions, 3u);
+    BOOST_CHECK_EQUAL(report.changed, 1u);
+    BOOST_CHECK_EQUAL(report.rebuilt, 2u);
+    BOOST_CHECK_EQUAL(report.reused, 1u);
+    BOOST_CHECK(context.getExpression("C") == c);
+    // Values set before the reload are kept.
+    BOOST_CHECK_EQUAL(context.calc("B"), 6);
+    BOOST_CHECK_EQUAL(context.calc("C"), 5);
+
+    // Profiling survives reloads, and covers rebuilt and reused expressions.
+    context.enableProfiling();
+    BOOST_CHECK_EQUAL(context.calc("B"), 6);
+    for (auto constant : {"3", "4"}) {
+        scratch.write("model.xml", model(constant));
+        incremental.reload();
+        BOOST_CHECK(context.isProfiling());
+        context.calc("B");
+        context.calc("C");
+    }
+    BOOST_CHECK_EQUAL(context.calc("B"), 10);
+    // One row per name, rebuilt expressions adding to the ones they replace.
+    auto hotspots = context.profiler()->hotspots();
+    BOOST_CHECK_EQUAL(hotspots.size(), 3u);
+    std::map<std::string, uint64_t> calls;
+    for (const auto& entry : hotspots) calls[entry.name] = entry.calls;
+    BOOST_CHECK_EQUAL(calls["B"], 4u);
+    BOOST_CHECK_EQUAL(calls["A"], 4u);
+    BOOST_CHECK_EQUAL(calls["C"], 2u);
+}
+
+BOOST_AUTO_TEST_CASE(Profiler_CountsAndFoldsCalls)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write("model.xml", SharedModel);
+    auto context = EvaluationParser::CreateFromFile(fname);
+    context.setVariable("z", 2);
+    BOOST_CHECK(!context.profiler());
+
+    context.enableProfiling();
+    BOOST_CHECK_EQUAL(context.calc("Y"), 9);
+    BOOST_CHECK_EQUAL(context.calc("Y"), 9);
+    context.disableProfiling();
+    context.calc("Y");
+
+    auto hotspots = context.profiler()->hotspots();
+    BOOST_REQUIRE_EQUAL(hotspots.size(), 2u);
+    std::map<std::string, Profiler::Entry> entries;
+    for (const auto& entry : hotspots) entries[entry.name] = entry;
+    BOOST_CHECK_EQUAL(entries["Y"].calls, 2u);
+    // X is reached twice per evaluation of Y.
+    BOOST_CHECK_EQUAL(entries["X"].calls, 4u);
+    BOOST_CHECK(entries["Y"].inclusiveSeconds >= entries["X"].inclusiveSeconds);
+    BOOST_CHECK(entries["Y"].inclusiveSeconds >= entries["Y"].exclusiveSeconds);
+
+    std::ostringstream folded;
+    context.profiler()->writeFolded(folded);
+    BOOST_CHECK(folded.str().find("Y;X ") != std::string::npos);
+
+    // Unset variables unwind the profiler stack.
+    auto other = EvaluationParser::CreateFromFile(fname);
+    other.enableProfiling();
+    BOOST_CHECK_THROW(other.calc("Y"), std::runtime_error);
+    other.setVariable("z", 1);
+    BOOST_CHECK_EQUAL(other.calc("Y"), 6);
+}
+
+BOOST_AUTO_TEST_CASE(PerfCounters_DegradeGracefully)
+{
+    PerfCounters counters;
+    auto before = counters.read();
+    volatile double sink = 0;
+    for (int i = 0; i < 100000; ++i) sink = sink + i;
+    auto delta = counters.read() - before;
+    if (counters.has(PerfCounters::Instructions))
+        BOOST_CHECK(delta[PerfCounters::Instructions] > 0);
+    else
+        BOOST_CHECK_EQUAL(delta[PerfCounters::Instructions], 0u);
+
+    ScratchDirectory scratch;
+    auto context =
+        EvaluationParser::CreateFromFile(scratch.write("model.xml", SharedModel));
+    context.setVariable("z", 2);
+    context.enableProfiling(true);
+    BOOST_CHECK_EQUAL(context.calc("Y"), 9);
+    std::ostringstream report;
+    context.profiler()->report(report);
+    BOOST_CHECK(report.str().find("Y") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(MemoryUsage_AccountsForNodesAndLoad)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write("model.xml", SharedModel);
+    auto context = EvaluationParser::CreateFromFile(fname);
+    auto usage = context.memoryUsage();
+    BOOST_CHECK_EQUAL(usage.nodeCount[MemoryUsage::Expression], 2u);
+    BOOST_CHECK_EQUAL(usage.nodeCount[MemoryUsage::Variable], 1u);
+    BOOST_CHECK_EQUAL(usage.nodeCount[MemoryUsage::Constant], 1u);
+    BOOST_CHECK_EQUAL(usage.nodeCount[MemoryUsage::BinaryOperator], 2u);
+    BOOST_CHECK(usage.expressionMap > 0 && usage.variableMap > 0);
+    BOOST_CHECK_EQUAL(usage.constantPool, usage.nodes[MemoryUsage::Constant]);
+    // The DOM was alive next to the graph while loading.
+    BOOST_REQUIRE(DocumentMemory::Installed());
+    BOOST_CHECK(usage.loadPeak > usage.total());
+
+    context.enableProfiling();
+    context.setVariable("z", 1);
+    context.calc("Y");
+    BOOST_CHECK(context.memoryUsage().caches > usage.caches);
+
+    // Tracing alone wraps each of the two expressions in a TracedNode.
+    auto traced = EvaluationParser::CreateFromFile(fname);
+    auto before = traced.memoryUsage().caches;
+    traced.enableTracing();
+    BOOST_CHECK_EQUAL(traced.memoryUsage().caches,
+                      before + 2 * MemoryUsage::SharedBlock(sizeof(TracedNode)));
+
+    std::ostringstream report;
+    usage.report(report);
+    BOOST_CHECK(report.str().find("load peak") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(Tracer_RecordsPhasesPerThread)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write("model.xml", SharedModel);
+    Tracer::Clear();
+    Tracer::Start();
+    auto context = EvaluationParser::CreateFromFile(fname);
+    context.enableTracing();
+    context.enableProfiling();
+    context.setVariable("z", 2);
+    BOOST_CHECK_EQUAL(context.calc("Y"), 9);
+    std::thread worker([]() {
+        Tracer::NameThread("worker");
+        EVALUATION_TRACE("test", "on worker");
+    });
+    worker.join();
+    Tracer::Stop();
+    // Stopped: nothing more is recorded.
+    context.calc("Y");
+
+    std::ostringstream trace;
+    Tracer::Write(trace);
+    auto text = trace.str();
+    auto count = [&](const std::string& what) {
+        size_t n = 0;
+        for (auto at = text.find(what); at != std::string::npos;
+             at = text.find(what, at + 1))
+            ++n;
+        return n;
+    };
+    BOOST_CHECK_EQUAL(count("\"name\": \"read file\""), 1u);
+    BOOST_CHECK_EQUAL(count("\"name\": \"parse XML\""), 1u);
+    BOOST_CHECK_EQUAL(count("\"name\": \"CreateNode\""), 1u);
+    BOOST_CHECK_EQUAL(count("\"cat\": \"eval\", \"name\": \"Y\""), 1u);
+    BOOST_CHECK_EQUAL(count("\"cat\": \"eval\", \"name\": \"X\""), 2u);
+    BOOST_CHECK_EQUAL(count("\"args\": {\"name\": \"worker\"}"), 1u);
+    BOOST_CHECK(text.find("\"tid\": 2") != std::string::npos);
+    BOOST_CHECK_EQUAL(context.profiler()->hotspots().size(), 2u);
+
+    context.disableTracing();
+    BOOST_CHECK(context.isProfiling());
+    Tracer::Clear();
+    std::ostringstream empty;
+    Tracer::Write(empty);
+    BOOST_CHECK(empty.str().find("\"ph\"") == std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(LatencyHistogram_PercentilesWithinBucketPrecision)
+{
+    LatencyHistogram histogram;
+    for (uint64_t value = 1; value <= 100000; ++value) histogram.record(value);
+    BOOST_CHECK_EQUAL(histogram.count(), 100000u);
+    BOOST_CHECK_EQUAL(histogram.min(), 1u);
+    BOOST_CHECK_EQUAL(histogram.max(), 100000u);
+    BOOST_CHECK_CLOSE(histogram.mean(), 50000.5, 1e-9);
+    BOOST_CHECK_CLOSE(double(histogram.percentile(50)), 50000, 100.0 / 64);
+    BOOST_CHECK_CLOSE(double(histogram.percentile(99)), 99000, 100.0 / 64);
+    BOOST_CHECK_EQUAL(histogram.percentile(100), 100000u);
+    // Small values are exact.
+    BOOST_CHECK_EQUAL(histogram.percentile(0.05), 50u);
+
+    LatencyHistogram tail;
+    tail.record(uint64_t(1) << 50);
+    histogram.merge(tail);
+    BOOST_CHECK_EQUAL(histogram.max(), uint64_t(1) << 50);
+    BOOST_CHECK_EQUAL(histogram.percentile(100), uint64_t(1) << 50);
+}
+
+BOOST_AUTO_TEST_CASE(LatencyStats_MergesThreads)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write("model.xml", SharedModel);
+    LatencyStats::Reset();
+    LatencyStats::Enable();
+    auto context = EvaluationParser::CreateFromFile(fname);
+    context.setVariable("z", 1);
+    context.calc("Y");
+    std::thread worker([&]() {
+        for (int i = 0; i < 10; ++i) LatencyStats::Record(LatencyStats::Calc, 1000);
+    });
+    worker.join();
+    LatencyStats::Enable(false);
+    context.calc("Y");
+
+    BOOST_CHECK_EQUAL(LatencyStats::Snapshot(LatencyStats::Load).count(), 1u);
+    auto calc = LatencyStats::Snapshot(LatencyStats::Calc);
+    BOOST_CHECK_EQUAL(calc.count(), 11u);
+    BOOST_CHECK_EQUAL(calc.percentile(50), 1000u);
+
+    std::ostringstream stats;
+    LatencyStats::Write(stats);
+    BOOST_CHECK(stats.str().find("\"calc\": {\"count\": 11") != std::string::npos);
+    LatencyStats::Reset();
+    BOOST_CHECK_EQUAL(LatencyStats::Snapshot(LatencyStats::Calc).count(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(Workload_RecordsAndReplays)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write("model.xml", SharedModel);
+    std::ostringstream trace;
+    {
+        auto context = EvaluationParser::CreateFromFile(fname);
+        auto recorder = std::make_shared<WorkloadRecorder>(trace);
+        context.setRecorder(recorder);
+        for (int i = 0; i < 100; ++i) {
+            context.setVariable("z", i);
+            context.calc("Y");
+        }
+        context.calc("X");
+        BOOST_CHECK_EQUAL(recorder->operations(), 201u);
+    }
+    // Names are written once: a tag, an id and a double per operation.
+    BOOST_CHECK(trace.str().size() < 201 * 10 + 32);
+
+    std::istringstream in(trace.str());
+    auto workload = Workload::Read(in);
+    BOOST_CHECK_EQUAL(workload.names().size(), 3u);
+    BOOST_CHECK_EQUAL(workload.operations().size(), 201u);
+    BOOST_CHECK(workload.operations()[1].type == Workload::Calc);
+    BOOST_CHECK_EQUAL(workload.operations()[3].value, 6);
+
+    auto context = EvaluationParser::CreateFromFile(fname);
+    ContextBackend backend(context);
+    auto result = workload.replay(backend, 3);
+    BOOST_CHECK_EQUAL(result.operations, 603u);
+    BOOST_CHECK_EQUAL(result.calcs, 303u);
+    BOOST_CHECK_EQUAL(result.calcLatency.count(), 303u);
+    BOOST_CHECK_EQUAL(result.mismatches, 0u);
+
+    // A different model gives different results.
+    std::string model = SharedModel;
+    model.replace(model.find("3"), 1, "4");
+    auto changed = scratch.write("changed.xml", model);
+    auto other = EvaluationParser::CreateFromFile(changed);
+    ContextBackend otherBackend(other);
+    BOOST_CHECK_EQUAL(workload.replay(otherBackend).mismatches, 101u);
+
+    std::istringstream garbage("not a workload");
+    BOOST_CHECK_THROW(Workload::Read(garbage), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(ModelAnalyzer_CountsCostsAndFlagsPatterns)
+{
+    ScratchDirectory scratch;
+    auto context = EvaluationParser::CreateFromFile(scratch.write("model.xml", SharedModel));
+    auto report = ModelAnalyzer::Analyze(context);
+    BOOST_CHECK_EQUAL(report.expressions, 2u);
+    BOOST_CHECK_EQUAL(report.distinctNodes, 6u);
+    BOOST_CHECK_EQUAL(report.operators["+"], 1u);
+    BOOST_CHECK_EQUAL(report.operators["expression"], 2u);
+    // X (2 nodes) once by itself, twice inside Y: 2 + (4 + 2 * 2).
+    BOOST_CHECK_EQUAL(report.evaluatedNodes, 10);
+    BOOST_CHECK_EQUAL(report.maxDepth, 5u);
+    BOOST_CHECK_EQUAL(report.costliest.front().first, "Y");
+    BOOST_CHECK(report.criticalPathCycles < report.estimatedCycles);
+    BOOST_CHECK(report.findings.empty());
+
+    std::string chain = "<variable value=\"a\"/>";
+    for (int i = 0; i < 40; ++i)
+        chain = "<bin_op type=\"+\">" + chain + "<constant value=\"1\"/></bin_op>";
+    const std::string square =
+        "<bin_op type=\"^\"><bin_op type=\"/\"><variable value=\"a\"/>"
+        "<constant value=\"2\"/></bin_op><constant value=\"2\"/></bin_op>";
+    auto slow = EvaluationParser::CreateFromFile(scratch.write("slow.xml",
+        "<root><variable value=\"A\">" + chain + "</variable>"
+        "<variable value=\"B\"><un_op type=\"exp\">" + square + "</un_op></variable>"
+        "<variable value=\"C\"><bin_op type=\"*\">" + square +
+        "<variable value=\"B\"/></bin_op></variable></root>"));
+    report = ModelAnalyzer::Analyze(slow);
+    std::map<ModelAnalyzer::Finding::Kind, size_t> kinds;
+    for (const auto& finding : report.findings) ++kinds[finding.kind];
+    BOOST_CHECK_EQUAL(kinds[ModelAnalyzer::Finding::DeepChain], 1u);
+    BOOST_CHECK_EQUAL(kinds[ModelAnalyzer::Finding::SmallIntegerPower], 2u);
+    BOOST_CHECK_EQUAL(kinds[ModelAnalyzer::Finding::DivisionByConstant], 2u);
+    // The two squares, but not their parts again.
+    BOOST_CHECK_EQUAL(kinds[ModelAnalyzer::Finding::RepeatedSubtree], 1u);
+    // exp and pow in B, counted again through C.
+    BOOST_CHECK_EQUAL(report.transcendentalCalls, 5);
+
+    std::ostringstream text;
+    report.write(text);
+    BOOST_CHECK(text.str().find("[deep-chain] A") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(GraphExport_AnnotatesProfileAndCriticalPath)
+{
+    ScratchDirectory scratch;
+    auto context = EvaluationParser::CreateFromFile(scratch.write("model.xml", SharedModel));
+
+    // Not profiled: estimated cycles, critical path Y -> X.
+    std::ostringstream json;
+    GraphExport::WriteJson(context, json);
+    auto text = json.str();
+    BOOST_CHECK(text.find("\"profiled\": false") != std::string::npos);
+    BOOST_CHECK(text.find("\"label\": \"X\", \"fan_out\": 1, \"critical\": true") !=
+                std::string::npos);
+    BOOST_CHECK(text.find("\"label\": \"z\", \"fan_out\": 1, \"critical\": false") !=
+                std::string::npos);
+    BOOST_CHECK(text.find("\"estimated_cycles\"") != std::string::npos);
+
+    context.enableProfiling();
+    context.setVariable("z", 1);
+    for (int i = 0; i < 10; ++i) context.calc("Y");
+    json.str("");
+    GraphExport::WriteJson(context, json);
+    text = json.str();
+    BOOST_CHECK(text.find("\"profiled\": true") != std::string::npos);
+    BOOST_CHECK(text.find("\"calls\": 20") != std::string::npos);  // X, twice per Y
+    BOOST_CHECK(text.find("\"calls\": 10") != std::string::npos);
+
+    std::ostringstream dot;
+    GraphExport::WriteDot(context, dot, GraphExport::Nodes);
+    text = dot.str();
+    BOOST_CHECK(text.find("digraph model {") == 0);
+    // Y, +, *, X, 3, z: one vertex each, X used twice.
+    size_t vertices = 0;
+    for (auto at = text.find("[label="); at != std::string::npos; at = text.find("[label=", at + 1))
+        ++vertices;
+    BOOST_CHECK_EQUAL(vertices, 6u);
+    BOOST_CHECK(text.find("fan-out 2") != std::string::npos);
+    BOOST_CHECK(text.find("color=red") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(NumberText_ParsesAndFormatsLikeStdio)
+{
+    auto format = [](double value) {
+        char text[NumberText::MaxLength];
+        return std::string(text, NumberText::Format(value, text));
+    };
+    BOOST_CHECK_EQUAL(format(0), "0");
+    BOOST_CHECK_EQUAL(format(-0.0), "-0");
+    BOOST_CHECK_EQUAL(format(42), "42");
+    BOOST_CHECK_EQUAL(format(0.1), "0.1");
+    BOOST_CHECK_EQUAL(format(-2.5e-7), "-2.5e-07");
+    BOOST_CHECK_EQUAL(format(1e300), "1e+300");
+    BOOST_CHECK_EQUAL(format(1.0 / 3), "0.3333333333333333");
+    BOOST_CHECK_EQUAL(format(std::numeric_limits<double>::infinity()), "inf");
+
+    auto parse = [](const std::string& text, double& value) {
+        auto end = NumberText::Parse(text.data(), text.data() + text.size(), value);
+        return end ? static_cast<size_t>(end - text.data()) : std::string::npos;
+    };
+    double value;
+    BOOST_CHECK_EQUAL(parse("1.5,2", value), 3u);
+    BOOST_CHECK_EQUAL(value, 1.5);
+    BOOST_CHECK_EQUAL(parse("-.25e2x", value), 6u);
+    BOOST_CHECK_EQUAL(value, -25);
+    BOOST_CHECK_EQUAL(parse("3e", value), 1u);
+    BOOST_CHECK_EQUAL(parse("nan", value), 3u);
+    BOOST_CHECK(std::isnan(value));
+    BOOST_CHECK_EQUAL(parse(",", value), std::string::npos);
+    BOOST_CHECK_EQUAL(parse("-", value), std::string::npos);
+
+    // Random bit patterns and decimals agree with strtod both ways.
+    std::mt19937_64 random(7);
+    for (int i = 0; i < 200000; ++i) {
+        double expected;
+        if (i % 2) {
+            auto bits = random();
+            std::memcpy(&expected, &bits, sizeof(expected));
+            if (!std::isfinite(expected)) continue;
+        } else {
+            expected = static_cast<double>(random() % 100000000) /
+                       std::pow(10.0, static_cast<double>(random() % 12));
+        }
+        auto text = format(expected);
+        BOOST_REQUIRE_EQUAL(std::strtod(text.c_str(), nullptr), expected);
+        BOOST_REQUIRE_EQUAL(parse(text, value), text.size());
+        BOOST_REQUIRE_EQUAL(value, expected);
+        char printed[32];
+        std::snprintf(printed, sizeof(printed), "%.17g", expected);
+        BOOST_REQUIRE_EQUAL(parse(printed, value), std::strlen(printed));
+        BOOST_REQUIRE_EQUAL(value, expected);
+    }
+
+    // JSON has no nan or inf.
+    BOOST_CHECK_EQUAL(NumberText::Json(0.1), "0.1");
+    BOOST_CHECK_EQUAL(NumberText::Json(-1e300), format(-1e300));
+    BOOST_CHECK_EQUAL(NumberText::Json(std::numeric_limits<double>::quiet_NaN()), "null");
+    BOOST_CHECK_EQUAL(NumberText::Json(-std::numeric_limits<double>::infinity()), "null");
+}
+
+BOOST_AUTO_TEST_CASE(ColumnFile_RoundTripsNpy)
+{
+    ScratchDirectory scratch;
+    auto fname = (scratch.path / "z.npy").string();
+    {
+        auto column = ColumnFile::Create(fname, ColumnFile::Float, 1000);
+        BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(column.data()) % 64, 0u);
+        auto values = static_cast<float*>(column.data());
+        for (size_t i = 0; i < column.rows(); ++i) values[i] = i * 0.5f;
+    }
+    auto column = ColumnFile::Open(fname);
+    BOOST_CHECK(column.type() == ColumnFile::Float);
+    BOOST_CHECK_EQUAL(column.rows(), 1000u);
+    BOOST_CHECK(!column.writable());
+    BOOST_CHECK_THROW(column.data(), std::runtime_error);
+    BOOST_CHECK_EQUAL(static_cast<const float*>(
+                          static_cast<const ColumnFile&>(column).data())[999], 499.5f);
+    BOOST_CHECK_EQUAL(fs::file_size(fname), 128 + 4000u);
+
+    // What numpy.save writes for a 2x2 float64 array.
+    std::string header = "{'descr': '<f8', 'fortran_order': False, 'shape': (2, 2), }";
+    header.resize(117, ' ');
+    header += '\n';
+    std::string matrix = std::string("\x93NUMPY\x01\x00\x76\x00", 10) + header +
+                         std::string(4 * sizeof(double), '\0');
+    BOOST_CHECK_THROW(ColumnFile::Open(scratch.write("matrix.npy", matrix)), std::runtime_error);
+    BOOST_CHECK_THROW(ColumnFile::Open(scratch.write("text.npy", SharedModel)),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(BatchEvaluator_MatchesCalcOverColumns)
+{
+    ScratchDirectory scratch;
+    // X = 3, Y = X + z * X, W = max(exp(-z), w)
+    auto fname = scratch.write(
+        "model.xml",
+        "<root>"
+        "<variable value=\"X\"><constant value=\"3\"/></variable>"
+        "<variable value=\"Y\"><bin_op type=\"+\"><variable value=\"X\"/>"
+        "<bin_op type=\"*\"><variable value=\"z\"/><variable value=\"X\"/>"
+        "</bin_op></bin_op></variable>"
+        "<variable value=\"W\"><bin_op type=\"max\"><un_op type=\"exp\"><un_op type=\"-\">"
+        "<variable value=\"z\"/></un_op></un_op><variable value=\"w\"/></bin_op></variable>"
+        "</root>");
+    auto context = EvaluationParser::CreateFromFile(fname);
+    BatchEvaluator batch(context, {"Y", "W"});
+    BOOST_CHECK_EQUAL(batch.variables().size(), 2u);
+    BOOST_CHECK_EQUAL(batch.variables()[0], "w");
+    BOOST_CHECK_EQUAL(batch.variables()[1], "z");
+
+    // Not a multiple of the block size, to cover the tail.
+    const size_t rows = 3 * BatchEvaluator::BlockRows + 17;
+    std::vector<double> z(rows);
+    std::vector<float> w(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        z[i] = i * 0.01 - 1;
+        w[i] = static_cast<float>(i % 7) * 0.25f;
+    }
+    auto y = ColumnFile::Create((scratch.path / "Y.npy").string(), ColumnFile::Double, rows);
+    std::vector<float> results(rows);
+    batch.bind("z", z.data());
+    batch.bind("w", w.data());
+    batch.bindResult("Y", y);
+    batch.bindResult("W", results.data());
+    BOOST_CHECK_THROW(batch.bind("X", z.data()), std::runtime_error);
+    batch.run(rows);
+
+    auto ys = static_cast<const double*>(static_cast<const ColumnFile&>(y).data());
+    for (size_t i = 0; i < rows; ++i) {
+        context.setVariable("z", z[i]);
+        context.setVariable("w", w[i]);
+        BOOST_REQUIRE_EQUAL(ys[i], context.calc("Y"));
+        BOOST_REQUIRE_EQUAL(results[i], static_cast<float>(context.calc("W")));
+    }
+
+    // Unbound variables take their value in the context.
+    batch.bind("w", static_cast<const double*>(nullptr));
+    context.setVariable("w", 2.5);
+    batch.run(rows);
+    BOOST_CHECK_EQUAL(results[rows - 1], 2.5f);
+    auto fresh = EvaluationParser::CreateFromFile(fname);
+    BatchEvaluator unset(fresh, {"W"});
+    BOOST_CHECK_THROW(unset.run(1), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(BatchEvaluator_ReadsAndWritesStructFields)
+{
+    ScratchDirectory scratch;
+    auto context = EvaluationParser::CreateFromFile(scratch.write("model.xml", SharedModel));
+    struct Scenario {
+        int id;
+        float z;
+        double y;
+        float x;
+    };
+    const size_t rows = 2 * BatchEvaluator::BlockRows + 5;
+    std::vector<Scenario> scenarios(rows);
+    std::vector<double> z(rows), y(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        scenarios[i].id = static_cast<int>(i);
+        scenarios[i].z = z[i] = i * 0.5f - 7;
+    }
+
+    BatchEvaluator batch(context, {"X", "Y"});
+    batch.bind("z", &scenarios[0].z, sizeof(Scenario));
+    batch.bindResult("Y", &scenarios[0].y, sizeof(Scenario));
+    batch.bindResult("X", &scenarios[0].x, sizeof(Scenario));
+    batch.run(rows);
+
+    BatchEvaluator columns(context, {"Y"});
+    columns.bind("z", z.data());
+    columns.bindResult("Y", y.data());
+    columns.run(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        BOOST_REQUIRE_EQUAL(scenarios[i].id, static_cast<int>(i));
+        BOOST_REQUIRE_EQUAL(scenarios[i].y, y[i]);
+        BOOST_REQUIRE_EQUAL(scenarios[i].x, 3.0f);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ChunkedPipeline_OverlapsStagesAcrossChunks)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write("model.xml", SharedModel);
+    fs::create_directories(scratch.path / "in");
+    fs::create_directories(scratch.path / "out");
+    auto in = (scratch.path / "in").string(), out = (scratch.path / "out").string();
+
+    // More chunks than slots, the last one partial.
+    const size_t rows = 10 * BatchEvaluator::BlockRows + 3;
+    {
+        auto z = ColumnFile::Create(in + "/z.npy", ColumnFile::Float, rows);
+        auto values = static_cast<float*>(z.data());
+        for (size_t i = 0; i < rows; ++i) values[i] = i * 0.25f;
+    }
+    auto context = EvaluationParser::CreateFromFile(fname);
+    ChunkedPipeline::Options options;
+    options.chunkRows = 2 * BatchEvaluator::BlockRows;
+    ChunkedPipeline pipeline(context, {"X", "Y"}, options);
+    auto report = pipeline.run(in, out);
+    BOOST_CHECK_EQUAL(report.rows, rows);
+    BOOST_CHECK_EQUAL(report.chunks, 6u);
+    BOOST_CHECK_EQUAL(report.reading.bytes, rows * sizeof(float));
+    BOOST_CHECK_EQUAL(report.writing.bytes, 2 * rows * sizeof(double));
+    std::ostringstream summary;
+    report.write(summary);
+    BOOST_CHECK(summary.str().find("bound by") != std::string::npos);
+
+    auto x = ColumnFile::Open(out + "/X.npy");
+    auto y = ColumnFile::Open(out + "/Y.npy");
+    BOOST_REQUIRE_EQUAL(y.rows(), rows);
+    auto xs = static_cast<const double*>(static_cast<const ColumnFile&>(x).data());
+    auto ys = static_cast<const double*>(static_cast<const ColumnFile&>(y).data());
+    for (size_t i = 0; i < rows; ++i) {
+        context.setVariable("z", i * 0.25f);
+        BOOST_REQUIRE_EQUAL(xs[i], 3);
+        BOOST_REQUIRE_EQUAL(ys[i], context.calc("Y"));
+    }
+
+    // A variable without a column must be set; errors stop every stage.
+    ChunkedPipeline::Options budget;
+    budget.memoryBudget = 1 << 20;
+    auto fresh = EvaluationParser::CreateFromFile(fname);
+    BOOST_CHECK_THROW(ChunkedPipeline(fresh, {"Y"}, budget).run(out, out), std::runtime_error);
+    fs::resize_file(in + "/z.npy", 100);
+    BOOST_CHECK_THROW(ChunkedPipeline(fresh, {"Y"}, budget).run(in, out), std::runtime_error);
+    BOOST_CHECK_EQUAL(ChunkedPipeline::ChunkRows(24, 3 << 20),
+                      (1 << 20) / 24 / BatchEvaluator::BlockRows * BatchEvaluator::BlockRows);
+}
+
+BOOST_AUTO_TEST_CASE(ChunkedPipeline_RebindsOnEveryRun)
+{
+    ScratchDirectory scratch;
+    auto fname = scratch.write(
+        "model.xml",
+        "<root><variable value=\"S\"><bin_op type=\"+\"><variable value=\"a\"/>"
+        "<variable value=\"b\"/></bin_op></variable></root>");
+    for (auto directory : {"both", "one", "out"})
+        fs::create_directories(scratch.path / directory);
+    auto path = [&scratch](const std::string& name) { return (scratch.path / name).string(); };
+    const size_t rows = 3 * BatchEvaluator::BlockRows + 5;
+    for (auto column : {"both/a.npy", "both/b.npy", "one/a.npy"}) {
+        auto file = ColumnFile::Create(path(column), ColumnFile::Double, rows);
+        auto values = static_cast<double*>(file.data());
+        for (size_t i = 0; i < rows; ++i) values[i] = static_cast<double>(i);
+    }
+    auto context = EvaluationParser::CreateFromFile(fname);
+    context.setVariable("b", 100);
+    ChunkedPipeline::Options options;
+    options.chunkRows = BatchEvaluator::BlockRows;
+    ChunkedPipeline pipeline(context, {"S"}, options);
+
+    // b comes from a column, then from the context: the second run must not
+    // read the chunk buffers of the first.
+    for (auto in : {"both", "one", "both"}) {
+        pipeline.run(path(in), path("out"));
+        auto s = ColumnFile::Open(path("out/S.npy"));
+        auto values = static_cast<const double*>(static_cast<const ColumnFile&>(s).data());
+        bool column = std::string(in) == "both";
+        for (size_t i = 0; i < rows; i += 17)
+            BOOST_REQUIRE_EQUAL(values[i], i + (column ? static_cast<double>(i) : 100.0));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Aggregate_MatchesExactStatisticsAcrossThreads)
+{
+    ScratchDirectory scratch;
+    auto context = EvaluationParser::CreateFromFile(scratch.write("model.xml", SharedModel));
+    const size_t rows = 20 * BatchEvaluator::BlockRows + 17;
+    std::mt19937 random(7);
+    std::uniform_real_distribution<double> uniform(-1, 1);
+    std::vector<double> z(rows);
+    std::vector<Aggregate::Entry> exact;
+    for (size_t i = 0; i < rows; ++i) {
+        z[i] = i % 100 == 42 ? std::numeric_limits<double>::quiet_NaN() : uniform(random);
+        if (z[i] == z[i]) exact.push_back(Aggregate::Entry(3 + z[i] * 3, i));
+    }
+    double sum = 0, squares = 0;
+    for (const auto& entry : exact) sum += entry.first;
+    double mean = sum / exact.size();
+    for (const auto& entry : exact) squares += (entry.first - mean) * (entry.first - mean);
+
+    Aggregate::Spec spec;
+    spec.bins = 12;
+    spec.low = -3;
+    spec.high = 3;
+    spec.compression = 100;
+    spec.top = 3;
+    auto bind = [&z](BatchEvaluator& batch) { batch.bind("z", z.data()); };
+    auto serial = Aggregate::Evaluate(context, {"Y"}, spec, bind, rows, 1);
+    auto parallel = Aggregate::Evaluate(context, {"X", "Y"}, spec, bind, rows, 4);
+    BOOST_REQUIRE_EQUAL(parallel.size(), 2u);
+    BOOST_CHECK_EQUAL(parallel[0].count(), rows);
+    BOOST_CHECK_EQUAL(parallel[0].variance(), 0);
+
+    for (auto* y : {&serial[0], &parallel[1]}) {
+        BOOST_CHECK_EQUAL(y->count(), exact.size());
+        BOOST_CHECK_EQUAL(y->nans(), rows - exact.size());
+        BOOST_CHECK_CLOSE(y->mean(), mean, 1e-10);
+        BOOST_CHECK_CLOSE(y->variance(), squares / (exact.size() - 1), 1e-10);
+        // Y lies in [0, 6): the upper half of the bins and the overflow.
+        BOOST_CHECK_EQUAL(y->underflow(), 0u);
+        uint64_t binned = y->overflow();
+        for (size_t b = 0; b < spec.bins; ++b) binned += y->histogram()[b];
+        BOOST_CHECK_EQUAL(binned, exact.size());
+        BOOST_CHECK_EQUAL(y->histogram()[0], 0u);
+    }
+    BOOST_CHECK(serial[0].histogram() == parallel[1].histogram());
+    BOOST_CHECK_EQUAL(serial[0].overflow(), parallel[1].overflow());
+
+    std::sort(exact.begin(), exact.end());
+    BOOST_CHECK_EQUAL(parallel[1].min(), exact.front().first);
+    BOOST_CHECK_EQUAL(parallel[1].max(), exact.back().first);
+    for (double q : {0.001, 0.01, 0.25, 0.5, 0.75, 0.99, 0.999}) {
+        // Compare ranks: the rank of the estimate is within 1% of q.
+        double estimate = parallel[1].quantile(q);
+        auto rank = std::lower_bound(exact.begin(), exact.end(), Aggregate::Entry(estimate, 0)) -
+                    exact.begin();
+        BOOST_CHECK_SMALL(static_cast<double>(rank) / exact.size() - q, 0.01);
+    }
+    auto top = parallel[1].top();
+    BOOST_REQUIRE_EQUAL(top.size(), 3u);
+    for (size_t k = 0; k < 3; ++k) BOOST_CHECK(top[k] == exact[exact.size() - 1 - k]);
+    BOOST_CHECK(serial[0].top() == top);
+
+    std::ostringstream json;
+    parallel[1].write(json);
+    BOOST_CHECK(json.str().find("\"nan\": " + std::to_string(rows - exact.size())) !=
+                std::string::npos);
+    BOOST_CHECK(json.str().find("\"0.5\": ") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(MonteCarlo_SamplesReproduciblyAndConverges)
+{
+    // Known answers of Philox4x32-10 (Random123).
+    uint32_t zero[4] = {0, 0, 0, 0};
+    Philox(0).generate(zero);
+    BOOST_CHECK_EQUAL(zero[0], 0x6627e8d5u);
+    BOOST_CHECK_EQUAL(zero[3], 0x9b00dbd8u);
+    uint32_t pi[4] = {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344};
+    Philox(0x299f31d0a4093822ull).generate(pi);
+    BOOST_CHECK_EQUAL(pi[0], 0xd16cfe09u);
+    BOOST_CHECK_EQUAL(pi[3], 0x24126ea1u);
+
+    // The first 2^k Sobol points of every dimension stratify [0, 1).
+    Sobol sobol(Sobol::MaxDimensions);
+    std::vector<double> points(1024);
+    for (size_t d = 0; d < Sobol::MaxDimensions; ++d) {
+        sobol.fill(0, points.size(), d, points.data());
+        std::vector<int> strata(points.size());
+        for (double point : points) ++strata[static_cast<size_t>(point * points.size())];
+        BOOST_REQUIRE(std::count(strata.begin(), strata.end(), 1) == 1024);
+        std::vector<double> tail(3);
+        sobol.fill(700, 3, d, tail.data());
+        BOOST_CHECK(std::equal(tail.begin(), tail.end(), points.begin() + 700));
+    }
+    BOOST_CHECK_CLOSE(MonteCarlo::InverseNormal(0.975), 1.959963984540054, 1e-12);
+    BOOST_CHECK_CLOSE(MonteCarlo::InverseNormal(1e-10), -6.361340902404056, 1e-10);
+    BOOST_CHECK_EQUAL(MonteCarlo::InverseNormal(0.5), 0);
+
+    // Y = 3 + 3z: with z ~ N(1, 2), Y ~ N(6, 6).
+    ScratchDirectory scratch;
+    auto context = EvaluationParser::CreateFromFile(scratch.write("model.xml", SharedModel));
+    MonteCarlo engine(context, {"Y"});
+    engine.sample("z", MonteCarlo::Distribution::Normal(1, 2));
+    MonteCarlo::Options options;
+    options.samples = 100000;
+    options.seed = 11;
+    options.threads = 3;
+    options.spec.top = 2;
+    auto three = engine.run(options);
+    options.threads = 1;
+    auto one = engine.run(options);
+    BOOST_CHECK_EQUAL(three.samples, options.samples);
+    BOOST_CHECK_CLOSE(three.aggregates[0].mean(), 6, 0.5);
+    BOOST_CHECK_CLOSE(std::sqrt(three.aggregates[0].variance()), 6, 1);
+    BOOST_CHECK_CLOSE(three.aggregates[0].mean(), one.aggregates[0].mean(), 1e-9);
+    BOOST_CHECK(three.aggregates[0].top() == one.aggregates[0].top());
+    BOOST_REQUIRE(three.convergence.size() > 2);
+    BOOST_CHECK_EQUAL(three.convergence.back().samples, options.samples);
+    BOOST_CHECK(three.convergence.back().errors[0] < three.convergence.front().errors[0]);
+
+    // Sobol samples estimate the mean far better; a tolerance stops early.
+    options.sequence = MonteCarlo::Sequence::Sobol;
+    auto sobolRun = engine.run(options);
+    BOOST_CHECK_SMALL(sobolRun.aggregates[0].mean() - 6, 1e-3);
+    options.tolerance = 0.01;
+    auto early = engine.run(options);
+    BOOST_CHECK(early.samples < options.samples);
+    BOOST_CHECK(early.convergence.back().errors[0] <= 0.06);
+
+    // Correlated normals come out with the requested correlation.
+    auto pair = EvaluationParser::CreateFromFile(scratch.write(
+        "pair.xml",
+        "<root><variable value=\"P\"><bin_op type=\"*\"><variable value=\"a\"/>"
+        "<variable value=\"b\"/></bin_op></variable></root>"));
+    MonteCarlo correlated(pair, {"P"});
+    correlated.sample("a", MonteCarlo::Distribution::Normal(0, 1));
+    correlated.sample("b", MonteCarlo::Distribution::Normal(0, 1));
+    BOOST_CHECK_THROW(correlated.correlate({"a", "b"}, {1, 2, 2, 1}), std::runtime_error);
+    correlated.correlate({"a", "b"}, {1, 0.6, 0.6, 1});
+    options.tolerance = 0;
+    BOOST_CHECK_CLOSE(correlated.run(options).aggregates[0].mean(), 0.6, 2);
+}
+
+BOOST_AUTO_TEST_CASE(GridSweep_HoistsSubexpressionsOutOfInnerLoops)
+{
+    ScratchDirectory scratch;
+    auto context = EvaluationParser::CreateFromFile(scratch.write(
+        "model.xml",
+        "<root>"
+        "<variable value=\"A\"><bin_op type=\"*\"><un_op type=\"exp\">"
+        "<variable value=\"a\"/></un_op><un_op type=\"cos\"><variable value=\"a\"/>"
+        "</un_op></bin_op></variable>"
+        "<variable value=\"Out\"><bin_op type=\"+\"><bin_op type=\"*\"><variable value=\"A\"/>"
+        "<variable value=\"b\"/></bin_op><bin_op type=\"/\"><variable value=\"c\"/>"
+        "<constant value=\"2\"/></bin_op></bin_op></variable>"
+        "</root>"));
+    context.setVariable("c", 5);
+    std::vector<GridSweep::Axis> axes = {GridSweep::Axis::Linear("a", -1, 1, 7),
+                                         GridSweep::Axis::Linear("b", 0, 3, 300)};
+    BOOST_CHECK_EQUAL(axes[1].values.back(), 3);
+    GridSweep sweep(context, {"Out", "A"});
+    auto results = sweep.run(axes);
+    BOOST_REQUIRE_EQUAL(results.size(), 2 * 7 * 300u);
+    // c / 2 once, exp, cos and * once per a, the rest per point.
+    BOOST_CHECK(sweep.levels() == std::vector<size_t>({1, 3, 2}));
+    for (size_t i = 0; i < 7; ++i) {
+        for (size_t j = 0; j < 300; ++j) {
+            context.setVariable("a", axes[0].values[i]);
+            context.setVariable("b", axes[1].values[j]);
+            BOOST_REQUIRE_EQUAL(results[i * 300 + j], context.calc("Out"));
+            BOOST_REQUIRE_EQUAL(results[2100 + i * 300 + j], context.calc("A"));
+        }
+    }
+
+    // Swapped axes, and c varied innermost: A * b moves in with a.
+    std::vector<GridSweep::Axis> swapped = {axes[1], axes[0], GridSweep::Axis{"c", {4, 6}}};
+    results = sweep.run(swapped);
+    BOOST_CHECK(sweep.levels() == std::vector<size_t>({0, 0, 4, 2}));
+    context.setVariable("a", axes[0].values[2]);
+    context.setVariable("b", axes[1].values[299]);
+    context.setVariable("c", 6);
+    BOOST_CHECK_EQUAL(results[(299 * 7 + 2) * 2 + 1], context.calc("Out"));
+    BOOST_CHECK_THROW(sweep.run({axes[0], axes[0]}), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(BatchEvaluator_ReusesRegistersAcrossTiles)
+{
+    // A chain of 400 operations on z: ((z + 1) * 2 + 1) * 2 ...
+    std::string body = "<variable value=\"z\"/>";
+    for (int i = 0; i < 200; ++i)
+        body = "<bin_op type=\"*\"><bin_op type=\"+\">" + body +
+               "<constant value=\"1\"/></bin_op><constant value=\"0.5\"/></bin_op>";
+    ScratchDirectory scratch;
+    auto context = EvaluationParser::CreateFromFile(scratch.write(
+        "chain.xml", "<root><variable value=\"Y\">" + body + "</variable></root>"));
+    BatchEvaluator batch(context, {"Y"});
+    // z, two constants, the result, and two intermediates in turn.
+    BOOST_CHECK_EQUAL(batch.registers(), 6u);
+    BOOST_CHECK(batch.tileRows() >= 16 && batch.tileRows() <= BatchEvaluator::MaxTileRows);
+
+    const size_t rows = 1000;
+    std::vector<double> z(rows), y(rows);
+    for (size_t i = 0; i < rows; ++i) z[i] = i * 0.01 - 3;
+    batch.bind("z", z.data());
+    batch.bindResult("Y", y.data());
+    for (size_t tile : {size_t(1), size_t(7), size_t(rows), batch.tune()}) {
+        batch.setTileRows(tile);
+        BOOST_CHECK_EQUAL(batch.tileRows(), tile);
+        std::fill(y.begin(), y.end(), 0);
+        batch.run(rows);
+        for (size_t i = 0; i < rows; i += 37) {
+            context.setVariable("z", z[i]);
+            BOOST_REQUIRE_EQUAL(y[i], context.calc("Y"));
+        }
+    }
+    BOOST_CHECK_THROW(batch.setTileRows(0), std::runtime_error);
+
+    // Tuning over the bound rows leaves the results alone.
+    std::fill(y.begin(), y.end(), 0);
+    auto tile = batch.tune(rows);
+    BOOST_CHECK_EQUAL(batch.tileRows(), tile);
+    BOOST_CHECK_EQUAL(y[rows - 1], 0);
+}
+
+BOOST_AUTO_TEST_CASE(BatchEvaluator_RunsInSingleAndMixedPrecision)
+{
+    ScratchDirectory scratch;
+    auto context = EvaluationParser::CreateFromFile(scratch.write(
+        "model.xml",
+        "<root>"
+        "<variable value=\"W\"><bin_op type=\"*\"><un_op type=\"exp\"><variable value=\"z\"/>"
+        "</un_op><constant value=\"0.1\"/></bin_op></variable>"
+        "<variable value=\"D\"><bin_op type=\"-\"><bin_op type=\"+\"><variable value=\"z\"/>"
+        "<constant value=\"1000\"/></bin_op><constant value=\"1000\"/></bin_op></variable>"
+        "</root>"));
+    const size_t rows = 3000;
+    std::vector<double> z(rows), w(rows), d(rows);
+    std::vector<float> single(rows);
+    for (size_t i = 0; i < rows; ++i) z[i] = 0.001 + i / 3000.0;
+    BatchEvaluator batch(context, {"W", "D"});
+    batch.bind("z", z.data());
+    batch.bindResult("W", w.data());
+    batch.bindResult("D", d.data());
+    Aggregate sum;
+    batch.bindAggregate("W", &sum);
+
+    // Floats carry about 7 digits; z + 1000 in float loses three of them.
+    batch.setPrecision(BatchEvaluator::Precision::Single);
+    BOOST_CHECK(batch.precision() == BatchEvaluator::Precision::Single);
+    auto deviations = batch.validate(rows);
+    BOOST_REQUIRE_EQUAL(deviations.size(), 2u);
+    BOOST_CHECK_EQUAL(deviations[0].output, "W");
+    BOOST_CHECK(deviations[0].maxRelative > 0 && deviations[0].maxRelative < 1e-6);
+    BOOST_CHECK(deviations[1].maxRelative > 1e-5);
+    BOOST_CHECK_EQUAL(deviations[1].mismatches, 0u);
+    batch.run(rows);
+    for (size_t i = 0; i < rows; i += 7) {
+        context.setVariable("z", z[i]);
+        BOOST_CHECK_CLOSE(w[i], context.calc("W"), 1e-4);
+    }
+    // validate() leaves the bound outputs alone and the aggregate unfilled.
+    BOOST_CHECK_EQUAL(sum.count(), rows);
+
+    // Mixed keeps z + 1000 in double: only the rounding of z is left.
+    batch.setPrecision(BatchEvaluator::Precision::Mixed);
+    deviations = batch.validate(rows);
+    BOOST_CHECK(deviations[1].maxRelative < 1e-7);
+    BOOST_CHECK(deviations[0].maxRelative < 1e-6);
+    batch.bindResult("W", single.data());
+    batch.run(rows);
+    BOOST_CHECK_CLOSE(single[rows - 1], w[rows - 1], 1e-4);
+
+    batch.setPrecision(BatchEvaluator::Precision::Double);
+    batch.run(rows);
+    context.setVariable("z", z[rows - 1]);
+    BOOST_CHECK_EQUAL(d[rows - 1], context.calc("D"));
+    BOOST_CHECK_EQUAL(batch.validate(rows)[1].maxAbsolute, 0);
+}
+
+BOOST_AUTO_TEST_CASE(BatchKernels_AgreeAcrossInstructionSets)
+{
+    ScratchDirectory scratch;
+    auto context = EvaluationParser::CreateFromFile(scratch.write(
+        "model.xml",
+        "<root>"
+        "<variable value=\"A\"><bin_op type=\"max\"><bin_op type=\"/\"><un_op type=\"cos\">"
+        "<variable value=\"x\"/></un_op><variable value=\"y\"/></bin_op><un_op type=\"-\">"
+        "<un_op type=\"log\"><variable value=\"y\"/></un_op></un_op></bin_op></variable>"
+        "<variable value=\"B\"><bin_op type=\"^\"><un_op type=\"exp\"><un_op type=\"sin\">"
+        "<variable value=\"x\"/></un_op></un_op><bin_op type=\"min\"><variable value=\"y\"/>"
+        "<constant value=\"2.5\"/></bin_op></bin_op></variable>"
+        "</root>"));
+    const size_t rows = 1000;
+    std::vector<double> x(rows), y(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        x[i] = i * 0.013 - 6;
+        y[i] = i * 0.007 - 0.5;
+    }
+    auto run = [&](const std::string& isa, BatchEvaluator::Precision precision) {
+        BatchEvaluator batch(context, {"A", "B"});
+        batch.setIsa(isa);
+        BOOST_CHECK_EQUAL(batch.isa(), isa);
+        batch.setPrecision(precision);
+        std::vector<double> results(2 * rows);
+        batch.bind("x", x.data());
+        batch.bind("y", y.data());
+        batch.bindResult("A", results.data());
+        batch.bindResult("B", results.data() + rows);
+        batch.run(rows);
+        return results;
+    };
+
+    // The baseline is always there; every level gives the same bits, NaNs
+    // of log(y < 0) included.
+    auto levels = BatchKernels::Available();
+    BOOST_REQUIRE(!levels.empty());
+    BOOST_CHECK(levels.front() == "sse2" || levels.front() == "generic");
+    if (!std::getenv("EVALUATION_ISA"))
+        BOOST_CHECK_EQUAL(BatchKernels::Get().isa, levels.back());
+    for (auto precision : {BatchEvaluator::Precision::Double, BatchEvaluator::Precision::Single}) {
+        auto baseline = run(levels.front(), precision);
+        for (const auto& isa : levels) {
+            BOOST_TEST_MESSAGE("Kernels " << isa);
+            auto results = run(isa, precision);
+            BOOST_CHECK(std::memcmp(results.data(), baseline.data(),
+                                    results.size() * sizeof(double)) == 0);
+        }
+    }
+    context.setVariable("x", x[rows - 1]);
+    context.setVariable("y", y[rows - 1]);
+    BOOST_CHECK_EQUAL(run(levels.back(), BatchEvaluator::Precision::Double)[rows - 1],
+                      context.calc("A"));
+    BOOST_CHECK_THROW(BatchKernels::Get("avx9"), std::runtime_error);
+}
@@ -0,0 +1,41 @@
+// Reports the static cost of a model and the patterns that slow it down.
+//
+//   analyze MODEL [--strict]
+//
+// See ModelAnalyzer for what is measured. With --strict the exit status is
+// 2 when there are findings, so that a model check can gate deployment.
+
+#include <iostream>
+#include <string>
+
+#include "../src/model_analyzer.h"
+#include "../src/parser.h"
+
+int main(int argc, char** argv) {
+    std::string model;
+    bool strict = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--strict") {
+            strict = true;
+        } else if (model.empty() && !arg.empty() && arg[0] != '-') {
+            model = arg;
+        } else {
+            model.clear();
+            break;
+        }
+    }
+    if (model.empty()) {
+        std::cerr << "usage: " << argv[0] << " MODEL [--strict]" << std::endl;
+        return 1;
+    }
+    try {
+        auto context = EvaluationParser::CreateFromFile(model);
+        auto report = ModelAnalyzer::Analyze(context);
+        report.write(std::cout);
+        return strict && !report.findings.empty() ? 2 : 0;
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+}
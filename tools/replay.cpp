@@ -0,0 +1,100 @@
+// Replays a recorded workload (see WorkloadRecorder) against a model.
+//
+//   replay MODEL WORKLOAD [--repeat N] [--lazy] [--dot FILE] [--graph FILE]
+//
+// Operations run back to back, as fast as the model evaluates. A summary
+// goes to stderr, throughput and calc latency percentiles as JSON to
+// stdout. With --lazy the model is loaded with CreateLazyFromFile and
+// expressions are built as the workload asks for them. With --dot or
+// --graph the replay is profiled and the expression graph, annotated with
+// the measurements, is written as DOT or JSON (see GraphExport).
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/evaluation.h"
+#include "../src/graph_export.h"
+#include "../src/parser.h"
+#include "../src/workload.h"
+
+int main(int argc, char** argv) {
+    std::vector<std::string> files;
+    size_t repeat = 1;
+    bool lazy = false;
+    std::string dot, graph;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--repeat" && i + 1 < argc) {
+            repeat = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--lazy") {
+            lazy = true;
+        } else if (arg == "--dot" && i + 1 < argc) {
+            dot = argv[++i];
+        } else if (arg == "--graph" && i + 1 < argc) {
+            graph = argv[++i];
+        } else if (!arg.empty() && arg[0] != '-') {
+            files.push_back(arg);
+        } else {
+            files.clear();
+            break;
+        }
+    }
+    if (files.size() != 2 || !repeat) {
+        std::cerr << "usage: " << argv[0] << " MODEL WORKLOAD [--repeat N] [--lazy]"
+                  << " [--dot FILE] [--graph FILE]" << std::endl;
+        return 1;
+    }
+
+    try {
+        std::ifstream in(files[1].c_str(), std::ios::binary);
+        if (!in) throw std::runtime_error("Cannot open " + files[1]);
+        auto workload = Workload::Read(in);
+        auto context = lazy ? EvaluationParser::CreateLazyFromFile(files[0], {})
+                            : EvaluationParser::CreateFromFile(files[0]);
+        if (!dot.empty() || !graph.empty()) context.enableProfiling();
+        ContextBackend backend(context);
+        auto result = workload.replay(backend, repeat);
+        if (!dot.empty()) {
+            std::ofstream out(dot.c_str());
+            GraphExport::WriteDot(context, out);
+        }
+        if (!graph.empty()) {
+            std::ofstream out(graph.c_str());
+            GraphExport::WriteJson(context, out);
+        }
+
+        const auto& latency = result.calcLatency;
+        std::fprintf(stderr,
+                     "%llu operations (%llu calc) in %.3fs: %.0f ops/s, calc p50 %lluns "
+                     "p99 %lluns p99.9 %lluns max %lluns, %llu mismatches\n",
+                     static_cast<unsigned long long>(result.operations),
+                     static_cast<unsigned long long>(result.calcs), result.seconds,
+                     result.operations / result.seconds,
+                     static_cast<unsigned long long>(latency.percentile(50)),
+                     static_cast<unsigned long long>(latency.percentile(99)),
+                     static_cast<unsigned long long>(latency.percentile(99.9)),
+                     static_cast<unsigned long long>(latency.max()),
+                     static_cast<unsigned long long>(result.mismatches));
+        std::printf(
+            "{\"operations\": %llu, \"calcs\": %llu, \"seconds\": %.6f, "
+            "\"operations_per_second\": %.1f, \"calcs_per_second\": %.1f, "
+            "\"calc_mean_ns\": %.1f, \"calc_p50_ns\": %llu, \"calc_p99_ns\": %llu, "
+            "\"calc_p999_ns\": %llu, \"calc_max_ns\": %llu, \"mismatches\": %llu}\n",
+            static_cast<unsigned long long>(result.operations),
+            static_cast<unsigned long long>(result.calcs), result.seconds,
+            result.operations / result.seconds, result.calcs / result.seconds,
+            latency.mean(), static_cast<unsigned long long>(latency.percentile(50)),
+            static_cast<unsigned long long>(latency.percentile(99)),
+            static_cast<unsigned long long>(latency.percentile(99.9)),
+            static_cast<unsigned long long>(latency.max()),
+            static_cast<unsigned long long>(result.mismatches));
+        return result.mismatches ? 2 : 0;
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+}